@@ -0,0 +1,265 @@
+#!/usr/bin/env bash
+#
+# bench.sh - benchmark syncfile copy engines and change detection latency
+#
+# Copyright (c) 2003,2023,2025 by Landon Curt Noll.  All Rights Reserved.
+#
+# Permission to use, copy, modify, and distribute this software and
+# its documentation for any purpose and without fee is hereby granted,
+# provided that the above copyright, this permission notice and text
+# this comment, and the disclaimer below appear in all of the following:
+#
+#       supporting documentation
+#       source copies
+#       source works derived from this source
+#       binaries derived from this source or from derived source
+#
+# LANDON CURT NOLL DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+# INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+# EVENT SHALL LANDON CURT NOLL BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+# CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF
+# USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+# OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+# PERFORMANCE OF THIS SOFTWARE.
+#
+# chongo (Landon Curt Noll) /\oo/\
+#
+# http://www.isthe.com/chongo/index.html
+# https://github.com/lcn2
+#
+# Share and enjoy!  :-)
+#
+# usage:
+#	bench.sh [syncfile [dir]]
+#
+# Builds file sets under dir (def: $TMPDIR or /tmp), copies each set
+# with each -e engine, then measures how long a change to src takes to
+# reach dest when polling and when waiting with -w.  Results go to
+# stdout as tab separated lines, one per measurement:
+#
+#	copy	set	engine	files	octets	secs	user	sys	MB/s	cpu_ns/octet	engine_octets	status
+#	latency	mode	changes	mean_ms	p50_ms	p90_ms	max_ms	status
+#
+# engine_octets is the part of the set the engine copied itself; the
+# rest was copied by engines it fell back to.  A latency status of
+# timeout means a change did not reach dest within BENCH_TIMEOUT.
+# Copies start with a cold page cache only when run as root.  The
+# environment may change the size of the file sets:
+#
+#	BENCH_TINY	number of 4k files in the tiny set (def: 2000)
+#	BENCH_MID	number of 8m files in the mid set (def: 16)
+#	BENCH_LARGE	size of the large file in megabytes (def: 2048)
+#	BENCH_SPARSE	size of the sparse file in megabytes (def: 4096)
+#	BENCH_CHANGES	number of changes timed for each latency mode (def: 20)
+#	BENCH_ENGINES	engines to time (def: clone direct cfr uring sendfile rw)
+#	BENCH_TIMEOUT	seconds to wait for a change to reach dest (def: 30)
+
+export SYNCFILE="${1:-./syncfile}"
+export BENCH_TOP="${2:-${TMPDIR:-/tmp}}"
+export BENCH_TINY="${BENCH_TINY:-2000}"
+export BENCH_MID="${BENCH_MID:-16}"
+export BENCH_LARGE="${BENCH_LARGE:-2048}"
+export BENCH_SPARSE="${BENCH_SPARSE:-4096}"
+export BENCH_CHANGES="${BENCH_CHANGES:-20}"
+export BENCH_ENGINES="${BENCH_ENGINES:-clone direct cfr uring sendfile rw}"
+export BENCH_TIMEOUT="${BENCH_TIMEOUT:-30}"
+
+# engine label used by the -S stats file for each -e engine
+#
+declare -A ENGINE_NAME=(
+    [clone]=clone [direct]=O_DIRECT [cfr]=copy_file_range
+    [uring]=io_uring [sendfile]=sendfile [rw]=read/write
+)
+
+if [[ ! -x $SYNCFILE ]]; then
+    echo "$0: ERROR: syncfile not executable: $SYNCFILE" 1>&2
+    exit 1
+fi
+BENCH_DIR=$(mktemp -d "$BENCH_TOP/syncfile-bench.XXXXXX")
+status="$?"
+if [[ $status -ne 0 || ! -d $BENCH_DIR ]]; then
+    echo "$0: ERROR: cannot make a directory under: $BENCH_TOP" 1>&2
+    exit 2
+fi
+trap 'kill $SYNC_PID 2>/dev/null; rm -rf "$BENCH_DIR"' EXIT
+
+
+# make_sets - form the src file sets
+#
+make_sets() {
+    local i
+
+    mkdir -p "$BENCH_DIR/src/tiny" "$BENCH_DIR/src/mid" \
+	     "$BENCH_DIR/src/large" "$BENCH_DIR/src/sparse" || exit 3
+    head -c $((BENCH_TINY * 4096)) /dev/urandom > "$BENCH_DIR/tiny.all" || exit 4
+    for ((i=0; i < BENCH_TINY; ++i)); do
+	dd if="$BENCH_DIR/tiny.all" of="$BENCH_DIR/src/tiny/$((i % 64))-$i" \
+	   bs=4096 skip="$i" count=1 status=none || exit 5
+    done
+    rm -f "$BENCH_DIR/tiny.all"
+    for ((i=0; i < BENCH_MID; ++i)); do
+	head -c 8M /dev/urandom > "$BENCH_DIR/src/mid/$i" || exit 6
+    done
+    dd if=/dev/urandom of="$BENCH_DIR/src/large/0" bs=1M \
+       count="$BENCH_LARGE" status=none || exit 7
+
+    # sparse: 16 data extents of 1m spread over a mostly empty file
+    #
+    truncate -s "${BENCH_SPARSE}M" "$BENCH_DIR/src/sparse/0" || exit 8
+    for ((i=0; i < 16; ++i)); do
+	dd if=/dev/urandom of="$BENCH_DIR/src/sparse/0" bs=1M count=1 \
+	   seek=$((i * BENCH_SPARSE / 16)) conv=notrunc status=none || exit 9
+    done
+    sync
+}
+
+
+# bench_copy - copy a file set with an engine
+#
+# given:
+#	$1	file set
+#	$2	-e engine
+#
+bench_copy() {
+    local set="$1"
+    local engine="$2"
+    local files octets times secs user sys ok moved
+
+    rm -rf "$BENCH_DIR/dest" "$BENCH_DIR/stats"
+    mkdir -p "$BENCH_DIR/dest" || exit 10
+    files=$(find "$BENCH_DIR/src/$set" -type f | wc -l)
+    octets=$(find "$BENCH_DIR/src/$set" -type f -printf '%s\n' | awk '{n += $1} END {print n+0}')
+    sync
+    if [[ -w /proc/sys/vm/drop_caches ]]; then
+	echo 3 > /proc/sys/vm/drop_caches
+    fi
+
+    # time the copy: bash reports real, user and system seconds
+    #
+    times=$( { TIMEFORMAT='%R %U %S'; time "$SYNCFILE" -R -e "$engine" -S "$BENCH_DIR/stats" \
+		 "$BENCH_DIR/src/$set" "$BENCH_DIR/dest/$set" >/dev/null 2>&1; } 2>&1 )
+    read -r secs user sys <<< "$times"
+    if diff -r -q "$BENCH_DIR/src/$set" "$BENCH_DIR/dest/$set" >/dev/null 2>&1; then
+	ok=ok
+    else
+	ok=failed
+    fi
+    moved=$(awk -v e="${ENGINE_NAME[$engine]}" \
+		'index($0, "syncfile_copied_bytes_total{engine=\"" e "\"}") == 1 {print $2}' \
+		"$BENCH_DIR/stats" 2>/dev/null)
+    awk -v set="$set" -v engine="$engine" -v files="$files" -v octets="$octets" \
+	-v secs="$secs" -v user="$user" -v sys="$sys" -v moved="${moved:-0}" -v ok="$ok" 'BEGIN {
+	mbs = (secs > 0) ? octets / secs / 1000000 : 0;
+	cpu = (octets > 0) ? (user + sys) * 1e9 / octets : 0;
+	printf "copy\t%s\t%s\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.1f\t%.3f\t%d\t%s\n",
+	       set, engine, files, octets, secs, user, sys, mbs, cpu, moved, ok;
+    }'
+}
+
+
+# wait_same - wait for dest to have the contents of src
+#
+# given:
+#	$1	src
+#	$2	dest
+#
+# returns:
+#	0 ==> same contents, 1 ==> not within BENCH_TIMEOUT seconds
+#
+# Polls every 2 ms so that cmp does not compete for the CPU with the
+# syncfile being timed.
+#
+wait_same() {
+    local now="${EPOCHREALTIME/./}"
+    local deadline=$((now + BENCH_TIMEOUT * 1000000))
+
+    until cmp -s "$1" "$2"; do
+	now="${EPOCHREALTIME/./}"
+	if ((now > deadline)); then
+	    return 1
+	fi
+	sleep 0.002
+    done
+    return 0
+}
+
+
+# bench_latency - time changes to src reaching dest
+#
+# given:
+#	$1	mode: poll or wait
+#	$@	syncfile flags of the mode
+#
+# returns:
+#	0 ==> each change reached dest, 1 ==> timeout
+#
+bench_latency() {
+    local mode="$1"
+    local i start ms
+    local status=ok
+    local -a lags=()
+    shift
+
+    rm -f "$BENCH_DIR/lag.src" "$BENCH_DIR/lag.dest"
+    echo start > "$BENCH_DIR/lag.src"
+    "$SYNCFILE" "$@" -n 0 "$BENCH_DIR/lag.src" "$BENCH_DIR/lag.dest" >/dev/null 2>&1 &
+    SYNC_PID=$!
+    if ! wait_same "$BENCH_DIR/lag.src" "$BENCH_DIR/lag.dest"; then
+	echo "$0: ERROR: $mode first sync did not reach dest in $BENCH_TIMEOUT secs" 1>&2
+	status=timeout
+    fi
+
+    # replace src, then poll until dest has the new contents
+    #
+    # Each change has a new length: mod times only count whole seconds.
+    #
+    for ((i=0; i < BENCH_CHANGES; ++i)); do
+	[[ $status == ok ]] || break
+	printf 'change %0*d\n' $((i + 8)) "$i" > "$BENCH_DIR/lag.tmp"
+	start="$EPOCHREALTIME"
+	mv -f "$BENCH_DIR/lag.tmp" "$BENCH_DIR/lag.src"
+	if ! wait_same "$BENCH_DIR/lag.src" "$BENCH_DIR/lag.dest"; then
+	    echo "$0: ERROR: $mode change $i did not reach dest in $BENCH_TIMEOUT secs" 1>&2
+	    status=timeout
+	    break
+	fi
+	ms=$(awk -v a="$start" -v b="$EPOCHREALTIME" 'BEGIN {printf "%.3f", (b - a) * 1000}')
+	lags+=("$ms")
+	sleep 0.$((RANDOM % 90 + 10))
+    done
+    kill "$SYNC_PID" 2>/dev/null
+    wait "$SYNC_PID" 2>/dev/null
+    SYNC_PID=
+
+    printf '%s\n' "${lags[@]}" | sort -g | awk -v mode="$mode" -v ok="$status" '
+	NF { lag[NR] = $1; sum += $1; n = NR }
+	END {
+	    if (n == 0) {
+		printf "latency\t%s\t0\t0\t0\t0\t0\t%s\n", mode, ok;
+		exit;
+	    }
+	    printf "latency\t%s\t%d\t%.3f\t%.3f\t%.3f\t%.3f\t%s\n", mode, n, sum / n,
+		   lag[int((n + 1) / 2)], lag[int((n * 9 + 9) / 10)], lag[n], ok;
+	}'
+    [[ $status == ok ]]
+}
+
+
+# main
+#
+make_sets
+printf '# syncfile bench: %s in %s\n' "$("$SYNCFILE" -V)" "$BENCH_DIR"
+if [[ ! -w /proc/sys/vm/drop_caches ]]; then
+    printf '# page cache not dropped before copies: /proc/sys/vm/drop_caches is not writable\n'
+fi
+printf '# copy\tset\tengine\tfiles\toctets\tsecs\tuser\tsys\tMB/s\tcpu_ns/octet\tengine_octets\tstatus\n'
+for set in tiny mid large sparse; do
+    for engine in $BENCH_ENGINES; do
+	bench_copy "$set" "$engine"
+    done
+done
+printf '# latency\tmode\tchanges\tmean_ms\tp50_ms\tp90_ms\tmax_ms\tstatus\n'
+status=0
+bench_latency poll -t 0.1 || status=11
+bench_latency wait -w -t 60 || status=11
+exit "$status"
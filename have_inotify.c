@@ -0,0 +1,58 @@
+/*
+ * have_inotify - determine if we have the inotify system calls
+ *
+ * Copyright (c) 2026 by Landon Curt Noll.  All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software and
+ * its documentation for any purpose and without fee is hereby granted,
+ * provided that the above copyright, this permission notice and text
+ * this comment, and the disclaimer below appear in all of the following:
+ *
+ *       supporting documentation
+ *       source copies
+ *       source works derived from this source
+ *       binaries derived from this source or from derived source
+ *
+ * LANDON CURT NOLL DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL LANDON CURT NOLL BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF
+ * USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ * chongo (Landon Curt Noll) /\oo/\
+ *
+ * http://www.isthe.com/chongo/index.html
+ * https://github.com/lcn2
+ *
+ * Share and enjoy!  :-)
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+
+int
+main(int argc, char *argv[])
+{
+    int fd;			/* inotify descriptor */
+
+    /* create an inotify instance */
+    fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (fd < 0) {
+	exit(1);
+    }
+
+    /* watch the current directory */
+    if (inotify_add_watch(fd, ".", IN_CLOSE_WRITE|IN_MOVED_TO) < 0) {
+	exit(2);
+    }
+
+    /* All done!  -- Jessica Noll, Age 2 */
+    (void) close(fd);
+    exit(0);
+}
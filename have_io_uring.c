@@ -0,0 +1,71 @@
+/*
+ * have_io_uring - determine if we have the io_uring system calls
+ *
+ * Copyright (c) 2026 by Landon Curt Noll.  All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software and
+ * its documentation for any purpose and without fee is hereby granted,
+ * provided that the above copyright, this permission notice and text
+ * this comment, and the disclaimer below appear in all of the following:
+ *
+ *       supporting documentation
+ *       source copies
+ *       source works derived from this source
+ *       binaries derived from this source or from derived source
+ *
+ * LANDON CURT NOLL DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL LANDON CURT NOLL BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF
+ * USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ * chongo (Landon Curt Noll) /\oo/\
+ *
+ * http://www.isthe.com/chongo/index.html
+ * https://github.com/lcn2
+ *
+ * Share and enjoy!  :-)
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+int
+main(int argc, char *argv[])
+{
+    struct io_uring_params params;	/* ring setup parameters */
+    int ring_fd;			/* io_uring file descriptor */
+
+    /*
+     * set up a small ring
+     *
+     * The kernel headers may know about io_uring while the kernel
+     * (or a seccomp policy) does not allow it, so we must try the call.
+     * The ring must also use the IORING_OP_STATX operation.
+     */
+    memset(&params, 0, sizeof(params));
+    errno = 0;
+    ring_fd = (int)syscall(__NR_io_uring_setup, 4, &params);
+    if (ring_fd < 0) {
+	fprintf(stderr, "%s: io_uring_setup failed: %s\n",
+		argv[0], strerror(errno));
+	exit(1);
+    }
+    if (IORING_OP_STATX <= 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+	fprintf(stderr, "%s: io_uring is too old\n", argv[0]);
+	exit(2);
+    }
+
+    /* All done!  -- Jessica Noll, Age 2 */
+    (void) close(ring_fd);
+    exit(0);
+}
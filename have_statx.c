@@ -0,0 +1,69 @@
+/*
+ * have_statx - determine if we have the statx system call
+ *
+ * Copyright (c) 2026 by Landon Curt Noll.  All Rights Reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software and
+ * its documentation for any purpose and without fee is hereby granted,
+ * provided that the above copyright, this permission notice and text
+ * this comment, and the disclaimer below appear in all of the following:
+ *
+ *       supporting documentation
+ *       source copies
+ *       source works derived from this source
+ *       binaries derived from this source or from derived source
+ *
+ * LANDON CURT NOLL DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO
+ * EVENT SHALL LANDON CURT NOLL BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF
+ * USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *
+ * chongo (Landon Curt Noll) /\oo/\
+ *
+ * http://www.isthe.com/chongo/index.html
+ * https://github.com/lcn2
+ *
+ * Share and enjoy!  :-)
+ */
+
+
+#define _GNU_SOURCE	/* for statx */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+
+int
+main(int argc, char *argv[])
+{
+    struct statx stx;		/* statx of our directory */
+
+    /*
+     * statx the current directory
+     *
+     * The C library may have statx while the kernel (or a seccomp
+     * policy) does not allow it, so we must try the call.  We also
+     * want the nanosecond mod time that the statx mask asked for.
+     */
+    errno = 0;
+    if (statx(AT_FDCWD, ".", AT_STATX_SYNC_AS_STAT,
+	      STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME, &stx) < 0) {
+	fprintf(stderr, "%s: statx failed: %s\n", argv[0], strerror(errno));
+	exit(1);
+    }
+    if (!(stx.stx_mask & STATX_MTIME) || !S_ISDIR(stx.stx_mode)) {
+	fprintf(stderr, "%s: statx did not fill in the mask\n", argv[0]);
+	exit(2);
+    }
+
+    /* All done!  -- Jessica Noll, Age 2 */
+    exit(0);
+}
@@ -30,6 +30,8 @@
  */
 
 
+#define _GNU_SOURCE	/* for copy_file_range */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -41,19 +43,51 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <string.h>
-#include <utime.h>
 #include <sys/time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sched.h>
+#include <syslog.h>
+#include <signal.h>
+#include <sys/file.h>
 
 #include "have_sendfile.h"
 #if defined(HAVE_SENDFILE)
 #include <sys/sendfile.h>
 #endif
 
+#include "have_ficlone.h"
+#if defined(HAVE_FICLONE)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "have_copy_file_range.h"
+
+#include "have_io_uring.h"
+#if defined(HAVE_IO_URING)
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "have_statx.h"
+
+#include "have_inotify.h"
+#if defined(HAVE_INOTIFY)
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#endif
+
 
 /*
  * official version
  */
-#define VERSION "1.6.1 2025-03-24"          /* format: major.minor YYYY-MM-DD */
+#define VERSION "1.7.0 2026-10-16"          /* format: major.minor YYYY-MM-DD */
 
 
 /*
@@ -61,31 +95,584 @@
  */
 static int fork_flag = 0;	/* 1 ==> fork into background at start */
 static int verbose = 0;		/* output verbose messages */
+static char *log_file = NULL;	/* -v messages file, "syslog" ==> syslog, NULL ==> stdout */
 static int del_dest = 0;	/* 1 ==> delete dest is src file is gone */
 static int del_src = 0;		/* 1 ==> delete src is dest file is gone */
 static int trunc = 0;		/* 1 ==> touch/truncate instead deleting */
 static int dest_2_src = 0;	/* 1 ==> copy dest to src if dest is newer */
+static int watch = 0;		/* 1 ==> wait for inotify events between checks */
 static double interval = 60.0;	/* seconds between checks */
+static int64_t adapt_min = 0;	/* -A shortest check interval in nanoseconds, 0 ==> fixed */
+static int64_t adapt_max = 0;	/* -A longest check interval in nanoseconds */
+static int64_t settle = 0;	/* -q nanoseconds a src must go unwritten, 0 ==> copy at once */
 static int64_t count = 1;	/* number of checks, 0 ==> infinite */
 static char *suffix = ".new";	/* suffix when forming a new dest file */
-static char *src = NULL;	/* src sync file */
-static char *dest = NULL;	/* dest sync file */
+static int use_tmpfile = 0;	/* 1 ==> copy into an unnamed O_TMPFILE */
+static int resume = 0;		/* 1 ==> large copies can resume where they stopped */
+static int durability = 0;	/* durability of copies, DURABLE_NONE, etc. */
+static char *manifest = NULL;	/* manifest of src dest pairs, - ==> stdin */
+static int jobs = 0;		/* copy worker threads, 0 ==> copy in main loop */
+static off_t delta_bsize = 0;	/* delta block size, 0 ==> copy all of a file */
+static int content_hash = 0;	/* 1 ==> same length files are compared by digest */
+static int meta_sync = 0;	/* 1 ==> same contents only get the attributes synced */
+static char *cache_file = NULL;	/* digest cache file, NULL ==> no cache */
+static char *stats_file = NULL;	/* Prometheus stats file, NULL ==> no stats file */
+static int use_uring = 0;	/* 1 ==> batch checks and copy by io_uring */
+static int copy_threads = 1;	/* threads copying one large file, 0 ==> auto */
+static off_t chunk_size = 0;	/* octets a copy thread takes at a time, 0 ==> auto */
+static int page_policy = 0;	/* page cache policy of copies, PAGES_KEEP, etc. */
+static int force_engine = -1;	/* engine to start copies with, -1 ==> clone */
+static int tree = 0;		/* 1 ==> src and dest are directory trees */
+static int walkers = 1;		/* threads walking a -R tree */
 static uid_t uid;		/* 0 ==> we are the superuser, can chown */
 
 
+/*
+ * src dest pairs
+ *
+ * Each pair has its own flags and check interval.  All pairs are
+ * loaded before the first cycle, so the pairs[] array does not change
+ * size while we are syncing.
+ */
+struct pair {
+    char *src;			/* src sync file */
+    char *dest;			/* dest sync file */
+    char *new_src;		/* src.new temp filename */
+    char *new_dest;		/* dest.new temp filename */
+    char *src_base;		/* basename of src, points into src */
+    char *dest_base;		/* basename of dest, points into dest */
+    int src_dir;		/* index in dirs[] of the src directory */
+    int dest_dir;		/* index in dirs[] of the dest directory */
+    int fan_next;		/* index in pairs[] of the next pair with this src, itself if none */
+    double interval;		/* seconds between checks */
+    int64_t next_due;		/* CLOCK_MONOTONIC nanoseconds of next check */
+    int64_t period;		/* -A check interval before jitter, 0 ==> none yet */
+    int64_t settle_due;		/* -q CLOCK_MONOTONIC when a src settles, 0 ==> none */
+    int heap_pos;		/* index in heap[], -1 ==> no checks left */
+    int in_flight;		/* 1 ==> a worker is copying this pair */
+    int64_t retry_due;		/* -j CLOCK_MONOTONIC to check again after a change, 0 ==> none */
+    int retry_next;		/* -j next pair on pool_retry_list if retry_due, -1 ==> end */
+    int64_t checks;		/* number of checks performed */
+    unsigned int del_dest:1;	/* 1 ==> delete dest is src file is gone */
+    unsigned int del_src:1;	/* 1 ==> delete src is dest file is gone */
+    unsigned int trunc:1;	/* 1 ==> touch/truncate instead deleting */
+    unsigned int dest_2_src:1;	/* 1 ==> copy dest to src if dest is newer */
+    unsigned int settled:1;	/* 1 ==> batched statx found nothing to do */
+    unsigned int tree:1;	/* 1 ==> src and dest are directory trees */
+    unsigned int entry:1;	/* 1 ==> a file of a tree, copied by its walker */
+    unsigned int changed:1;	/* 1 ==> the last check copied, removed or truncated */
+};
+static struct pair *pairs = NULL;	/* src dest pairs to sync */
+static int npairs = 0;			/* number of pairs in use */
+static int maxpairs = 0;		/* number of pairs allocated */
+
+
+/*
+ * scheduler
+ *
+ * heap[] is a min-heap of pairs[] indices keyed on next_due, so that
+ * each wakeup only touches the pairs that are due.
+ *
+ * With -A, a pair is checked again adapt_min after a check that found a
+ * change, and its interval doubles after each quiet check up to
+ * adapt_max.  Each interval is moved by up to 1/ADAPT_JITTER of itself,
+ * either way, so that many syncfiles started together do not keep
+ * waking together.
+ */
+#define NSEC_PER_SEC ((int64_t)1000000000)
+#define ADAPT_JITTER 8			/* jitter is +/- 1/ADAPT_JITTER of the interval */
+static uint64_t jitter_state = 0;	/* xorshift64* state, 0 ==> not seeded */
+static int *heap = NULL;		/* pairs[] indices ordered by next_due */
+static int nheap = 0;			/* number of pairs in heap[] */
+static int *due = NULL;			/* pairs[] indices due this cycle */
+
+
+/*
+ * copy engines
+ *
+ * copy_file() tries the engines in this order, falling back to the next
+ * engine when an engine cannot copy between the two files.
+ *
+ * The from file is fstated after every CHANGE_WINDOW octets.  If it was
+ * written, the copy would be discarded anyway, so we stop copying and
+ * try again COPY_DEBOUNCE (or -q secs if longer) later.
+ */
+#define ENGINE_CLONE	0	/* ioctl FICLONE, shares extents */
+#define ENGINE_DIRECT	1	/* O_DIRECT read and write, only if -F direct */
+#define ENGINE_CFR	2	/* copy_file_range, copies within the kernel */
+#define ENGINE_URING	3	/* io_uring linked reads and writes, only if -U */
+#define ENGINE_SENDFILE	4	/* sendfile */
+#define ENGINE_RW	5	/* read and write via a buffer */
+#define ENGINE_CNT	6	/* number of engines */
+static const char * const engine_name[ENGINE_CNT] = {
+    "clone", "O_DIRECT", "copy_file_range", "io_uring", "sendfile", "read/write"
+};
+static const char * const engine_flag[ENGINE_CNT] = {	/* -e names */
+    "clone", "direct", "cfr", "uring", "sendfile", "rw"
+};
+#define COPY_DONE 0		/* engine copied the range */
+#define COPY_NEXT 1		/* engine cannot copy, try the next engine */
+#define COPY_FAIL (-1)		/* copy failed */
+#define RW_BUFSIZ (64*1024)	/* read/write engine buffer size */
+#define CHANGE_WINDOW ((off_t)32*1024*1024)	/* octets copied between fstats of the from file */
+#define COPY_DEBOUNCE NSEC_PER_SEC		/* wait before copying a changed from file again */
+#define LINK_TRIES 100				/* -O names tried when linking a temp file */
+#define LINK_NAME "%s.%d.%d"			/* -O temp name when taken: temp name, pid, try */
+
+
+/*
+ * page cache policy of copies (-F)
+ *
+ * PAGES_DROP copies DROP_WINDOW octets at a time.  Once a window is
+ * copied, writeback of the window starts, and the window before it,
+ * whose writeback has had a window of time to finish, is waited for and
+ * dropped from the page cache along with the same range of the from file.
+ * PAGES_DIRECT also copies files of DIRECT_MIN or more with O_DIRECT, so
+ * that their pages never enter the page cache.
+ */
+#define PAGES_KEEP 0		/* leave the page cache alone */
+#define PAGES_DROP 1		/* drop copied pages behind the copy */
+#define PAGES_DIRECT 2		/* O_DIRECT for large files, drop for the rest */
+#define PAGES_CNT 3		/* number of policies */
+static const char * const pages_name[PAGES_CNT] = {
+    "keep", "drop", "direct"
+};
+#define DROP_WINDOW ((off_t)8*1024*1024)	/* octets copied between drops */
+#define DIRECT_MIN ((off_t)64*1024*1024)	/* smallest file copied with O_DIRECT */
+#define DIRECT_ALIGN 4096			/* O_DIRECT offset, length and buffer alignment */
+#define DIRECT_BUFSIZ (1024*1024)		/* O_DIRECT engine buffer size */
+
+
+/*
+ * parallel copy of a large file (-P and -K)
+ *
+ * The temp file is preallocated, and then the copy threads take chunks
+ * of the file in turn, each thread copying its chunk at its own offset
+ * through its own open temp file.  Files smaller than PARALLEL_MIN are
+ * copied by one thread.
+ */
+#define PARALLEL_MIN ((off_t)64*1024*1024)	/* smallest file copied by threads */
+#define PARALLEL_MAX 8				/* most threads if -P 0 */
+#define CHUNK_MIN ((off_t)16*1024*1024)		/* smallest chunk if no -K */
+#define CHUNK_ALIGN ((off_t)1024*1024)		/* auto chunks are a multiple of this */
+#define CHUNKS_PER_THREAD 4			/* auto chunks per thread, to balance the load */
+struct chunk_copy {
+    int from_fd;		/* open file descriptor to copy from */
+    char *from;			/* name of file being copied from */
+    char *new_to;		/* temp filename, each thread opens its own */
+    off_t start;		/* first octet to copy */
+    off_t end;			/* octet after the last to copy */
+    off_t chunk;		/* octets in each chunk */
+    int engine;			/* first engine to try */
+    int64_t nchunks;		/* number of chunks */
+    int64_t next;		/* next chunk to take, atomic */
+    int failed;			/* 0 ==> no chunk failed, else copy_extents() return, atomic */
+};
+
+
+/*
+ * io_uring (-U)
+ *
+ * Each thread that uses io_uring forms its own ring on first use.  The
+ * main loop submits a statx of the src and dest of every due pair as
+ * one batch, and only opens the pairs that may need work.  The io_uring
+ * engine copies through URING_BUFS registered buffers: each buffer is
+ * filled by a read that is linked to the write that empties it, so a
+ * single io_uring_enter moves all of the buffers.
+ */
+#if defined(HAVE_IO_URING)
+#define URING_ENTRIES 256		/* submission queue entries, a power of 2 */
+#define URING_BUFS 8			/* registered buffers per ring */
+#define URING_BUFSIZ (256*1024)		/* octets per registered buffer */
+struct uring {
+    int fd;				/* io_uring descriptor */
+    unsigned int entries;		/* submission queue entries */
+    unsigned int tail;			/* our submission queue tail */
+    unsigned int pending;		/* entries not yet submitted */
+    unsigned int *sq_head;		/* submission queue head, kernel advances */
+    unsigned int *sq_tail;		/* submission queue tail, we advance */
+    unsigned int *sq_mask;		/* submission queue index mask */
+    struct io_uring_sqe *sqes;		/* submission queue entries */
+    unsigned int *cq_head;		/* completion queue head, we advance */
+    unsigned int *cq_tail;		/* completion queue tail, kernel advances */
+    unsigned int *cq_mask;		/* completion queue index mask */
+    struct io_uring_cqe *cqes;		/* completion queue entries */
+    char *bufs;				/* URING_BUFS buffers of URING_BUFSIZ octets */
+    int fixed;				/* 1 ==> bufs are registered with the ring */
+};
+static __thread struct uring *ring = NULL;	/* this thread's ring */
+static __thread int ring_failed = 0;		/* 1 ==> this thread has no ring */
+static struct statx due_stat[URING_ENTRIES];	/* statx of src and dest of due pairs */
+#endif
+
+
+/*
+ * content digest (-H)
+ *
+ * The digest is four CRC32C lanes: lane i covers every fourth 8 octet
+ * word starting with word i, and the octets of a final partial stripe
+ * go into lane 0.  The lanes are independent so the crc32 instructions
+ * of the SSE4.2 kernel overlap, and together they form a 128 bit digest.
+ */
+#define CRC32C_POLY 0x82f63b78		/* reflected CRC32C polynomial */
+#define DIGEST_LANES 4			/* CRC32C lanes in a digest */
+#define DIGEST_STRIPE (DIGEST_LANES*8)	/* octets of one word per lane */
+#define DIGEST_BUFSIZ (1024*1024)	/* octets read at a time, a multiple of DIGEST_STRIPE */
+#define SAME_BUFSIZ (1024*1024)	/* -M octets of each file read at a time */
+struct digest {
+    uint32_t lane[DIGEST_LANES];	/* CRC32C of each lane */
+};
+static uint32_t crc32c_table[8][256];	/* slicing-by-8 CRC32C tables */
+static void (*digest_kernel)(struct digest *d, const unsigned char *buf, size_t len);
+static const char *digest_kernel_name = NULL;	/* name of digest_kernel */
+
+
+/*
+ * digest cache (-C)
+ *
+ * The cache file is a header followed by a hash table of entries, one
+ * per file, keyed by a hash of the filename.  Each entry records the
+ * identity of the file when its digest was formed, so a file that has
+ * not changed since, even across restarts, is not read again.
+ */
+#define CACHE_MAGIC "syncfile digest cache 1\n"	/* cache file magic, 24 octets */
+struct cache_head {
+    char magic[24];		/* CACHE_MAGIC */
+    uint32_t slots;		/* number of entries, a power of 2 */
+    uint32_t unused;		/* pad to 32 octets */
+};
+struct cache_entry {
+    uint64_t key;		/* hash of filename, 0 ==> empty slot */
+    uint64_t dev;		/* device of file */
+    uint64_t ino;		/* inode of file */
+    int64_t size;		/* length of file */
+    int64_t mtime_ns;		/* nanosecond mod time of file */
+    int64_t ctime_ns;		/* nanosecond change time of file */
+    struct digest digest;	/* digest of file */
+};
+static void *cache_map = NULL;		/* mapped cache file */
+static struct cache_entry *cache = NULL;	/* cache entries, NULL ==> no cache */
+static uint32_t cache_mask = 0;		/* number of entries - 1 */
+
+
+/*
+ * resumable copies (-r)
+ *
+ * A file of RESUME_MIN or more is copied into its named temp file
+ * RESUME_STEP octets at a time.  After each step the temp file is
+ * fdatasynced, then the state file next to it records the identity of
+ * the from file and how much of the temp file is copied, along with a
+ * digest of all of the temp file before that point.  The digest runs
+ * from checkpoint to checkpoint, so each adds only its step, read back
+ * while it is likely still cached.  A copy that fails, or a process
+ * that is killed, leaves both files behind, and a later copy of the
+ * same, unchanged from file continues from there once the temp file
+ * still matches the digest.
+ */
+#define RESUME_MAGIC "syncfile resume state 2\n"	/* state file magic, 24 octets */
+#define RESUME_SUFFIX ".resume"			/* state filename is temp filename + this */
+#define RESUME_MIN ((off_t)64*1024*1024)	/* smallest file copied resumably */
+#define RESUME_STEP ((off_t)256*1024*1024)	/* octets copied between checkpoints */
+struct resume_state {
+    char magic[24];		/* RESUME_MAGIC */
+    uint64_t dev;		/* device of from file */
+    uint64_t ino;		/* inode of from file */
+    int64_t size;		/* length of from file */
+    int64_t mtime_ns;		/* nanosecond mod time of from file */
+    int64_t done;		/* octets of the temp file copied and synced */
+    struct digest check;	/* running digest, not yet finished, of the octets before done */
+};
+
+
+/*
+ * fan-out of one src to several dests
+ *
+ * A src given with more than one dest forms a pair for each dest, and
+ * the pairs are linked in a ring by fan_next.  When one of them copies
+ * the src, the other dests that also need it are copied at the same
+ * time.  Each is cloned from the src if it can be, otherwise it is
+ * filled from the temp file of the first dest, FAN_STEP octets at a
+ * time while that step is still in the page cache.  So the src is read
+ * once however many dests it has, and each dest is renamed into place
+ * on its own.
+ */
+#define FAN_STEP ((off_t)256*1024*1024)		/* octets copied to the other dests at a time */
+#define FAN_MAX 64				/* most dests on a manifest line */
+struct fan_dest {
+    int pair;			/* index in pairs[] of the pair of this dest */
+    char *new_to;		/* temp filename in same directory as to */
+    char *to;			/* filename being copied into */
+    int to_fd;			/* open temp file descriptor, -1 ==> none */
+    char *temp;			/* name to open the temp file by */
+    char fd_path[sizeof("/proc/self/fd/") + 3*sizeof(int)];	/* -O temp file */
+    int unnamed;		/* 1 ==> -O temp file has no name */
+    int cloned;			/* 1 ==> temp file is a clone of the from file */
+    int ret;			/* copy return, as copy_file() */
+};
+struct fan {
+    int n;			/* number of other dests */
+    off_t size;			/* number of octets to copy */
+    off_t done;			/* octets of the first temp file copied to the others */
+    struct fan_dest dest[];	/* the other dests */
+};
+
+
+/*
+ * durability of copies (-y)
+ *
+ * DURABLE_NONE renames a copy into place as soon as it is written and
+ * leaves the rest to writeback.  DURABLE_DATA fdatasyncs each temp file
+ * before its rename, so that a crash cannot leave an empty or zero
+ * filled dest.  DURABLE_FULL also makes the renames durable, a batch at
+ * a time: complete temp files wait in durable_batch[] until DURABLE_BATCH
+ * of them are ready, the checks of a cycle are done, or a copy worker
+ * finds the queue empty.  Then writeback of the whole batch is started
+ * at once, each file is fdatasynced, all are renamed, and each directory
+ * they were renamed in is fsynced once.  A dest whose copy is waiting
+ * is not copied again.
+ */
+#define DURABLE_NONE 0		/* no syncs */
+#define DURABLE_DATA 1		/* fdatasync each copy before its rename */
+#define DURABLE_FULL 2		/* also fsync the directory, in batches */
+#define DURABLE_CNT 3		/* number of levels */
+static const char * const durable_name[DURABLE_CNT] = {
+    "none", "data", "full"
+};
+#define DURABLE_BATCH 64	/* most copies in one group commit */
+struct durable {
+    int fd;			/* open temp file descriptor */
+    char *link_name;		/* malloced temp filename */
+    char *to;			/* malloced filename to rename it to */
+    char *from;			/* malloced name of the from file, for -C */
+    struct stat from_buf;	/* fstat of the from file, for -C */
+    int64_t detected;		/* CLOCK_MONOTONIC when the change was found, for -S */
+    int64_t copy_time;		/* nanoseconds the copy took, for -S */
+    int renamed;		/* 1 ==> synced and renamed into place */
+};
+static struct durable durable_batch[DURABLE_BATCH];	/* copies waiting for a commit */
+static int durable_len = 0;				/* copies in durable_batch[] */
+static pthread_mutex_t durable_lock = PTHREAD_MUTEX_INITIALIZER;	/* held while committing */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * statistics (-S)
+ *
+ * The counters and histograms are always kept, with relaxed atomic
+ * adds because copies run on workers and walkers.  With -S, the main
+ * loop rewrites the stats file in the Prometheus text format after a
+ * cycle, at most once every STATS_PERIOD, and at exit.
+ *
+ * Bucket i of a histogram counts the durations of at most 2^i
+ * microseconds, and the last bucket counts the rest (+Inf).
+ */
+#define STATS_PERIOD NSEC_PER_SEC	/* shortest time between stats file writes */
+#define HIST_BUCKETS 27			/* 1 usec to 2^25 usec (about 34 sec), and +Inf */
+struct histogram {
+    int64_t bucket[HIST_BUCKETS];	/* durations in each bucket */
+    int64_t count;			/* number of durations */
+    int64_t sum_ns;			/* sum of durations in nanoseconds */
+};
+struct stats {
+    int64_t cycles;			/* sync cycles run */
+    int64_t checks;			/* pair checks */
+    int64_t copies_started;		/* copies started or queued */
+    int64_t copies_completed;		/* copies renamed into place */
+    int64_t copies_failed;		/* copies that failed */
+    int64_t copies_discarded;		/* copies whose src changed during the copy */
+    int64_t attrs_synced;		/* -M files whose attributes were set instead of copied */
+    int64_t copies_resumed;		/* -r copies continued from a checkpoint */
+    int64_t resumed_bytes;		/* octets -r copies did not copy again */
+    int64_t bytes[ENGINE_CNT];		/* octets copied by each engine */
+    int64_t delta_bytes;		/* octets written by -B delta copies */
+    struct histogram copy_time;		/* time to copy and rename a file */
+    int64_t copy_time_max;		/* longest copy in nanoseconds */
+    struct histogram sync_lag;		/* time from finding a change to its rename */
+    int64_t sync_lag_max;		/* longest sync lag in nanoseconds */
+};
+static struct stats stats;		/* statistics */
+#define STAT_ADD(var, n) ((void) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED))
+
+
+/*
+ * asynchronous log (-v and -L)
+ *
+ * debug() formats its message into a slot of log_ring[] and returns
+ * without a system call.  The slot of position pos is free when its
+ * seq is the round of pos (pos & ~LOG_RING_MASK) and holds a message
+ * when its seq is one more.  Producers claim positions by compare and
+ * swap on log_tail.  Whoever holds log_lock is the one consumer: it
+ * writes the messages from log_head in order, then frees their slots for
+ * the next round.  The log thread sleeps on log_wake until a producer
+ * fills a slot, and a producer that finds the ring full drains it
+ * itself.  A producer signals log_wake only when log_sleeping says the
+ * log thread waits, so while the thread drains, debug() makes no system
+ * call.
+ *
+ * Messages are formatted by the producer, not the consumer, because
+ * a %s arg may be freed before the ring is drained.  A message too long
+ * for its slot ends in LOG_MORE.  Each message carries the wall clock
+ * time it was queued, so a clock step shows in the log as it happens.
+ */
+#define LOG_SLOTS 1024				/* ring slots, a power of 2 */
+#define LOG_RING_MASK ((uint64_t)LOG_SLOTS-1)	/* ring position to slot */
+#define LOG_MSG_MAX 496				/* longest message with its NUL */
+#define LOG_MORE "..."				/* end of a truncated message */
+struct log_msg {
+    uint64_t seq;			/* round of this slot, +1 ==> holds a message */
+    int64_t when;			/* CLOCK_REALTIME_COARSE of the message */
+    char text[LOG_MSG_MAX];		/* the formatted message */
+};
+static struct log_msg log_ring[LOG_SLOTS];	/* messages not yet written */
+static uint64_t log_tail = 0;		/* next position to claim */
+static uint64_t log_head = 0;		/* next position to write, under log_lock */
+static FILE *log_stream = NULL;		/* where messages go, NULL ==> syslog */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_sleeping = 0;		/* 1 ==> the log thread waits on log_wake */
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;	/* a slot was filled */
+
+
+/*
+ * copy worker pool (-j)
+ *
+ * The main loop queues copies and keeps checking pairs while the workers
+ * copy.  The queue is bounded: when it is full the main loop waits for a
+ * worker to take a job.  A pair is never queued while it is in flight.
+ */
+struct job {
+    int pair;			/* index in pairs[] of the pair being copied */
+    int from_fd;		/* open file descriptor to copy from */
+    struct stat from_buf;	/* fstat of from_fd */
+    char *from;			/* name of file being copied from */
+    char *new_to;		/* temp filename in same directory as to */
+    char *to;			/* filename being copied into */
+    struct fan *fan;		/* other dests of the from file, or NULL */
+    int64_t detected;		/* CLOCK_MONOTONIC when the change was found */
+};
+#define JOBS_PER_WORKER 4	/* queue slots per worker */
+static pthread_t *workers = NULL;	/* copy worker threads */
+static struct job *queue = NULL;	/* circular queue of copy jobs */
+static int queue_max = 0;		/* queue[] slots */
+static int queue_head = 0;		/* next job to take */
+static int queue_len = 0;		/* jobs in queue[] */
+static int pool_busy = 0;		/* jobs queued or being copied */
+static int pool_retry_list = -1;	/* first pair with a retry_due, -1 ==> none */
+static int pool_stop = 0;		/* 1 ==> workers exit when queue[] is empty */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;	/* a copy finished */
+
+
+/*
+ * directory tree walk (-R)
+ *
+ * A check of a tree pair walks the src and dest trees together.  Each
+ * walker has a deque of directory pairs to walk: a walker pushes and
+ * pops the subdirectories it finds at the bottom of its own deque, so
+ * it walks depth first, and an idle walker steals from the top of
+ * another deque, taking the shallowest and so likely largest subtree.
+ */
+#define WALK_BUFSIZ (64*1024)	/* getdents64 buffer size */
+#define COMM_LEN 17		/* /proc comm buffer, TASK_COMM_LEN and a NUL */
+struct walk_dir {
+    char *src;			/* src directory path */
+    char *dest;			/* dest directory path */
+};
+struct walk_deque {
+    pthread_mutex_t lock;	/* guards this deque */
+    struct walk_dir *dirs;	/* directory pairs to walk */
+    int top;			/* index of the top, the first to steal */
+    int bottom;			/* index after the bottom, the first to pop */
+    int max;			/* dirs[] slots */
+};
+struct walk {
+    struct pair *p;		/* tree pair being walked */
+    int nwalkers;		/* number of walkers */
+    struct walk_deque *deques;	/* deque of each walker */
+    int64_t pending;		/* directory pairs queued or being walked, atomic */
+    int64_t queued;		/* directory pairs queued, atomic */
+    pthread_mutex_t idle_lock;	/* guards waits for a directory pair to walk */
+    pthread_cond_t idle_cond;	/* signaled when one is queued or the walk is done */
+    int64_t ndirs;		/* directory pairs walked, atomic */
+    int64_t nfiles;		/* files found, atomic */
+    int64_t nsettled;		/* files that look similar without opening, atomic */
+    int changed;		/* 1 ==> a file was copied, removed or truncated, atomic */
+    int64_t settle_due;		/* -q earliest settle_due of a file, 0 ==> none, atomic */
+};
+struct walk_thread {
+    struct walk *w;		/* walk */
+    int id;			/* index of this walker in w->deques[] */
+};
+struct walk_list {
+    char *pool;			/* NUL terminated names */
+    size_t *names;		/* offset in pool of each name */
+    int nnames;			/* number of names */
+};
+
+
+/*
+ * directories that hold src and dest files
+ *
+ * Files are looked up, opened and renamed relative to the O_PATH
+ * descriptor of their directory.  A directory may be replaced under
+ * its path (mv dir dir.old; mkdir dir), so the main thread stats the
+ * path again every DIR_RECHECK, or at once when a file is missing, and
+ * reopens the descriptor when the path names another directory.  The
+ * new directory is dup3()ed onto the old descriptor, so a worker never
+ * uses a closed descriptor.  A directory that cannot be opened is used
+ * by its path.
+ */
+#define DIR_RECHECK NSEC_PER_SEC	/* time between stats of a directory path */
+struct dir {
+    char *path;			/* directory path */
+    int fd;			/* O_PATH descriptor or -1 ==> use the path */
+    int valid;			/* 1 ==> fd is the directory at path, atomic */
+    dev_t dev;			/* device of fd */
+    ino_t ino;			/* inode of fd */
+    int64_t recheck;		/* CLOCK_MONOTONIC time to stat the path again */
+    int wd;			/* inotify watch descriptor or -1 */
+};
+static struct dir *dirs = NULL;		/* src and dest directories */
+static int ndirs = 0;			/* number of dirs in use */
+static int maxdirs = 0;			/* number of dirs allocated */
+static int *dir_hash = NULL;		/* index in dirs[] of each path hash, or -1 */
+static unsigned int dir_mask = 0;	/* size of dir_hash[] - 1 */
+
+
+/*
+ * watch state (-w)
+ *
+ * Each pair has two endpoints: 2*i is the src and 2*i+1 is the dest of
+ * pairs[i].  The endpoints are hashed by watch descriptor and basename
+ * so that an inotify event finds its pairs without a scan of all pairs.
+ */
+#if defined(HAVE_INOTIFY)
+#define WATCH_MASK (IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE|IN_ATTRIB)
+static int watch_fd = -1;		/* inotify descriptor or -1 ==> not watching */
+static int timer_fd = -1;		/* timerfd for the next due pair */
+static int *watch_hash = NULL;		/* first endpoint of each hash chain or -1 */
+static int *watch_next = NULL;		/* next endpoint in hash chain or -1 */
+static unsigned int watch_mask = 0;	/* size of watch_hash[] - 1 */
+#endif
+
+
 /*
  * usage
  */
 static char *program = NULL;		/* our name */
 static char *prog = NULL;		/* basename of our name */
 static const char * const usage =
-    "usage: %s [-h] [-v] [-V] [-f] [-d] [-D] [-T] [-c] [-t secs] [-n cnt] [-s suffix] src dest\n"
+    "usage: %s [-h] [-v] [-V] [-f] [-w] [-d] [-D] [-T] [-c] [-t secs] [-A min:max] [-q secs] [-n cnt] [-j jobs] [-B bsize] [-H] [-M] [-C cache] [-U] [-P threads] [-K chunk] [-F policy] [-R] [-W walkers] [-S statsfile] [-e engine] [-L log] [-O] [-r] [-y level] [-s suffix] [-m manifest] [src dest ...]\n"
     "\n"
     "\t-h\t   print this message\n"
     "\t-v\t   output progress messages to stdout\n"
+    "\t-L log\t   output -v messages to the log file, syslog ==> syslog (implies -v)\n"
     "\t-V\t   print version string and exit\n"
     "\n"
     "\t-f\t   fork into background\n"
+    "\t-w\t   wait for src or dest to change between checks, -t is the rescan interval\n"
     "\n"
     "\t-d\t   delete dest when src file does not exist\n"
     "\t-D\t   delete src when dest file does not exist\n"
@@ -94,12 +681,38 @@ static const char * const usage =
     "\t-c\t   copy dest to src if dest is newer or src is gone (def: don't)\n"
     "\n"
     "\t-t secs\t   check interval (may be a float) (def: 60.0)\n"
+    "\t-A min:max  adapt the check interval: min secs after a change, doubling to max secs while quiet (def: -t)\n"
+    "\t-q secs\t   copy a src only once it has not been written for secs (may be a float) (def: 0.0)\n"
     "\t-n cnt\t   number of checks, 0 ==> infinite (def: 1)\n"
+    "\t-j jobs\t   copy with jobs worker threads while checking continues (def: 0, copy while checking)\n"
+    "\t-B bsize   write only the bsize blocks that differ into a clone, else a copy, of the old file (def: copy all)\n"
+    "\t-H\t   compare same length files by content digest, copy only if they differ,\n"
+    "\t\t   else set only the mode, owner and times if those differ\n"
+    "\t-M\t   compare same length files whose mode or mod time differ, and if their contents\n"
+    "\t\t   are the same only set the mode, owner and times instead of copying\n"
+    "\t-C cache   keep digests of unchanged files in the cache file (implies -H)\n"
+    "\t-U\t   batch checks and copy with io_uring (def: one system call at a time)\n"
+    "\t-P threads  copy files of 64m or more with threads at once, 0 ==> auto (def: 1)\n"
+    "\t-K chunk   octets a -P thread copies at a time (def: auto)\n"
+    "\t-F policy  page cache use of copies: keep, drop behind the copy, or\n"
+    "\t\t   direct: O_DIRECT for files of 64m or more and drop for the rest (def: keep)\n"
+    "\n"
+    "\t-R\t   src and dest are directories: sync each file of the trees\n"
+    "\t-W walkers  threads walking a -R tree (def: 1)\n"
+    "\n"
+    "\t-S statsfile  rewrite counters and latency histograms to statsfile in Prometheus text format\n"
+    "\t-e engine  copy with: clone (only), direct, cfr, uring, sendfile or rw (def: fastest that works)\n"
     "\n"
     "\t-s suffix  filename suffix when forming new files (def: .new)\n"
+    "\t-O\t   copy into an unnamed O_TMPFILE, fsync it, then link and rename it into place\n"
+    "\t-r\t   checkpoint copies of files of 64m or more in named temp files, resume them if interrupted\n"
+    "\t-y level   durability of copies: none, data: fdatasync each before its rename, or\n"
+    "\t\t   full: also fsync its directory, committing many copies at once (def: none)\n"
     "\n"
-    "\tsrc\t   src file\n"
-    "\tdest\t   destination file\n"
+    "\t-m manifest  sync each \"[-d] [-D] [-T] [-c] [-R] [-t secs] src dest ...\" line, - ==> stdin\n"
+    "\n"
+    "\tsrc\t   src file (required unless -m)\n"
+    "\tdest\t   destination file, more than one ==> src is read once for all of them (required unless -m)\n"
     "\n"
     "Exit codes:\n"
     "    0         all OK\n"
@@ -113,12 +726,154 @@ static const char * const usage =
 /*
  * forward declarations
  */
+static void sync_pair(struct pair *p);
+static void check_pair(struct pair *p, int *src_fd, int *dest_fd);
+static char *at_dir(int dir, char *base, char *path, int *dirfd);
+static char *at_path(char *path, int *dirfd);
+static int at_rename(char *from, char *to);
+static int probe_file(int dir, char *base, char *path, struct stat *buf);
+static int open_file(char *path, int *fd, struct stat *buf);
+static void start_copy(struct pair *p, int *from_fd, struct stat *from_buf,
+		       char *from, char *new_to, char *to);
+static void pool_start(void);
+static void *pool_worker(void *arg);
+static void pool_finish(void);
+static int pool_retry(void);
+static void tree_sync(struct pair *p);
+static void *tree_walker(void *arg);
+static void walk_push(struct walk *w, int id, char *src, char *dest);
+static int walk_take(struct walk *w, int id, struct walk_dir *dir);
+static void walk_subdir(struct walk *w, int id, char *src, struct stat *src_buf,
+			char *dest, struct stat *dest_buf);
+static void walk_dir(struct walk *w, int id, struct walk_dir *dir);
+static int temp_name(int fd, char *name, struct walk_list *list, struct walk_list *other);
+static int walk_find(struct walk_list *list, char *name, size_t len);
+static int read_comm(char *path, char *comm);
+static void walk_list(int fd, char *path, struct walk_list *list);
+static int walk_cmp(const void *a, const void *b, void *pool);
+static void walk_file(struct walk *w, struct walk_dir *dir, char *name);
+static char *path_cat(char *a, char *b, char *c);
+static void stats_copy(int ret, int64_t detected, int64_t started);
+static void hist_observe(struct histogram *h, int64_t *max, int64_t ns);
+static void stats_write(void);
+static void stats_hist(FILE *stream, char *name, char *help,
+		       struct histogram *h, int64_t max);
 static void pr_usage(FILE *stream);
 static void parse_args(int argc, char *argv[]);
-static void dsleep(double timeout);
+static struct pair *add_pair(char *src, char *dest);
+static void fan_join(int prev, int i);
+static void load_manifest(char *filename);
+static void setup_pairs(void);
+static int find_dir(char *path);
+static unsigned int dir_slot(char *path, size_t len);
+static int dir_lookup(char *path, size_t len);
+static int dir_open(int dir);
+static int dir_check(int dir, int force);
+static void split_path(char *path, char **dir, char **base);
+static void heap_push(int i);
+static int heap_pop(void);
+static void heap_fix(int i);
+static int64_t next_period(struct pair *p);
+static int64_t settle_wait(struct stat *buf);
+static int64_t now_nsec(void);
+static void sleep_until(int64_t when);
+#if defined(HAVE_INOTIFY)
+static unsigned int watch_hash_of(int wd, char *name);
+static void watch_setup(void);
+static void watch_rehash(void);
+static void watch_dir(int dir);
+static int watch_wait(int64_t until);
+static int watch_similar(struct pair *p);
+#endif
 static void debug(char *fmt, ...);
-static void copy_file(int from_fd, struct stat *src_buf,
+static void log_setup(void);
+static void log_start(void);
+static void *log_thread(void *arg);
+static void log_drain(void);
+static void log_finish(void);
+static int copy_file(int from_fd, struct stat *src_buf,
+		      char *from, char *new_to, char *to, struct fan *fan,
+		      int64_t detected, int64_t started);
+static int temp_finish(int to_fd, struct stat *src_buf, char *from, char *temp,
+		       int unnamed, char *new_to, char *to, int64_t detected, int64_t started);
+static struct fan *fan_collect(struct pair *p, struct stat *from_buf);
+static int fan_wants(struct pair *s, struct stat *from_buf);
+static void fan_open(struct fan *fan, int from_fd, off_t size);
+static void fan_copy(struct fan *fan, int to_fd, char *temp, off_t end);
+static void fan_finish(struct fan *fan, struct stat *src_buf, char *from,
+		       int64_t detected, int64_t started);
+static void fan_discard(struct fan *fan, int ret);
+static void fan_stats(struct fan *fan, int64_t detected, int64_t started);
+static void fan_release(struct fan *fan);
+static void durable_add(int fd, char *link_name, char *to, char *from, struct stat *from_buf,
+			int64_t detected, int64_t started);
+static int durable_pending(char *to);
+static void durable_flush(void);
+static void durable_commit(void);
+static int from_changed(int from_fd, struct stat *buf);
+static int temp_open(char *to);
+static char *temp_link(char *fd_path, char *new_to);
+static void temp_discard(int to_fd, char *new_to, int unnamed);
+static char *resume_name(char *new_to);
+static int resume_open(struct stat *src_buf, char *new_to, struct resume_state *rs);
+static int resume_save(int to_fd, char *new_to, struct resume_state *rs, off_t done);
+static int resume_check(int fd, off_t start, off_t done, char *name, struct digest *d);
+static void resume_remove(char *new_to);
+static int copy_data(int from_fd, int to_fd, off_t size, char *from, char *new_to,
+		     struct resume_state *rs, struct fan *fan);
+static int copy_engine(off_t size);
+static int parallel_plan(off_t size, off_t *chunk);
+static int copy_parallel(int from_fd, int to_fd, off_t start, off_t end, char *from,
+			 char *new_to, int engine, int nthreads, off_t chunk);
+static void *chunk_worker(void *arg);
+static int copy_delta(int from_fd, struct stat *from_buf, int to_fd,
 		      char *from, char *new_to, char *to);
+static int delta_hole(int from_fd, char *blk, off_t offset, size_t len);
+static ssize_t pread_full(int fd, char *buf, size_t len, off_t offset);
+static off_t parse_size(char *arg, char *flag);
+static void digest_setup(void);
+static void digest_sw(struct digest *d, const unsigned char *buf, size_t len);
+#if defined(__x86_64__) && defined(__GNUC__)
+static void digest_sse42(struct digest *d, const unsigned char *buf, size_t len);
+#endif
+static int file_digest(int fd, off_t size, char *name, struct digest *d);
+static void cache_setup(void);
+static struct cache_entry *cache_slot(uint64_t key);
+static uint64_t cache_key(char *name);
+static int cached_digest(int fd, struct stat *buf, char *name, struct digest *d);
+static int same_data(int src_fd, struct stat *src_buf, char *src,
+		     int dest_fd, struct stat *dest_buf, char *dest);
+static int sync_attrs(int to_fd, struct stat *from_buf, char *from, char *to);
+static int cache_valid(struct cache_entry *e, struct stat *buf);
+static void cache_store(char *name, struct stat *buf, struct digest *d);
+static void cache_copied(char *from, struct stat *from_buf, char *to);
+#if defined(HAVE_IO_URING)
+static struct uring *uring_ring(void);
+static void uring_discard(struct uring *r);
+static struct io_uring_sqe *uring_sqe(struct uring *r);
+static int uring_wait(struct uring *r, unsigned int want);
+static int uring_reap(struct uring *r, uint64_t *user_data, int *res);
+static void uring_stat_due(int ndue);
+#endif
+static int same_contents(int src_fd, struct stat *src_buf, char *src,
+			 int dest_fd, struct stat *dest_buf, char *dest);
+static int copy_extents(int from_fd, int to_fd, off_t start, off_t end,
+			char *from, char *new_to, int engine);
+static int copy_range(int from_fd, int to_fd, off_t start, off_t end,
+		      char *from, char *new_to, int engine);
+static void drop_behind(int from_fd, int to_fd, off_t *dropped, off_t *started,
+			off_t done, int last);
+static int copy_by_cfr(int from_fd, int to_fd, off_t *offset, off_t end,
+		       char *from, char *new_to);
+static int next_engine(int engine);
+static int copy_by_direct(int from_fd, int to_fd, off_t *offset, off_t end,
+			  char *from, char *new_to);
+static int copy_by_uring(int from_fd, int to_fd, off_t *offset, off_t end,
+			 char *from, char *new_to);
+static int copy_by_sendfile(int from_fd, int to_fd, off_t *offset, off_t end,
+			    char *from, char *new_to);
+static int copy_by_rw(int from_fd, int to_fd, off_t *offset, off_t end,
+		      char *from, char *new_to);
 
 
 int
@@ -126,36 +881,109 @@ main(int argc, char *argv[])
 {
     pid_t pid;			/* pid of child or 0 (parent) or < 0 (error) */
     int64_t cycle_num = 0;	/* next cycle number */
-
-    struct stat src_buf;	/* src status */
-    int src_exists;		/* 1 ==> src exists, 0 ==> missing */
-    int src_fd = -1;		/* open src descriptor or -1 => no file */
-    char *new_src = NULL;	/* src.new temp filename */
-
-    struct stat dest_buf;	/* dest status */
-    int dest_exists;		/* 1 ==> dest exists, 0 ==> missing */
-    int dest_fd = -1;		/* open dest descriptor or -1 => no file */
-    char *new_dest = NULL;	/* dest.new temp filename */
+    struct pair *p;		/* current pair */
+    int64_t now;		/* current CLOCK_MONOTONIC time */
+    int64_t next;		/* when the next pair is due */
+    int64_t wake;		/* when to wake up, no later than next */
+    int busy;			/* 1 ==> -j copies are queued or in flight */
+    int64_t period;		/* check interval in nanoseconds */
+    int64_t stats_due = 0;	/* CLOCK_MONOTONIC of the next stats file write */
+    int ndue;			/* number of pairs in due[] */
+    int i;
+    int j;
 
     /*
      * parse args
      */
     program = argv[0];
     parse_args(argc, argv);
+    log_setup();
     uid = geteuid();
+    digest_setup();
     if (verbose) {
-	debug("sync from: %s", src);
-	debug("sync to: %s", dest);
-	debug("check interval: %f sec", interval);
+	for (i=0; i < npairs; ++i) {
+	    p = &pairs[i];
+	    if (p->tree) {
+		debug("sync tree from: %s", p->src);
+		debug("sync tree to: %s", p->dest);
+	    } else {
+		debug("sync from: %s", p->src);
+		debug("sync to: %s", p->dest);
+	    }
+	    if (adapt_min > 0) {
+		debug("adaptive check interval: %f to %f sec",
+		      (double)adapt_min / (double)NSEC_PER_SEC,
+		      (double)adapt_max / (double)NSEC_PER_SEC);
+	    } else {
+		debug("check interval: %f sec", p->interval);
+	    }
+	    if (p->trunc) {
+		debug("truncate dest if src is missing: %d", p->del_dest);
+		debug("truncate src if dest is missing: %d", p->del_src);
+	    } else {
+		debug("delete dest if src is missing: %d", p->del_dest);
+		debug("delete src if dest is missing: %d", p->del_src);
+	    }
+	}
+	if (settle > 0) {
+	    debug("copy a src once unwritten for: %f sec",
+		  (double)settle / (double)NSEC_PER_SEC);
+	}
 	debug("number of checks: %ld", count);
-	if (trunc) {
-	    debug("truncate dest if src is missing: %d", del_dest);
-	    debug("truncate src if dest is missing: %d", del_src);
-	} else {
-	    debug("delete dest if src is missing: %d", del_dest);
-	    debug("delete src if dest is missing: %d", del_src);
+	if (jobs > 0) {
+	    debug("copy worker threads: %d", jobs);
+	}
+	if (delta_bsize > 0) {
+	    debug("delta block size: %lld", (long long)delta_bsize);
+	}
+	if (content_hash) {
+	    debug("compare contents with the %s digest kernel", digest_kernel_name);
+	}
+	if (cache_file != NULL) {
+	    debug("digest cache: %s", cache_file);
+	}
+	if (use_uring) {
+	    debug("will batch checks and copy with io_uring");
+	}
+	if (copy_threads != 1) {
+	    if (copy_threads == 0) {
+		debug("threads copying a large file: auto");
+	    } else {
+		debug("threads copying a large file: %d", copy_threads);
+	    }
+	    if (chunk_size > 0) {
+		debug("copy thread chunk size: %lld", (long long)chunk_size);
+	    }
+	}
+	if (page_policy != PAGES_KEEP) {
+	    debug("page cache policy of copies: %s", pages_name[page_policy]);
+	}
+	if (walkers > 1) {
+	    debug("threads walking a tree: %d", walkers);
+	}
+	if (stats_file != NULL) {
+	    debug("stats file: %s", stats_file);
+	}
+	if (force_engine >= 0) {
+	    debug("copy engine: %s", engine_name[force_engine]);
+	}
+	if (log_file != NULL) {
+	    debug("log: %s", log_file);
 	}
 	debug("new dest file suffux: %s", suffix);
+	if (use_tmpfile) {
+	    debug("will copy into unnamed temp files");
+	}
+	if (resume) {
+	    debug("will resume interrupted copies of files of %lld octets or more",
+		  (long long)RESUME_MIN);
+	}
+	if (durability != DURABLE_NONE) {
+	    debug("durability of copies: %s", durable_name[durability]);
+	}
+	if (watch) {
+	    debug("will wait for src or dest changes between checks");
+	}
 	if (uid == 0) {
 	    debug("will also set ownership and group of file");
 	}
@@ -172,7 +1000,12 @@ main(int argc, char *argv[])
     if (fork_flag) {
 
 	/* fork me :-) */
-	debug("forking into background, debug disabled on child");
+	if (log_file == NULL) {
+	    debug("forking into background, debug disabled on child");
+	} else {
+	    debug("forking into background, child logs to: %s", log_file);
+	}
+	log_finish();
 	errno = 0;
 	pid = fork();
 	if (pid < 0) {
@@ -186,236 +1019,217 @@ main(int argc, char *argv[])
 	}
 
 	/* child code from now on */
-	verbose = 0;
+	if (log_file == NULL) {
+	    verbose = 0;
+	}
     }
 
     /*
-     * form temp filenames
+     * write -v messages in the background
      */
-    new_src = (char *)malloc(strlen(src) + strlen(suffix) + 1);
-    if (new_src == NULL) {
-	fprintf(stderr, "%s: new_src malloc failed\n", program);
-	exit(11);
+    if (verbose) {
+	log_start();
     }
-    sprintf(new_src, "%s%s", src, suffix);
-    new_dest = (char *)malloc(strlen(dest) + strlen(suffix)) + 1;
-    if (new_dest == NULL) {
-	fprintf(stderr, "%s: new_dest malloc failed\n", program);
-	exit(12);
+
+    /*
+     * form temp filenames and note the src and dest directories
+     */
+    setup_pairs();
+
+    /*
+     * map the digest cache if -C
+     */
+    if (cache_file != NULL) {
+	cache_setup();
     }
-    sprintf(new_dest, "%s%s", dest, suffix);
 
     /*
-     * sync cycle
+     * watch the src and dest directories if -w
      */
-    debug("stating cycle 0");
-    do {
+#if defined(HAVE_INOTIFY)
+    if (watch) {
+	watch_setup();
+    }
+#endif
 
-	/* close any open files */
-	if (src_fd >= 0) {
-	    (void) close(src_fd);
-	    src_fd = -1;
-	}
-	if (dest_fd >= 0) {
-	    (void) close(dest_fd);
-	    dest_fd = -1;
-	}
+    /*
+     * start the copy workers if -j
+     */
+    if (jobs > 0) {
+	pool_start();
+    }
 
-	/* sleep if not first cycle */
-	if (cycle_num > 0) {
-	    if (interval > 0.0) {
-		debug("sleeping for %f seconds", interval);
-		dsleep(interval);
-	    }
-	    debug("stating cycle %lld", cycle_num);
-	}
+    /*
+     * sync cycle
+     *
+     * Every pair is due at the start.  Each cycle checks the pairs that
+     * are due, and then sleeps (or waits for a change if -w) until the
+     * next pair is due.  Pairs with no checks left leave the heap.
+     */
+    heap = (int *)malloc(npairs * sizeof(heap[0]));
+    if (heap == NULL) {
+	fprintf(stderr, "%s: heap malloc failed\n", program);
+	exit(27);
+    }
+    due = (int *)malloc(npairs * sizeof(due[0]));
+    if (due == NULL) {
+	fprintf(stderr, "%s: due malloc failed\n", program);
+	exit(40);
+    }
+    now = now_nsec();
+    for (i=0; i < npairs; ++i) {
+	pairs[i].next_due = now;
+	heap_push(i);
+    }
+    while (nheap > 0) {
+	debug("stating cycle %lld", cycle_num);
 	++cycle_num;
+	STAT_ADD(stats.cycles, 1);
+
+	/* collect the pairs that are due */
+	now = now_nsec();
+	ndue = 0;
+	while (nheap > 0 && pairs[heap[0]].next_due <= now) {
+	    due[ndue++] = heap_pop();
+	}
 
 	/*
-	 * attempt to open both files
-	 *
-	 * We use open files because we can fstat the descriptor knowing
-	 * that we are talking about the file that we opened.  I.e., someone
-	 * cannot move the file between a stat and open.  We also
-	 * use sendfile which needs at least the src file descriptor.
+	 * -U: statx the due pairs in batches so that we open only the
+	 * pairs that may need work.  Contents decide when -H, so every
+	 * pair must be opened and we do not batch.
 	 */
-	src_fd = open(src, O_RDWR);
-	if (src_fd < 0) {
-	    if (access(src, F_OK) == 0) {
-		debug("src exists but is not readable: %s", src);
-		continue;
+#if defined(HAVE_IO_URING)
+	if (use_uring && !content_hash) {
+	    uring_stat_due(ndue);
+	}
+#endif
+
+	/* check the pairs that are due */
+	for (j=0; j < ndue; ++j) {
+	    i = due[j];
+	    p = &pairs[i];
+	    if (p->settled) {
+		debug("src: %s and dest: %s look similar", p->src, p->dest);
+		p->changed = 0;
 	    } else {
-		/* no such file */
-		src_exists = 0;
-		memset(&src_buf, 0, sizeof(src_buf));
-		debug("src file is missing: %s", src);
+		sync_pair(p);
 	    }
-	} else {
-	    src_exists = 1;
-	    if (fstat(src_fd, &src_buf) < 0) {
-		/* stat filed, assume file does not exist */
-		close(src_fd);
-		src_exists = 0;
-		memset(&src_buf, 0, sizeof(src_buf));
-		debug("src fstat failed, assume it is missing: %s", src);
-	    } else {
-		debug("src file exists: %s", src);
+	    /* -q: a check that held back a src that had not settled does not count */
+	    if (p->settle_due <= 0) {
+		++p->checks;
 	    }
-	}
-	dest_fd = open(dest, O_RDWR);
-	if (dest_fd < 0) {
-	    if (access(dest, F_OK) == 0) {
-		debug("dest exists but is not readable: %s", dest);
+	    STAT_ADD(stats.checks, 1);
+	    if (count > 0 && p->checks >= count) {
+		/* no checks left, unless pool_retry() asks for one more */
 		continue;
-	    } else {
-		/* no such file */
-		dest_exists = 0;
-		memset(&dest_buf, 0, sizeof(dest_buf));
-		debug("dest file is missing: %s", dest);
 	    }
-	} else {
-	    dest_exists = 1;
-	    if (fstat(dest_fd, &dest_buf) < 0) {
-		/* stat filed, assume file does not exist */
-		close(dest_fd);
-		dest_exists = 0;
-		memset(&dest_buf, 0, sizeof(dest_buf));
-		debug("dest fstat failed, assume it is missing: %s", dest);
+
+	    /*
+	     * The next check is due one interval after this check was due,
+	     * not one interval after it finished, so checks do not drift.
+	     * Checks we are too late for are skipped.
+	     */
+	    if (adapt_min > 0) {
+		period = next_period(p);
 	    } else {
-		debug("dest file exists: %s", dest);
+		period = (int64_t)(p->interval * (double)NSEC_PER_SEC);
+	    }
+	    if (period <= 0) {
+		period = 1;
+	    }
+	    p->next_due += period;
+	    if (p->next_due <= now) {
+		p->next_due += ((now - p->next_due) / period + 1) * period;
 	    }
-	}
-
-	/* nothing to do if both files are missing, unless -T */
-	if (!src_exists && !dest_exists) {
-	    debug("both src and dest are missing");
-	    continue;
-	}
-
-	/* ignore if any existing file is NOT a regular file */
-	if (src_exists && !S_ISREG(src_buf.st_mode)) {
-	    debug("src: %s is not a regular file", src);
-	    continue;
-	}
-	if (dest_exists && !S_ISREG(dest_buf.st_mode)) {
-	    debug("dest: %s is not a regular file", dest);
-	    continue;
-	}
-
-	/* deal with a missing src file */
-	if (!src_exists) {
-
-	    /* remove dest if src is missing and -d */
-	    if (del_dest) {
-		debug("src is missing and -d was given");
-		errno = 0;
-		if (unlink(dest) < 0) {
-		    debug("unable to remove dest: %s: %s",
-			  dest, strerror(errno));
-		} else {
-		    debug("removed dest: %s", dest);
-		}
 
-	    /* touch / truncate both files if -T (src is missing) */
-	    } else if (trunc) {
-		if (ftruncate(dest_fd, (off_t)0) < 0) {
-		    debug("unable to truncate dest: %s: %s",
-			  dest, strerror(errno));
-		} else {
-		    debug("truncated dest: %s", dest);
-		    errno = 0;
-		    src_fd = open(src, O_RDWR|O_CREAT|O_TRUNC,
-				  dest_buf.st_mode);
-		    if (src_fd < 0) {
-			debug("unable to create empty src: %s: %s",
-			      src, strerror(errno));
-		    } else {
-			debug("created empty src: %s", src);
-		    }
+	    /* -q: check again as soon as a src we held back settles */
+	    if (p->settle_due > 0) {
+		if (p->settle_due < p->next_due) {
+		    p->next_due = p->settle_due;
 		}
-
-	    /* no src and no -d and no -T, so nothing to do */
-	    } else {
-		debug("src is missing");
+		p->settle_due = 0;
 	    }
-	    continue;
+	    heap_push(i);
 	}
 
-	/* deal with a missing dest file */
-	if (!dest_exists) {
-
-	    /* remove src if dest is missing and -D */
-	    if (del_src) {
-		debug("dest is missing and -D was given");
-		errno = 0;
-		if (unlink(src) < 0) {
-		    debug("unable to remove src: %s: %s",
-			  src, strerror(errno));
-		} else {
-		    debug("removed src: %s", src);
-		}
-
-	    /* touch / truncate both files if -T and dest is missing */
-	    } else if (trunc) {
-		if (ftruncate(src_fd, (off_t)0) < 0) {
-		    debug("unable to truncate src: %s: %s",
-			  src, strerror(errno));
-		} else {
-		    debug("truncated src: %s", src);
-		    errno = 0;
-		    dest_fd = open(dest, O_RDWR|O_CREAT|O_TRUNC,
-				   src_buf.st_mode);
-		    if (dest_fd < 0) {
-			debug("unable to create empty dest: %s: %s",
-			      dest, strerror(errno));
-		    } else {
-			debug("created empty dest: %s", dest);
-		    }
-		}
-
-	    /* no dest and no -D and no -T, so nothing to do */
-	    } else {
-		debug("dest is missing");
+	/* -y full: commit the copies of this cycle */
+	if (durability == DURABLE_FULL) {
+	    durable_flush();
+	}
+	/*
+	 * -j: with no checks left, wait for the copies in flight, as a
+	 * from file that changed during its copy is checked once more
+	 */
+	if (nheap <= 0 && jobs > 0) {
+	    pthread_mutex_lock(&pool_lock);
+	    while (pool_busy > 0 && pool_retry_list < 0) {
+		pthread_cond_wait(&pool_done, &pool_lock);
 	    }
-	    continue;
+	    pthread_mutex_unlock(&pool_lock);
+	    (void) pool_retry();
 	}
-
-	/* copy src to dest if dest is missing and no -D */
-	if (!dest_exists && !del_src) {
-	    debug("src: %s exists and dest: %s is missing", src, dest);
-	    copy_file(src_fd, &src_buf, src, new_dest, dest);
-	    continue;
+	if (nheap <= 0) {
+	    break;
 	}
 
-	/* copy dest to src if src is missing and -b and no -d */
-	if (!src_exists && dest_2_src && !del_dest) {
-	    debug("dest: %s exists and src: %s is missing", dest, src);
-	    copy_file(dest_fd, &dest_buf, dest, new_src, src);
-	    continue;
+	/* -S: rewrite the stats file, but not too often */
+	if (stats_file != NULL && now >= stats_due) {
+	    stats_write();
+	    stats_due = now + STATS_PERIOD;
 	}
 
-	/* different modes, lengths, or mod times means we copy something */
-	if (src_exists && dest_exists &&
-	    (src_buf.st_mode != dest_buf.st_mode ||
-	     src_buf.st_size != dest_buf.st_size ||
-	     src_buf.st_mtime != dest_buf.st_mtime)) {
-
-	    /* -b means we copy dest to src if dest is newer */
-	    debug("src: %s and dest: %s are different", src, dest);
-	    if (dest_2_src && src_buf.st_mtime < dest_buf.st_mtime) {
-		debug("dest: %s is newer, copying to src: %s", dest, src);
-		copy_file(dest_fd, &dest_buf, dest, new_src, src);
-	    } else {
-		debug("copying to src: %s to dest: %s", src, dest);
-		copy_file(src_fd, &src_buf, src, new_dest, dest);
+	/*
+	 * sleep, or wait for a change if -w, until the next pair is due
+	 *
+	 * -j: while copies are in flight, wake every COPY_DEBOUNCE to
+	 * schedule the pairs whose from file changed during their copy.
+	 */
+	for (;;) {
+	    busy = (jobs > 0) ? pool_retry() : 0;
+	    next = pairs[heap[0]].next_due;
+	    now = now_nsec();
+	    if (next <= now) {
+		break;
+	    }
+	    wake = (busy && now + COPY_DEBOUNCE < next) ? now + COPY_DEBOUNCE : next;
+#if defined(HAVE_INOTIFY)
+	    if (watch) {
+		debug("waiting up to %f seconds for a change",
+		      (double)(wake - now) / (double)NSEC_PER_SEC);
+		if (watch_wait(wake) > 0) {
+		    debug("change detected");
+		    break;
+		}
+		debug("no change detected, rescanning");
+	    } else
+#endif
+	    {
+		debug("sleeping for %f seconds",
+		      (double)(wake - now) / (double)NSEC_PER_SEC);
+		sleep_until(wake);
+	    }
+	    if (wake >= next) {
+		break;
 	    }
-	    continue;
 	}
+    }
 
-	/* src and dest must be identical or similar */
-	debug("src and dest look similar");
+    /*
+     * wait for any copies in flight
+     */
+    if (jobs > 0) {
+	pool_finish();
+    }
+    if (durability == DURABLE_FULL) {
+	durable_flush();
+    }
 
-    } while (count == 0 || cycle_num < count);
+    /*
+     * final stats
+     */
+    if (stats_file != NULL) {
+	stats_write();
+    }
 
     /*
      * all done!  -- Jessica Noll, Age 2
@@ -425,426 +1239,7576 @@ main(int argc, char *argv[])
 
 
 /*
- * pr_usage - print usage message
+ * sync_pair - check a src dest pair once and sync them if needed
  *
  * given:
- *
- *    stream - print usage message on stream, NULL ==> stderr
+ *	p	pair to check
  */
 static void
-pr_usage(FILE *stream)
+sync_pair(struct pair *p)
 {
+    int src_fd = -1;		/* open src descriptor or -1 => no file */
+    int dest_fd = -1;		/* open dest descriptor or -1 => no file */
+    int in_flight;		/* 1 ==> a worker is copying this pair */
+
     /*
-     * NULL stream means stderr
+     * firewall
      */
-    if (stream == NULL) {
-        stream = stderr;
+    if (p == NULL) {
+	fprintf(stderr, "%s: sync_pair called with NULL ptr\n", program);
+	exit(20);
     }
 
     /*
-     * firewall - change program if NULL
+     * do not check a pair while a worker is copying it
      */
-    if (program == NULL) {
-        program = "((NULL))";
+    if (jobs > 0) {
+	pthread_mutex_lock(&pool_lock);
+	in_flight = p->in_flight;
+	pthread_mutex_unlock(&pool_lock);
+	if (in_flight) {
+	    debug("copy in flight: %s ==> %s", p->src, p->dest);
+	    return;
+	}
     }
 
     /*
-     * firewall set name if NULL
+     * check the pair, or each file of a tree pair
      */
-    if (prog == NULL) {
-        prog = rindex(program, '/');
-    }
-    /* paranoia if no / is found */
-    if (prog == NULL) {
-        prog = program;
-    } else {
-	++prog;
+    p->changed = 0;
+    if (p->tree) {
+	tree_sync(p);
+	return;
     }
+    check_pair(p, &src_fd, &dest_fd);
 
     /*
-     * print usage message to stderr
+     * close any open files
      */
-    fprintf(stream, usage, program, prog, VERSION);
+    if (src_fd >= 0) {
+	(void) close(src_fd);
+    }
+    if (dest_fd >= 0) {
+	(void) close(dest_fd);
+    }
+    return;
 }
 
 
 /*
- * parse_args - parse command args
+ * check_pair - compare a src dest pair and sync them if they differ
  *
  * given:
- *	argc	number of args to parse
- *	argv	command arg list
+ *	p		pair to check
+ *	src_fd		where to store the open src descriptor or -1
+ *	dest_fd		where to store the open dest descriptor or -1
+ *
+ * The caller closes any descriptor left open.
  */
 static void
-parse_args(int argc, char *argv[])
+check_pair(struct pair *p, int *src_fd, int *dest_fd)
 {
-    extern char *optarg;	/* option argument */
-    extern int optind;		/* argv index of the next arg */
-    char *p;
-    int i;
+    struct stat src_buf;	/* src status */
+    int src_exists;		/* 1 ==> src exists, 0 ==> missing */
+    struct stat dest_buf;	/* dest status */
+    int dest_exists;		/* 1 ==> dest exists, 0 ==> missing */
+    int different;		/* 1 ==> src and dest differ */
+    int ret;			/* sync_attrs() return */
 
     /*
-     * parse command flags
+     * look at both files without opening them
+     *
+     * Most checks find nothing to do, so we statx each file by name in
+     * the O_PATH descriptor of its directory, which also leaves atime
+     * alone.  Files are opened read-only only when they must be read,
+     * and fstat of the open descriptor replaces the statx so that we
+     * copy with the status of the file we actually opened.
+     *
+     * Read-only opens mean that closing the files does not generate
+     * an IN_CLOSE_WRITE event that would wake up -w.
      */
-    while ((i = getopt(argc, argv, "hvVfdDTct:n:s:")) != -1) {
-	switch (i) {
-	case 'h':	/* print help message */
-	    pr_usage(stderr);
-	    exit(2); /*ooo*/
-	    /*NOTREACHED*/
-	case 'v':	/* verbose output */
-	    verbose = 1;
-	    break;
-	case 'V':	/* verbose output */
-	    printf("%s\n", VERSION);
-	    exit(2); /*ooo*/
-	    /*NOTREACHED*/
-	case 'f':	/* fork info background */
-	    fork_flag = 1;
-	    break;
-	case 'd':	/* delete dest when src file does not exist */
-	    del_dest = 1;
-	    break;
-	case 'D':	/* delete src when dest file does not exist */
-	    del_src = 1;
-	    break;
-	case 'T':	/* truncate/touch both files of one file is missing */
-	    trunc = 1;
-	    break;
-	case 'c':	/* cp dest to src if dest is newer */
-	    dest_2_src = 1;
-	    break;
-	case 't':
+    switch (probe_file(p->src_dir, p->src_base, p->src, &src_buf)) {
+    case 1:
+	src_exists = 1;
+	debug("src file exists: %s", p->src);
+	break;
+    case 0:
+	src_exists = 0;
+	debug("src file is missing: %s", p->src);
+	break;
+    default:
+	debug("cannot stat src: %s: %s", p->src, strerror(errno));
+	return;
+    }
+    switch (probe_file(p->dest_dir, p->dest_base, p->dest, &dest_buf)) {
+    case 1:
+	dest_exists = 1;
+	debug("dest file exists: %s", p->dest);
+	break;
+    case 0:
+	dest_exists = 0;
+	debug("dest file is missing: %s", p->dest);
+	break;
+    default:
+	debug("cannot stat dest: %s: %s", p->dest, strerror(errno));
+	return;
+    }
+
+    /* nothing to do if both files are missing, unless -T */
+    if (!src_exists && !dest_exists) {
+	debug("both src and dest are missing");
+	return;
+    }
+
+    /* ignore if any existing file is NOT a regular file */
+    if (src_exists && !S_ISREG(src_buf.st_mode)) {
+	debug("src: %s is not a regular file", p->src);
+	return;
+    }
+    if (dest_exists && !S_ISREG(dest_buf.st_mode)) {
+	debug("dest: %s is not a regular file", p->dest);
+	return;
+    }
+
+    /* deal with a missing src file */
+    if (!src_exists) {
+
+	/* remove dest if src is missing and -d */
+	if (p->del_dest) {
+	    debug("src is missing and -d was given");
 	    errno = 0;
-	    interval = strtod(optarg, NULL);
-	    if (errno == ERANGE) {
-		fprintf(stderr, "%s: invalid -t interval value\n", program);
-		exit(3); /*ooo*/
-		/*NOTREACHED*/
-	    } else if (interval <= 0.0) {
-		fprintf(stderr,
-			"%s: -t interval value must be > 0.0\n", program);
-		exit(3); /*ooo*/
-		/*NOTREACHED*/
+	    if (unlink(p->dest) < 0) {
+		debug("unable to remove dest: %s: %s",
+		      p->dest, strerror(errno));
+	    } else {
+		debug("removed dest: %s", p->dest);
+		p->changed = 1;
 	    }
-	    break;
-	case 'n':
+
+	/* touch / truncate both files if -T (src is missing) */
+	} else if (p->trunc) {
 	    errno = 0;
-	    count = strtoll(optarg, NULL, 0);
-	    if (errno == ERANGE) {
-		fprintf(stderr, "%s: invalid -n count value\n", program);
-		exit(3); /*ooo*/
-		/*NOTREACHED*/
-	    } else if (count < 0) {
-		fprintf(stderr, "%s: -n count must be >= 0\n", program);
-		exit(3); /*ooo*/
-		/*NOTREACHED*/
+	    if (truncate(p->dest, (off_t)0) < 0) {
+		debug("unable to truncate dest: %s: %s",
+		      p->dest, strerror(errno));
+	    } else {
+		debug("truncated dest: %s", p->dest);
+		p->changed = 1;
+		errno = 0;
+		*src_fd = open(p->src, O_RDWR|O_CREAT|O_TRUNC,
+			      dest_buf.st_mode);
+		if (*src_fd < 0) {
+		    debug("unable to create empty src: %s: %s",
+			  p->src, strerror(errno));
+		} else {
+		    debug("created empty src: %s", p->src);
+		}
 	    }
-	    break;
-	case 's':	/* new file suffix */
-	    suffix = optarg;
-	    for (p=suffix; *p; ++p) {
-		if (!isascii(*p) || (!isalnum(*p) && *p != '.' && *p != '_' &&
-		    *p != '+' && *p != ',' && *p != '-')) {
-		    fprintf(stderr,
-			    "%s: -s suffux must only be [A-Za-z0-9._+,-]\n",
-			    program);
-		    exit(3); /*ooo*/
-		    /*NOTREACHED*/
+
+	/* copy dest to src if -c */
+	} else if (p->dest_2_src) {
+	    debug("dest: %s exists and src: %s is missing", p->dest, p->src);
+	    start_copy(p, dest_fd, &dest_buf, p->dest, p->new_src, p->src);
+
+	/* no src and no -d, -T or -c, so nothing to do */
+	} else {
+	    debug("src is missing");
+	}
+	return;
+    }
+
+    /* deal with a missing dest file */
+    if (!dest_exists) {
+
+	/* remove src if dest is missing and -D */
+	if (p->del_src) {
+	    debug("dest is missing and -D was given");
+	    errno = 0;
+	    if (unlink(p->src) < 0) {
+		debug("unable to remove src: %s: %s",
+		      p->src, strerror(errno));
+	    } else {
+		debug("removed src: %s", p->src);
+		p->changed = 1;
+	    }
+
+	/* touch / truncate both files if -T and dest is missing */
+	} else if (p->trunc) {
+	    errno = 0;
+	    if (truncate(p->src, (off_t)0) < 0) {
+		debug("unable to truncate src: %s: %s",
+		      p->src, strerror(errno));
+	    } else {
+		debug("truncated src: %s", p->src);
+		p->changed = 1;
+		errno = 0;
+		*dest_fd = open(p->dest, O_RDWR|O_CREAT|O_TRUNC,
+			       src_buf.st_mode);
+		if (*dest_fd < 0) {
+		    debug("unable to create empty dest: %s: %s",
+			  p->dest, strerror(errno));
+		} else {
+		    debug("created empty dest: %s", p->dest);
 		}
 	    }
+
+	/* no dest and no -D and no -T, so copy src to dest */
+	} else {
+	    debug("src: %s exists and dest: %s is missing", p->src, p->dest);
+	    start_copy(p, src_fd, &src_buf, p->src, p->new_dest, p->dest);
+	}
+	return;
+    }
+
+    /* different modes, lengths, or mod times means we copy something */
+    different = (src_exists && dest_exists &&
+		 (src_buf.st_mode != dest_buf.st_mode ||
+		  src_buf.st_size != dest_buf.st_size ||
+		  src_buf.st_mtime != dest_buf.st_mtime));
+
+    /*
+     * -H means the contents of same length files decide, and -M that
+     * they decide for same length files that would otherwise be copied.
+     * Same contents with a different mode or mod time only need the
+     * attributes, so the pair converges and is not compared again.
+     */
+    if ((content_hash || (meta_sync && different)) && src_exists && dest_exists &&
+	src_buf.st_size == dest_buf.st_size) {
+	if (open_file(p->src, src_fd, &src_buf) < 0 ||
+	    open_file(p->dest, dest_fd, &dest_buf) < 0) {
+	    return;
+	}
+	switch (content_hash ?
+		same_contents(*src_fd, &src_buf, p->src, *dest_fd, &dest_buf, p->dest) :
+		same_data(*src_fd, &src_buf, p->src, *dest_fd, &dest_buf, p->dest)) {
+	case 1:
+	    if (different) {
+		debug("src: %s and dest: %s have the same contents", p->src, p->dest);
+	    }
+
+	    /*
+	     * the file we would copy into only needs the attributes,
+	     * and if we cannot set them, a copy will
+	     */
+	    if (different) {
+		if (p->dest_2_src && src_buf.st_mtime < dest_buf.st_mtime) {
+		    ret = sync_attrs(*src_fd, &dest_buf, p->dest, p->src);
+		} else {
+		    ret = sync_attrs(*dest_fd, &src_buf, p->src, p->dest);
+		}
+		if (ret < 0) {
+		    break;
+		}
+		p->changed = 1;
+	    }
+	    different = 0;
+	    break;
+	case 0:
+	    different = 1;
 	    break;
 	default:
-	    pr_usage(stderr);
-	    exit(3); /*ooo*/
-	    /*NOTREACHED*/
+	    /* unable to tell, so mode, length and mod time decide */
+	    break;
 	}
     }
-    if (trunc && (del_dest || del_src)) {
-	fprintf(stderr, "%s: -T conflicts with -d and -D", program);
-	exit(3); /*ooo*/
-	/*NOTREACHED*/
+    if (different) {
+
+	/* -b means we copy dest to src if dest is newer */
+	debug("src: %s and dest: %s are different", p->src, p->dest);
+	if (p->dest_2_src && src_buf.st_mtime < dest_buf.st_mtime) {
+	    debug("dest: %s is newer, copying to src: %s", p->dest, p->src);
+	    start_copy(p, dest_fd, &dest_buf, p->dest, p->new_src, p->src);
+	} else {
+	    debug("copying to src: %s to dest: %s", p->src, p->dest);
+	    start_copy(p, src_fd, &src_buf, p->src, p->new_dest, p->dest);
+	}
+	return;
     }
 
+    /* src and dest must be identical or similar */
+    debug("src and dest look similar");
+}
+
+
+/*
+ * at_dir - return the name to look up a file by, and the directory it is in
+ *
+ * given:
+ *	dir	index in dirs[] of the directory of the file, or -1
+ *	base	basename of the file
+ *	path	path of the file
+ *	dirfd	where to store the directory descriptor or AT_FDCWD
+ *
+ * returns:
+ *	base, relative to *dirfd, or path if the directory is not open
+ */
+static char *
+at_dir(int dir, char *base, char *path, int *dirfd)
+{
     /*
-     * parse flags
+     * firewall
      */
-    if (optind+2 != argc) {
-	fprintf(stderr, "%s: required to args are missing\n", program);
-	pr_usage(stderr);
-	exit(3); /*ooo*/
-	/*NOTREACHED*/
-    } else {
-	src = argv[optind];
-	dest = argv[optind+1];
+    if (path == NULL || dirfd == NULL) {
+	fprintf(stderr, "%s: at_dir called with NULL ptr\n", program);
+	exit(78);
     }
-    return;
+
+    if (dir >= 0 && dir < ndirs && base != NULL &&
+	__atomic_load_n(&dirs[dir].valid, __ATOMIC_ACQUIRE)) {
+	*dirfd = dirs[dir].fd;
+	return base;
+    }
+    *dirfd = AT_FDCWD;
+    return path;
 }
 
 
 /*
- * dsleep - sleep for a double number of seconds
+ * at_path - return the name to open a file by, and the directory it is in
  *
  * given:
- *	timeout		seconds to sleep as a float
+ *	path	path of the file
+ *	dirfd	where to store the directory descriptor or AT_FDCWD
+ *
+ * returns:
+ *	basename of path, relative to *dirfd, or path if its directory
+ *	is not one of dirs[]
+ *
+ * Copies open and rename their files with this, so that they see
+ * the same directory that probe_file() looked in.
  */
-static void
-dsleep(double timeout)
+static char *
+at_path(char *path, int *dirfd)
 {
-    struct timespec delay;	/* time to sleep */
-    struct timespec remaining;	/* time left to sleep */
+    char *p;			/* last / in path */
 
     /*
-     * setup to sleep
+     * firewall
      */
-    delay.tv_sec = (time_t)timeout;
-    delay.tv_nsec = (long)((timeout - (double)(delay.tv_sec)) * 1000000000.0);
-    remaining.tv_sec = (time_t)0;
-    remaining.tv_nsec = (long)0;
+    if (path == NULL || dirfd == NULL) {
+	fprintf(stderr, "%s: at_path called with NULL ptr\n", program);
+	exit(104);
+    }
 
     /*
-     * sleep until finished
+     * split on the last / as split_path() does
      */
-    do {
-	/* sleep for the specified time */
-	errno = 0;
-	if (nanosleep(&delay, &remaining) < 0) {
-	    delay = remaining;
-	    remaining.tv_sec = (time_t)0;
-	    remaining.tv_nsec = (long)0;
-	}
-    } while (errno == EINTR);
-    return;
+    p = rindex(path, '/');
+    if (p == NULL) {
+	return at_dir(dir_lookup(".", 1), path, path, dirfd);
+    } else if (p == path) {
+	return at_dir(dir_lookup("/", 1), p+1, path, dirfd);
+    }
+    return at_dir(dir_lookup(path, p-path), p+1, path, dirfd);
 }
 
 
 /*
- * debug - print debug message (if -v) to stdout
+ * at_rename - rename a file, each name in the directory at_path() finds
  *
  * given:
- *	fmt	printf-like format of the main part of the debug message
- *	...	optional debug message args
+ *	from	path of the file to rename
+ *	to	path to rename it to
+ *
+ * returns:
+ *	0 ==> renamed, -1 ==> error (errno set)
  */
-static void
-debug(char *fmt, ...)
+static int
+at_rename(char *from, char *to)
 {
-    struct timeval now;		/* the current time */
-    va_list ap;		/* argument pointer */
+    int from_dirfd;		/* directory of from or AT_FDCWD */
+    int to_dirfd;		/* directory of to or AT_FDCWD */
+    char *from_name;		/* from in from_dirfd */
+    char *to_name;		/* to in to_dirfd */
 
-    /* only output if verbose (-v) */
-    if (verbose) {
-
-	/* output debug header */
-	(void) gettimeofday(&now, NULL);
-	fprintf(stdout, "%s:%f: ",
-		program,
-		(double)now.tv_sec + ((double)now.tv_usec / 1000000.0));
+    /*
+     * firewall
+     */
+    if (from == NULL || to == NULL) {
+	fprintf(stderr, "%s: at_rename called with NULL ptr\n", program);
+	exit(109);
+    }
 
-	/* start the var arg setup and fetch our first arg */
-	va_start(ap, fmt);
+    from_name = at_path(from, &from_dirfd);
+    to_name = at_path(to, &to_dirfd);
+    errno = 0;
+    return renameat(from_dirfd, from_name, to_dirfd, to_name);
+}
 
-	/* output debug message */
-	vfprintf(stdout, fmt, ap);
 
-	/* clean up stdarg stuff */
-	va_end(ap);
+/*
+ * probe_file - find the type, mode, length and mod time of a file
+ *
+ * given:
+ *	dir	index in dirs[] of the directory of the file, or -1
+ *	base	basename of the file
+ *	path	path of the file
+ *	buf	where to store the status, zeroed if the file is missing
+ *
+ * returns:
+ *	1 ==> file exists, 0 ==> file is missing, -1 ==> cannot tell (errno set)
+ *
+ * Only the fields that checks compare are filled in.
+ */
+static int
+probe_file(int dir, char *base, char *path, struct stat *buf)
+{
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* name to look up in dirfd */
+#if defined(HAVE_STATX)
+    struct statx stx;		/* statx of the file */
+#endif
 
-	/* output end of debug message */
-	fputc('\n', stdout);
-	fflush(stdout);
+    /*
+     * firewall
+     */
+    if (buf == NULL) {
+	fprintf(stderr, "%s: probe_file called with NULL ptr\n", program);
+	exit(79);
     }
-    return;
+
+    /*
+     * stat the file by name, and if it is missing, look again in
+     * case its directory was replaced
+     */
+    (void) dir_check(dir, 0);
+    do {
+	name = at_dir(dir, base, path, &dirfd);
+	memset(buf, 0, sizeof(*buf));
+	errno = 0;
+#if defined(HAVE_STATX)
+	if (statx(dirfd, name, AT_STATX_SYNC_AS_STAT,
+		  STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME, &stx) == 0) {
+	    buf->st_mode = stx.stx_mode;
+	    buf->st_size = (off_t)stx.stx_size;
+	    buf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	    buf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	    return 1;
+	}
+#else
+	if (fstatat(dirfd, name, buf, 0) == 0) {
+	    return 1;
+	}
+#endif
+	if (errno != ENOENT && errno != ENOTDIR) {
+	    return -1;
+	}
+    } while (dirfd != AT_FDCWD && dir_check(dir, 1));
+    return 0;
 }
 
 
 /*
- * copy_file - copy from one file to another in a safe atomic fashion
+ * open_file - open a file read-only and fstat it
  *
  * given:
- *	from_fd		open file descriptor to copy from
- *	src_buf		pointer to fstat of from_fd
- *	from		name of file being copied from
- *	new_to		temp filename in same directory as to
- *	to		filename being copied into
- *
- * We copy into a temp filename and then rename it to the destination.
- * This means that the to file will never contain a partial copy
- * of the from file.  The to file will either have its original contents
- * or the contents of the from file ... nothing in between.
+ *	path	file to open
+ *	fd	where to store the open descriptor, -1 ==> not opened
+ *	buf	where to store the fstat of *fd
  *
- * This function also sets the modification time of the to file
- * to match the from file.
+ * returns:
+ *	0 ==> opened, -1 ==> not opened
  */
-static void
-copy_file(int from_fd, struct stat *src_buf, char *from, char *new_to, char *to)
+static int
+open_file(char *path, int *fd, struct stat *buf)
 {
-    int to_fd = -1;		/* new_to open file descriptor */
-    size_t count;		/* bytes left to transfer */
-    ssize_t written;		/* bytes written */
-    struct utimbuf timebuf;	/* access and modification time to set */
-#if defined(HAVE_SENDFILE)
-    off_t offset = (off_t)0;	/* starting offset of transfer */
-#else
-    int readcnt;		/* bytes read from from */
-    char buf[BUFSIZ+1];		/* I/O buffer */
-#endif
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* name to open in dirfd */
 
     /*
      * firewall
      */
-    if (from_fd < 0) {
-	fprintf(stderr, "%s: copy_file from_fd < 0: %d\n", program, from_fd);
-	exit(13);
-    }
-    if (src_buf == NULL || from == NULL || new_to == NULL || to == NULL) {
-	fprintf(stderr, "%s: called with NULL ptr\n", program);
-	exit(14);
+    if (path == NULL || fd == NULL || buf == NULL) {
+	fprintf(stderr, "%s: open_file called with NULL ptr\n", program);
+	exit(80);
     }
 
     /*
-     * open the temp from file
+     * open and fstat the file
      */
-    debug("opening temp file: %s", new_to);
+    name = at_path(path, &dirfd);
     errno = 0;
-    to_fd = open(new_to, O_CREAT|O_EXCL|O_TRUNC|O_WRONLY, src_buf->st_mode);
-    if (to_fd < 0) {
-	debug("unable to open temp file: %s: %s", new_to, strerror(errno));
-	return;
+    *fd = openat(dirfd, name, O_RDONLY);
+    if (*fd < 0) {
+	debug("cannot open: %s: %s", path, strerror(errno));
+	return -1;
+    }
+    if (fstat(*fd, buf) < 0) {
+	debug("cannot fstat: %s: %s", path, strerror(errno));
+	(void) close(*fd);
+	*fd = -1;
+	return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * start_copy - copy a file now, or queue the copy for a worker if -j
+ *
+ * given:
+ *	p		pair being copied
+ *	from_fd		pointer to open file descriptor to copy from, or -1
+ *	from_buf	pointer to fstat of from_fd, or statx of from
+ *	from		name of file being copied from
+ *	new_to		temp filename in same directory as to
+ *	to		filename being copied into
+ *
+ * If *from_fd is -1, we open from and fstat it into *from_buf.
+ *
+ * When the copy is queued, the worker owns the descriptor: *from_fd is
+ * set to -1 so that the caller does not close it.
+ */
+static void
+start_copy(struct pair *p, int *from_fd, struct stat *from_buf,
+	   char *from, char *new_to, char *to)
+{
+    struct job *job;		/* queued job */
+    struct fan *fan;		/* other dests of the src, or NULL */
+    int64_t detected;		/* CLOCK_MONOTONIC when the change was found */
+    int64_t wait;		/* -q nanoseconds until the from file settles */
+    int ret;			/* copy_file() return */
+
+    /*
+     * firewall
+     */
+    if (p == NULL || from_fd == NULL || from_buf == NULL) {
+	fprintf(stderr, "%s: start_copy called with NULL ptr\n", program);
+	exit(32);
+    }
+
+    /*
+     * -y full: the last copy to this file is not yet renamed into place
+     */
+    if (durability == DURABLE_FULL && durable_pending(to)) {
+	debug("copy to %s is waiting for a group commit", to);
+	return;
+    }
+
+    /*
+     * open the from file, unless -H already read it
+     */
+    if (*from_fd < 0 && open_file(from, from_fd, from_buf) < 0) {
+	return;
+    }
+
+    /*
+     * -q: hold back a from file that is still being written
+     */
+    p->changed = 1;
+    detected = now_nsec();
+    if (settle > 0) {
+	wait = settle_wait(from_buf);
+	if (wait > 0) {
+	    debug("%s written in the last %f sec, waiting %f sec for it to settle",
+		  from, (double)settle / (double)NSEC_PER_SEC,
+		  (double)wait / (double)NSEC_PER_SEC);
+	    if (p->settle_due <= 0 || detected + wait < p->settle_due) {
+		p->settle_due = detected + wait;
+	    }
+	    return;
+	}
+    }
+
+    /*
+     * a src with several dests is copied to the others that need it too
+     */
+    fan = (from == p->src) ? fan_collect(p, from_buf) : NULL;
+    STAT_ADD(stats.copies_started, 1 + ((fan == NULL) ? 0 : fan->n));
+
+    /*
+     * copy now if we have no workers, or if we are walking a tree
+     */
+    if (jobs <= 0 || p->entry) {
+	ret = copy_file(*from_fd, from_buf, from, new_to, to, fan, detected, detected);
+	stats_copy(ret, detected, detected);
+	fan_stats(fan, detected, detected);
+	fan_release(fan);
+	if (ret > 0) {
+	    /* the from file changed, check again once it may have settled */
+	    p->settle_due = now_nsec() + ((settle > COPY_DEBOUNCE) ? settle : COPY_DEBOUNCE);
+	}
+	return;
+    }
+
+    /*
+     * queue the copy, waiting for room if the queue is full
+     */
+    pthread_mutex_lock(&pool_lock);
+    if (p->in_flight) {
+	pthread_mutex_unlock(&pool_lock);
+	debug("copy in flight: %s ==> %s", from, to);
+	fan_release(fan);
+	return;
+    }
+    while (queue_len >= queue_max) {
+	debug("copy queue is full, waiting");
+	pthread_cond_wait(&pool_not_full, &pool_lock);
+    }
+    job = &queue[(queue_head + queue_len) % queue_max];
+    job->pair = p - pairs;
+    job->from_fd = *from_fd;
+    job->from_buf = *from_buf;
+    job->from = from;
+    job->new_to = new_to;
+    job->to = to;
+    job->fan = fan;
+    job->detected = detected;
+    ++queue_len;
+    ++pool_busy;
+    p->in_flight = 1;
+    pthread_cond_signal(&pool_not_empty);
+    pthread_mutex_unlock(&pool_lock);
+    debug("queued copy %s ==> %s", from, to);
+    *from_fd = -1;
+    return;
+}
+
+
+/*
+ * pool_start - start the copy worker threads
+ */
+static void
+pool_start(void)
+{
+    int ret;			/* pthread_create return */
+    int i;
+
+    /*
+     * allocate the worker and queue arrays
+     */
+    queue_max = jobs * JOBS_PER_WORKER;
+    workers = (pthread_t *)malloc(jobs * sizeof(workers[0]));
+    queue = (struct job *)malloc(queue_max * sizeof(queue[0]));
+    if (workers == NULL || queue == NULL) {
+	fprintf(stderr, "%s: worker pool malloc failed\n", program);
+	exit(33);
+    }
+
+    /*
+     * start the workers
+     */
+    for (i=0; i < jobs; ++i) {
+	ret = pthread_create(&workers[i], NULL, pool_worker, NULL);
+	if (ret != 0) {
+	    fprintf(stderr, "%s: pthread_create failed: %s\n",
+		    program, strerror(ret));
+	    exit(34);
+	}
+    }
+    return;
+}
+
+
+/*
+ * pool_worker - copy queued jobs until told to stop
+ *
+ * given:
+ *	arg	unused
+ */
+static void *
+pool_worker(void *arg)
+{
+    struct job job;		/* job being copied */
+    int64_t started;		/* CLOCK_MONOTONIC when the copy started */
+    int idle;			/* 1 ==> no jobs are queued */
+    int ret;			/* copy_file() return */
+
+    for (;;) {
+
+	/* take the next job */
+	pthread_mutex_lock(&pool_lock);
+	while (queue_len <= 0 && !pool_stop) {
+	    pthread_cond_wait(&pool_not_empty, &pool_lock);
+	}
+	if (queue_len <= 0) {
+	    pthread_mutex_unlock(&pool_lock);
+	    break;
+	}
+	job = queue[queue_head];
+	queue_head = (queue_head + 1) % queue_max;
+	--queue_len;
+	pthread_cond_signal(&pool_not_full);
+	pthread_mutex_unlock(&pool_lock);
+
+	/* copy */
+	started = now_nsec();
+	ret = copy_file(job.from_fd, &job.from_buf, job.from, job.new_to, job.to,
+			job.fan, job.detected, started);
+	stats_copy(ret, job.detected, started);
+	fan_stats(job.fan, job.detected, started);
+	(void) close(job.from_fd);
+
+	/*
+	 * the pairs may be checked again, and if the from file changed,
+	 * the main thread checks the pair again once it may have settled
+	 */
+	fan_release(job.fan);
+	pthread_mutex_lock(&pool_lock);
+	pairs[job.pair].in_flight = 0;
+	if (ret > 0) {
+	    if (pairs[job.pair].retry_due <= 0) {
+		pairs[job.pair].retry_next = pool_retry_list;
+		pool_retry_list = job.pair;
+	    }
+	    pairs[job.pair].retry_due = now_nsec() +
+					((settle > COPY_DEBOUNCE) ? settle : COPY_DEBOUNCE);
+	}
+	--pool_busy;
+	idle = (queue_len <= 0);
+	pthread_cond_broadcast(&pool_done);
+	pthread_mutex_unlock(&pool_lock);
+
+	/* -y full: commit the copies made so far once there are no more to join them */
+	if (idle && durability == DURABLE_FULL) {
+	    durable_flush();
+	}
+    }
+    return NULL;
+}
+
+
+/*
+ * pool_finish - wait for queued copies to finish and stop the workers
+ */
+static void
+pool_finish(void)
+{
+    int i;
+
+    /*
+     * tell the workers to stop once the queue is empty
+     */
+    pthread_mutex_lock(&pool_lock);
+    pool_stop = 1;
+    pthread_cond_broadcast(&pool_not_empty);
+    pthread_mutex_unlock(&pool_lock);
+
+    /*
+     * wait for them
+     */
+    for (i=0; i < jobs; ++i) {
+	(void) pthread_join(workers[i], NULL);
+    }
+    debug("copy workers finished");
+    return;
+}
+
+
+/*
+ * pool_retry - schedule the pairs whose from file changed during their copy
+ *
+ * returns:
+ *	1 ==> copies are queued or in flight, 0 ==> the workers are idle
+ *
+ * A worker does not copy a changed from file again: the pair is checked
+ * again at its retry_due, so that its flags and the newer of src and
+ * dest decide what to copy.  Workers push such pairs on pool_retry_list,
+ * so we look at only those, not at every pair.
+ */
+static int
+pool_retry(void)
+{
+    struct pair *p;		/* pair to check again */
+    int busy;			/* 1 ==> copies are queued or in flight */
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    for (i=pool_retry_list; i >= 0; i=p->retry_next) {
+	p = &pairs[i];
+	if (p->heap_pos < 0) {
+	    /* no checks left: check once more */
+	    debug("%s changed during its copy, checking again", p->src);
+	    p->next_due = p->retry_due;
+	    heap_push(i);
+	} else if (p->retry_due < p->next_due) {
+	    debug("%s changed during its copy, checking again", p->src);
+	    p->next_due = p->retry_due;
+	    heap_fix(i);
+	}
+	p->retry_due = 0;
+    }
+    pool_retry_list = -1;
+    busy = (pool_busy > 0);
+    pthread_mutex_unlock(&pool_lock);
+    return busy;
+}
+
+
+/*
+ * tree_sync - check a -R tree pair once and sync each file that differs
+ *
+ * given:
+ *	p	tree pair to check
+ *
+ * The walkers walk the src and dest trees together.  Each file is
+ * checked as a pair of its own, with the flags of the tree pair, and
+ * is copied by the walker that found it.  A missing directory is made
+ * when a file would be copied into it, but directories are never
+ * removed: -d and -D only remove files.
+ */
+static void
+tree_sync(struct pair *p)
+{
+    struct walk w;		/* this walk */
+    struct walk_thread *wt;	/* walker arguments */
+    pthread_t *tids;		/* helper walker threads */
+    struct stat src_buf;	/* src directory status */
+    struct stat dest_buf;	/* dest directory status */
+    int started;		/* helper walkers started */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (p == NULL) {
+	fprintf(stderr, "%s: tree_sync called with NULL ptr\n", program);
+	exit(57);
+    }
+
+    /*
+     * set up the deques, one per walker
+     */
+    memset(&w, 0, sizeof(w));
+    w.p = p;
+    w.nwalkers = walkers;
+    w.deques = (struct walk_deque *)calloc(walkers, sizeof(w.deques[0]));
+    wt = (struct walk_thread *)calloc(walkers, sizeof(wt[0]));
+    tids = (pthread_t *)calloc(walkers, sizeof(tids[0]));
+    if (w.deques == NULL || wt == NULL || tids == NULL) {
+	fprintf(stderr, "%s: walker calloc failed\n", program);
+	exit(58);
+    }
+    pthread_mutex_init(&w.idle_lock, NULL);
+    pthread_cond_init(&w.idle_cond, NULL);
+    for (i=0; i < walkers; ++i) {
+	pthread_mutex_init(&w.deques[i].lock, NULL);
+	wt[i].w = &w;
+	wt[i].id = i;
+    }
+
+    /*
+     * the top directories are walked like any other subdirectory
+     */
+    walk_subdir(&w, 0, path_cat(p->src, "", ""),
+		(stat(p->src, &src_buf) == 0) ? &src_buf : NULL,
+		path_cat(p->dest, "", ""),
+		(stat(p->dest, &dest_buf) == 0) ? &dest_buf : NULL);
+
+    /*
+     * walk with the helper walkers and this thread
+     */
+    for (started=1; started < walkers; ++started) {
+	errno = pthread_create(&tids[started], NULL, tree_walker, &wt[started]);
+	if (errno != 0) {
+	    /* OK to continue with the walkers we have */
+	    debug("cannot start walker thread: %s", strerror(errno));
+	    break;
+	}
+    }
+    (void) tree_walker(&wt[0]);
+    for (i=1; i < started; ++i) {
+	(void) pthread_join(tids[i], NULL);
+    }
+    debug("walked %lld directories and %lld files, %lld look similar: %s ==> %s",
+	  (long long)w.ndirs, (long long)w.nfiles, (long long)w.nsettled,
+	  p->src, p->dest);
+    p->changed = w.changed;
+    if (w.settle_due > 0) {
+	p->settle_due = w.settle_due;
+    }
+
+    /*
+     * cleanup
+     */
+    for (i=0; i < walkers; ++i) {
+	pthread_mutex_destroy(&w.deques[i].lock);
+	free(w.deques[i].dirs);
+    }
+    pthread_cond_destroy(&w.idle_cond);
+    pthread_mutex_destroy(&w.idle_lock);
+    free(w.deques);
+    free(wt);
+    free(tids);
+    return;
+}
+
+
+/*
+ * tree_walker - walk directories until the walk is done
+ *
+ * given:
+ *	arg	pointer to the struct walk_thread of this walker
+ *
+ * returns:
+ *	NULL
+ *
+ * The walk is done when no directories are queued or being walked.
+ * Until then, a walker without a directory to walk sleeps until one
+ * is queued, because a walker that is walking may yet queue more.
+ */
+static void *
+tree_walker(void *arg)
+{
+    struct walk_thread *wt = (struct walk_thread *)arg;	/* this walker */
+    struct walk_dir dir;	/* directory pair to walk */
+
+    /*
+     * firewall
+     */
+    if (wt == NULL || wt->w == NULL) {
+	fprintf(stderr, "%s: tree_walker called with NULL ptr\n", program);
+	exit(59);
+    }
+
+    /*
+     * walk directories until there are none left
+     */
+    while (__atomic_load_n(&wt->w->pending, __ATOMIC_ACQUIRE) > 0) {
+	if (walk_take(wt->w, wt->id, &dir)) {
+	    walk_dir(wt->w, wt->id, &dir);
+	    free(dir.src);
+	    free(dir.dest);
+	    if (__atomic_sub_fetch(&wt->w->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		/* wake the idle walkers to finish */
+		pthread_mutex_lock(&wt->w->idle_lock);
+		pthread_cond_broadcast(&wt->w->idle_cond);
+		pthread_mutex_unlock(&wt->w->idle_lock);
+	    }
+	} else {
+	    /* wait for a directory to be queued or the walk to be done */
+	    pthread_mutex_lock(&wt->w->idle_lock);
+	    while (__atomic_load_n(&wt->w->queued, __ATOMIC_ACQUIRE) == 0 &&
+		   __atomic_load_n(&wt->w->pending, __ATOMIC_ACQUIRE) > 0) {
+		pthread_cond_wait(&wt->w->idle_cond, &wt->w->idle_lock);
+	    }
+	    pthread_mutex_unlock(&wt->w->idle_lock);
+	}
+    }
+    return NULL;
+}
+
+
+/*
+ * walk_push - queue a directory pair on the bottom of a walker's deque
+ *
+ * given:
+ *	w	walk
+ *	id	walker queuing the directory pair
+ *	src	malloced src directory path, the walk frees it
+ *	dest	malloced dest directory path, the walk frees it
+ */
+static void
+walk_push(struct walk *w, int id, char *src, char *dest)
+{
+    struct walk_deque *dq;	/* deque of this walker */
+
+    /*
+     * firewall
+     */
+    if (w == NULL || src == NULL || dest == NULL) {
+	fprintf(stderr, "%s: walk_push called with NULL ptr\n", program);
+	exit(60);
+    }
+
+    /*
+     * make room at the bottom, then push
+     */
+    dq = &w->deques[id];
+    (void) __atomic_add_fetch(&w->pending, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom >= dq->max) {
+	if (dq->top > 0) {
+	    memmove(dq->dirs, dq->dirs + dq->top,
+		    (dq->bottom - dq->top) * sizeof(dq->dirs[0]));
+	    dq->bottom -= dq->top;
+	    dq->top = 0;
+	}
+	if (dq->bottom >= dq->max) {
+	    dq->max = (dq->max > 0) ? dq->max*2 : 64;
+	    dq->dirs = (struct walk_dir *)realloc(dq->dirs, dq->max * sizeof(dq->dirs[0]));
+	    if (dq->dirs == NULL) {
+		fprintf(stderr, "%s: walk deque realloc failed\n", program);
+		exit(61);
+	    }
+	}
+    }
+    dq->dirs[dq->bottom].src = src;
+    dq->dirs[dq->bottom].dest = dest;
+    ++dq->bottom;
+    (void) __atomic_add_fetch(&w->queued, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&dq->lock);
+
+    /*
+     * wake an idle walker to take it
+     */
+    pthread_mutex_lock(&w->idle_lock);
+    pthread_cond_signal(&w->idle_cond);
+    pthread_mutex_unlock(&w->idle_lock);
+    return;
+}
+
+
+/*
+ * walk_take - take a directory pair to walk
+ *
+ * given:
+ *	w	walk
+ *	id	walker taking the directory pair
+ *	dir	where to store the directory pair
+ *
+ * returns:
+ *	1 ==> took a directory pair, 0 ==> every deque is empty
+ *
+ * A walker takes from the bottom of its own deque, so it walks depth
+ * first.  Otherwise it steals from the top of another deque, which is
+ * the shallowest directory, and so likely the largest subtree.
+ */
+static int
+walk_take(struct walk *w, int id, struct walk_dir *dir)
+{
+    struct walk_deque *dq;	/* deque being taken from */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (w == NULL || dir == NULL) {
+	fprintf(stderr, "%s: walk_take called with NULL ptr\n", program);
+	exit(62);
+    }
+
+    /*
+     * our own deque first, then the others in turn
+     */
+    for (i=0; i < w->nwalkers; ++i) {
+	dq = &w->deques[(id + i) % w->nwalkers];
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom > dq->top) {
+	    if (i == 0) {
+		*dir = dq->dirs[--dq->bottom];
+	    } else {
+		*dir = dq->dirs[dq->top++];
+	    }
+	    (void) __atomic_sub_fetch(&w->queued, 1, __ATOMIC_ACQ_REL);
+	    pthread_mutex_unlock(&dq->lock);
+	    return 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+    }
+    return 0;
+}
+
+
+/*
+ * walk_subdir - decide whether to walk a pair of subdirectories
+ *
+ * given:
+ *	w		walk
+ *	id		walker that found the subdirectories
+ *	src		malloced src path, the walk frees it
+ *	src_buf		src status, NULL ==> src is missing
+ *	dest		malloced dest path, the walk frees it
+ *	dest_buf	dest status, NULL ==> dest is missing
+ *
+ * A directory missing on one side is made, as a file would be copied,
+ * unless the flags of the tree would remove files on the other side
+ * instead.  Then we walk so that the files are removed.
+ */
+static void
+walk_subdir(struct walk *w, int id, char *src, struct stat *src_buf,
+	    char *dest, struct stat *dest_buf)
+{
+    struct pair *p;		/* tree pair */
+    int walk = 0;		/* 1 ==> walk the subdirectories */
+
+    /*
+     * firewall
+     */
+    if (w == NULL || w->p == NULL || src == NULL || dest == NULL) {
+	fprintf(stderr, "%s: walk_subdir called with NULL ptr\n", program);
+	exit(63);
+    }
+    p = w->p;
+
+    /*
+     * both directories exist
+     */
+    if (src_buf != NULL && S_ISDIR(src_buf->st_mode) &&
+	dest_buf != NULL && S_ISDIR(dest_buf->st_mode)) {
+	walk = 1;
+
+    /*
+     * a src directory and no dest
+     */
+    } else if (src_buf != NULL && S_ISDIR(src_buf->st_mode) && dest_buf == NULL) {
+	if (p->del_src) {
+	    debug("dest directory is missing, removing files of src: %s", src);
+	    walk = 1;
+	} else {
+	    errno = 0;
+	    if (mkdir(dest, src_buf->st_mode & 07777) < 0) {
+		debug("unable to make dest directory: %s: %s", dest, strerror(errno));
+	    } else {
+		debug("made dest directory: %s", dest);
+		walk = 1;
+	    }
+	}
+
+    /*
+     * a dest directory and no src
+     */
+    } else if (dest_buf != NULL && S_ISDIR(dest_buf->st_mode) && src_buf == NULL) {
+	if (p->del_dest) {
+	    debug("src directory is missing, removing files of dest: %s", dest);
+	    walk = 1;
+	} else if (p->dest_2_src || p->trunc) {
+	    errno = 0;
+	    if (mkdir(src, dest_buf->st_mode & 07777) < 0) {
+		debug("unable to make src directory: %s: %s", src, strerror(errno));
+	    } else {
+		debug("made src directory: %s", src);
+		walk = 1;
+	    }
+	} else {
+	    debug("src directory is missing: %s", src);
+	}
+
+    /*
+     * a directory on one side and something else on the other
+     */
+    } else if (src_buf != NULL || dest_buf != NULL) {
+	debug("src: %s and dest: %s are not both directories", src, dest);
+    }
+
+    /*
+     * walk or forget the subdirectories
+     */
+    if (walk) {
+	walk_push(w, id, src, dest);
+    } else {
+	free(src);
+	free(dest);
+    }
+    return;
+}
+
+
+/*
+ * walk_dir - check the entries of a directory pair
+ *
+ * given:
+ *	w	walk
+ *	id	walker walking the directory pair
+ *	dir	directory pair to walk
+ *
+ * The src and dest directories are listed and their names merged, so
+ * each name found on either side is checked once.  Our temp and -r
+ * state files are not synced, see temp_name().
+ */
+static void
+walk_dir(struct walk *w, int id, struct walk_dir *dir)
+{
+    struct walk_list src_list;	/* names in the src directory */
+    struct walk_list dest_list;	/* names in the dest directory */
+    struct stat src_buf;	/* src entry status */
+    struct stat dest_buf;	/* dest entry status */
+    int src_fd;			/* open src directory or -1 */
+    int dest_fd;		/* open dest directory or -1 */
+    int src_exists;		/* 1 ==> src entry exists */
+    int dest_exists;		/* 1 ==> dest entry exists */
+    char *name;			/* entry name */
+    int cmp;			/* name order */
+    int i;
+    int j;
+
+    /*
+     * firewall
+     */
+    if (w == NULL || dir == NULL) {
+	fprintf(stderr, "%s: walk_dir called with NULL ptr\n", program);
+	exit(64);
+    }
+
+    /*
+     * list both directories, a missing directory has no names
+     */
+    (void) __atomic_add_fetch(&w->ndirs, 1, __ATOMIC_RELAXED);
+    src_fd = open(dir->src, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    dest_fd = open(dir->dest, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    walk_list(src_fd, dir->src, &src_list);
+    walk_list(dest_fd, dir->dest, &dest_list);
+
+    /*
+     * check each name of either directory
+     */
+    for (i=0, j=0; i < src_list.nnames || j < dest_list.nnames; ) {
+
+	/* next name in order, from one or both sides */
+	if (i >= src_list.nnames) {
+	    cmp = 1;
+	} else if (j >= dest_list.nnames) {
+	    cmp = -1;
+	} else {
+	    cmp = strcmp(src_list.pool + src_list.names[i],
+			 dest_list.pool + dest_list.names[j]);
+	}
+	if (cmp <= 0) {
+	    name = src_list.pool + src_list.names[i];
+	} else {
+	    name = dest_list.pool + dest_list.names[j];
+	}
+	src_exists = (cmp <= 0);
+	dest_exists = (cmp >= 0);
+	i += src_exists;
+	j += dest_exists;
+
+	/* skip . and .. and our temp files, which are only on the side we copy to */
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+	    continue;
+	}
+	if (cmp < 0 && temp_name(src_fd, name, &src_list, &dest_list)) {
+	    continue;
+	}
+	if (cmp > 0 && temp_name(dest_fd, name, &dest_list, &src_list)) {
+	    continue;
+	}
+
+	/* status of each side */
+	src_exists = (src_exists &&
+		      fstatat(src_fd, name, &src_buf, AT_SYMLINK_NOFOLLOW) == 0);
+	dest_exists = (dest_exists &&
+		       fstatat(dest_fd, name, &dest_buf, AT_SYMLINK_NOFOLLOW) == 0);
+
+	/* subdirectories are walked later, perhaps by another walker */
+	if ((src_exists && S_ISDIR(src_buf.st_mode)) ||
+	    (dest_exists && S_ISDIR(dest_buf.st_mode))) {
+	    walk_subdir(w, id, path_cat(dir->src, "/", name),
+			src_exists ? &src_buf : NULL,
+			path_cat(dir->dest, "/", name),
+			dest_exists ? &dest_buf : NULL);
+	    continue;
+	}
+
+	/*
+	 * files that check_pair() would find similar need not be opened,
+	 * unless -H where contents decide
+	 */
+	(void) __atomic_add_fetch(&w->nfiles, 1, __ATOMIC_RELAXED);
+	if (src_exists && dest_exists && !content_hash &&
+	    S_ISREG(src_buf.st_mode) &&
+	    src_buf.st_mode == dest_buf.st_mode &&
+	    src_buf.st_size == dest_buf.st_size &&
+	    src_buf.st_mtime == dest_buf.st_mtime) {
+	    (void) __atomic_add_fetch(&w->nsettled, 1, __ATOMIC_RELAXED);
+	    continue;
+	}
+	walk_file(w, dir, name);
+    }
+
+    /*
+     * cleanup
+     */
+    free(src_list.pool);
+    free(src_list.names);
+    free(dest_list.pool);
+    free(dest_list.names);
+    if (src_fd >= 0) {
+	(void) close(src_fd);
+    }
+    if (dest_fd >= 0) {
+	(void) close(dest_fd);
+    }
+    return;
+}
+
+
+/*
+ * temp_name - determine if a name is one of our temp or -r state files
+ *
+ * given:
+ *	fd	open directory holding name, or -1
+ *	name	filename
+ *	list	names in that directory
+ *	other	names in the directory on the other side
+ *
+ * returns:
+ *	1 ==> name is provably our temp name, 0 ==> it is not
+ *
+ * These are the names setup_pairs(), resume_name() and temp_link()
+ * form from a filename: the -s suffix, followed by RESUME_SUFFIX, or
+ * by the pid and try number of LINK_NAME.  A file may have such a name
+ * too, so a name is ours only if the filename it was formed from is
+ * on either side, and:
+ *
+ *	a -r state file's temp file is beside it,
+ *	a link name's pid is a live process with our command name,
+ *	a temp file has a -r state file beside it, or is locked by a copy
+ */
+static int
+temp_name(int fd, char *name, struct walk_list *list, struct walk_list *other)
+{
+    size_t len;			/* length of name left to match */
+    size_t temp_len;		/* length of the temp name within name */
+    size_t suffix_len;		/* length of suffix */
+    size_t resume_len = sizeof(RESUME_SUFFIX) - 1;	/* length of RESUME_SUFFIX */
+    size_t digits;		/* digits of a number before len */
+    char *state;		/* -r state filename of a temp name */
+    long pid = 0;		/* pid of a link name, 0 ==> not a link name */
+    char comm_path[sizeof("/proc//comm") + 3*sizeof(long)];	/* /proc comm of pid */
+    char comm[2][COMM_LEN];	/* command names of pid and of us */
+    int temp_fd;		/* open temp file */
+    int locked;			/* 1 ==> a copy holds the temp file lock */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (name == NULL || list == NULL || other == NULL) {
+	fprintf(stderr, "%s: temp_name called with NULL ptr\n", program);
+	exit(110);
+    }
+
+    /*
+     * strip a -r state suffix, or the .pid.try of a -O link name
+     */
+    len = strlen(name);
+    if (len > resume_len && strcmp(name + len - resume_len, RESUME_SUFFIX) == 0) {
+	len -= resume_len;
+    } else {
+	for (i=0; i < 2; ++i) {
+	    for (digits=0; digits < len && isdigit((unsigned char)name[len-1-digits]); ++digits) {
+	    }
+	    if (digits == 0 || digits >= len || name[len-1-digits] != '.') {
+		break;
+	    }
+	    len -= digits + 1;
+	    if (i == 1) {
+		pid = strtol(name + len + 1, NULL, 10);
+	    }
+	}
+	if (i < 2) {
+	    /* not a pid and a try */
+	    len = strlen(name);
+	}
+    }
+    temp_len = len;
+
+    /*
+     * what is left must end with the temp file suffix, after a filename
+     * on either side
+     */
+    suffix_len = strlen(suffix);
+    if (len <= suffix_len || strncmp(name + len - suffix_len, suffix, suffix_len) != 0) {
+	return 0;
+    }
+    len -= suffix_len;
+    if (!walk_find(list, name, len) && !walk_find(other, name, len)) {
+	return 0;
+    }
+
+    /*
+     * a -r state file must be beside its temp file
+     */
+    if (temp_len < strlen(name) && pid == 0) {
+	return walk_find(list, name, temp_len);
+    }
+
+    /*
+     * a link name is ours while the syncfile that linked it lives
+     */
+    if (pid > 0) {
+	if (pid > INT_MAX || (kill((pid_t)pid, 0) < 0 && errno != EPERM)) {
+	    return 0;
+	}
+	snprintf(comm_path, sizeof(comm_path), "/proc/%ld/comm", pid);
+	return read_comm(comm_path, comm[0]) &&
+	       read_comm("/proc/self/comm", comm[1]) &&
+	       strcmp(comm[0], comm[1]) == 0;
+    }
+
+    /*
+     * a temp file is ours if it has a -r state file, or a copy locks it
+     */
+    state = path_cat(name, RESUME_SUFFIX, "");
+    i = walk_find(list, state, strlen(state));
+    free(state);
+    if (i) {
+	return 1;
+    }
+    if (fd < 0) {
+	return 0;
+    }
+    temp_fd = openat(fd, name, O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC);
+    if (temp_fd < 0) {
+	/* gone, renamed into place by its copy */
+	return errno == ENOENT;
+    }
+    locked = (flock(temp_fd, LOCK_SH|LOCK_NB) < 0 && errno == EWOULDBLOCK);
+    (void) close(temp_fd);
+    return locked;
+}
+
+
+/*
+ * read_comm - read the command name of a process
+ *
+ * given:
+ *	path	/proc comm file of the process
+ *	comm	where to store the command name, COMM_LEN octets
+ *
+ * returns:
+ *	1 ==> read, 0 ==> no such process or unable to read
+ */
+static int
+read_comm(char *path, char *comm)
+{
+    ssize_t readcnt;		/* octets read */
+    int fd;			/* open comm file */
+
+    /*
+     * firewall
+     */
+    if (path == NULL || comm == NULL) {
+	fprintf(stderr, "%s: read_comm called with NULL ptr\n", program);
+	exit(112);
+    }
+
+    /*
+     * read the name, without its newline
+     */
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+	return 0;
+    }
+    readcnt = read(fd, comm, COMM_LEN - 1);
+    (void) close(fd);
+    if (readcnt <= 0) {
+	return 0;
+    }
+    comm[readcnt] = '\0';
+    comm[strcspn(comm, "\n")] = '\0';
+    return 1;
+}
+
+
+/*
+ * walk_find - determine if a directory listing has a name
+ *
+ * given:
+ *	list	names in a directory, in strcmp order
+ *	name	name to find, need not be NUL terminated
+ *	len	length of name
+ *
+ * returns:
+ *	1 ==> list has the name, 0 ==> it does not
+ */
+static int
+walk_find(struct walk_list *list, char *name, size_t len)
+{
+    char *entry;		/* name in list */
+    int lo;			/* first name that may match */
+    int hi;			/* after the last name that may match */
+    int mid;			/* name to compare */
+    int cmp;			/* order of entry and name */
+
+    /*
+     * firewall
+     */
+    if (list == NULL || name == NULL) {
+	fprintf(stderr, "%s: walk_find called with NULL ptr\n", program);
+	exit(111);
+    }
+
+    /*
+     * binary search
+     */
+    for (lo=0, hi=list->nnames; lo < hi; ) {
+	mid = lo + (hi - lo) / 2;
+	entry = list->pool + list->names[mid];
+	cmp = strncmp(entry, name, len);
+	if (cmp == 0 && entry[len] != '\0') {
+	    cmp = 1;
+	}
+	if (cmp == 0) {
+	    return 1;
+	} else if (cmp < 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return 0;
+}
+
+
+/*
+ * walk_list - list the names in a directory, in strcmp order
+ *
+ * given:
+ *	fd	open directory, -1 ==> no directory
+ *	path	directory path, for messages
+ *	list	where to store the names
+ *
+ * The names are read with getdents64 into one pool of strings, and
+ * names[] holds the offset of each name in the pool.
+ */
+static void
+walk_list(int fd, char *path, struct walk_list *list)
+{
+    char buf[WALK_BUFSIZ];	/* getdents64 buffer */
+    struct dirent64 *ent;	/* directory entry in buf */
+    ssize_t len;		/* octets of entries read */
+    ssize_t off;		/* offset of ent in buf */
+    size_t pool_len = 0;	/* octets of pool in use */
+    size_t pool_max = 0;	/* octets of pool allocated */
+    size_t name_len;		/* length of name including the NUL */
+    int max_names = 0;		/* names[] allocated */
+
+    /*
+     * firewall
+     */
+    if (path == NULL || list == NULL) {
+	fprintf(stderr, "%s: walk_list called with NULL ptr\n", program);
+	exit(65);
+    }
+    memset(list, 0, sizeof(*list));
+    if (fd < 0) {
+	return;
+    }
+
+    /*
+     * read all of the entries
+     */
+    for (;;) {
+	errno = 0;
+	len = getdents64(fd, buf, sizeof(buf));
+	if (len < 0) {
+	    debug("cannot read directory %s: %s", path, strerror(errno));
+	    break;
+	} else if (len == 0) {
+	    break;
+	}
+	for (off = 0; off < len; off += ent->d_reclen) {
+	    ent = (struct dirent64 *)(buf + off);
+	    name_len = strlen(ent->d_name) + 1;
+	    if (pool_len + name_len > pool_max) {
+		pool_max = (pool_max > 0) ? pool_max*2 : WALK_BUFSIZ;
+		list->pool = (char *)realloc(list->pool, pool_max);
+		if (list->pool == NULL) {
+		    fprintf(stderr, "%s: walk pool realloc failed\n", program);
+		    exit(66);
+		}
+	    }
+	    if (list->nnames >= max_names) {
+		max_names = (max_names > 0) ? max_names*2 : 256;
+		list->names = (size_t *)realloc(list->names, max_names * sizeof(list->names[0]));
+		if (list->names == NULL) {
+		    fprintf(stderr, "%s: walk names realloc failed\n", program);
+		    exit(67);
+		}
+	    }
+	    memcpy(list->pool + pool_len, ent->d_name, name_len);
+	    list->names[list->nnames++] = pool_len;
+	    pool_len += name_len;
+	}
+    }
+
+    /*
+     * sort the names so the src and dest lists can be merged
+     */
+    qsort_r(list->names, list->nnames, sizeof(list->names[0]), walk_cmp, list->pool);
+    return;
+}
+
+
+/*
+ * walk_cmp - qsort_r compare of two names in a pool
+ *
+ * given:
+ *	a	pointer to offset in pool of a name
+ *	b	pointer to offset in pool of another name
+ *	pool	pool of names
+ *
+ * returns:
+ *	< 0, 0 or > 0 as the name of a is before, the same as, or after b
+ */
+static int
+walk_cmp(const void *a, const void *b, void *pool)
+{
+    return strcmp((char *)pool + *(const size_t *)a, (char *)pool + *(const size_t *)b);
+}
+
+
+/*
+ * walk_file - check a file of a tree, as a pair of its own
+ *
+ * given:
+ *	w	walk
+ *	dir	directory pair holding the file
+ *	name	name of the file in the directory pair
+ *
+ * The file pair has the flags of the tree pair, and is copied now by
+ * this walker rather than by a -j worker.
+ */
+static void
+walk_file(struct walk *w, struct walk_dir *dir, char *name)
+{
+    struct pair e;		/* file pair */
+    int src_fd = -1;		/* open src descriptor or -1 => no file */
+    int dest_fd = -1;		/* open dest descriptor or -1 => no file */
+    int64_t due;		/* earliest settle_due of the walk so far */
+
+    /*
+     * firewall
+     */
+    if (w == NULL || w->p == NULL || dir == NULL || name == NULL) {
+	fprintf(stderr, "%s: walk_file called with NULL ptr\n", program);
+	exit(68);
+    }
+
+    /*
+     * form the file pair
+     */
+    memset(&e, 0, sizeof(e));
+    e.src = path_cat(dir->src, "/", name);
+    e.dest = path_cat(dir->dest, "/", name);
+    e.new_src = path_cat(e.src, suffix, "");
+    e.new_dest = path_cat(e.dest, suffix, "");
+    e.src_dir = -1;
+    e.dest_dir = -1;
+    e.heap_pos = -1;
+    e.del_dest = w->p->del_dest;
+    e.del_src = w->p->del_src;
+    e.trunc = w->p->trunc;
+    e.dest_2_src = w->p->dest_2_src;
+    e.entry = 1;
+
+    /*
+     * check the file pair
+     */
+    check_pair(&e, &src_fd, &dest_fd);
+    if (e.changed) {
+	__atomic_store_n(&w->changed, 1, __ATOMIC_RELAXED);
+    }
+    if (e.settle_due > 0) {
+	/* keep the earliest, another walker may store first */
+	due = __atomic_load_n(&w->settle_due, __ATOMIC_RELAXED);
+	while ((due <= 0 || e.settle_due < due) &&
+	       !__atomic_compare_exchange_n(&w->settle_due, &due, e.settle_due, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	    /* due is now the value another walker stored */
+	}
+    }
+
+    /*
+     * cleanup
+     */
+    if (src_fd >= 0) {
+	(void) close(src_fd);
+    }
+    if (dest_fd >= 0) {
+	(void) close(dest_fd);
+    }
+    free(e.src);
+    free(e.dest);
+    free(e.new_src);
+    free(e.new_dest);
+    return;
+}
+
+
+/*
+ * path_cat - concatenate three strings into a malloced path
+ *
+ * given:
+ *	a	first string
+ *	b	second string
+ *	c	third string
+ *
+ * returns:
+ *	malloced a b c
+ */
+static char *
+path_cat(char *a, char *b, char *c)
+{
+    size_t a_len;		/* length of a */
+    size_t b_len;		/* length of b */
+    size_t c_len;		/* length of c */
+    char *path;			/* malloced path */
+
+    /*
+     * firewall
+     */
+    if (a == NULL || b == NULL || c == NULL) {
+	fprintf(stderr, "%s: path_cat called with NULL ptr\n", program);
+	exit(69);
+    }
+
+    /*
+     * concatenate
+     */
+    a_len = strlen(a);
+    b_len = strlen(b);
+    c_len = strlen(c);
+    path = (char *)malloc(a_len + b_len + c_len + 1);
+    if (path == NULL) {
+	fprintf(stderr, "%s: path malloc failed\n", program);
+	exit(70);
+    }
+    memcpy(path, a, a_len);
+    memcpy(path + a_len, b, b_len);
+    memcpy(path + a_len + b_len, c, c_len + 1);
+    return path;
+}
+
+
+/*
+ * stats_copy - count a copy that is done
+ *
+ * given:
+ *	ret		copy_file() return, 0 ==> copied, > 0 ==> discarded
+ *	detected	CLOCK_MONOTONIC when the change was found
+ *	started		CLOCK_MONOTONIC when the copy started
+ */
+static void
+stats_copy(int ret, int64_t detected, int64_t started)
+{
+    int64_t now;		/* CLOCK_MONOTONIC when the copy was done */
+
+    if (ret < 0) {
+	STAT_ADD(stats.copies_failed, 1);
+	return;
+    } else if (ret > 0) {
+	STAT_ADD(stats.copies_discarded, 1);
+	return;
+    }
+    if (durability == DURABLE_FULL) {
+	/* -y full: durable_commit() counts the copy once it is durable, or failed */
+	return;
+    }
+    now = now_nsec();
+    STAT_ADD(stats.copies_completed, 1);
+    hist_observe(&stats.copy_time, &stats.copy_time_max, now - started);
+    hist_observe(&stats.sync_lag, &stats.sync_lag_max, now - detected);
+    return;
+}
+
+
+/*
+ * hist_observe - add a duration to a histogram
+ *
+ * given:
+ *	h	histogram
+ *	max	pointer to the longest duration so far
+ *	ns	duration in nanoseconds
+ */
+static void
+hist_observe(struct histogram *h, int64_t *max, int64_t ns)
+{
+    int64_t usec;		/* duration in microseconds, rounded up */
+    int64_t old;		/* longest duration before this one */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (h == NULL || max == NULL) {
+	fprintf(stderr, "%s: hist_observe called with NULL ptr\n", program);
+	exit(71);
+    }
+
+    /*
+     * find the smallest bucket that holds the duration
+     */
+    if (ns < 0) {
+	ns = 0;
+    }
+    usec = (ns + 999) / 1000;
+    i = 0;
+    while (i < HIST_BUCKETS-1 && ((int64_t)1 << i) < usec) {
+	++i;
+    }
+    STAT_ADD(h->bucket[i], 1);
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->sum_ns, ns);
+    old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (ns > old &&
+	   !__atomic_compare_exchange_n(max, &old, ns, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	/* a failed exchange loaded the new longest duration into old */
+    }
+    return;
+}
+
+
+/*
+ * stats_write - rewrite the stats file in the Prometheus text format
+ *
+ * We write a temp file and rename it, so a reader never sees a partly
+ * written stats file.  A failure to write the stats does not stop the
+ * sync.
+ */
+static void
+stats_write(void)
+{
+    static char *new_stats = NULL;	/* temp stats filename */
+    FILE *stream;			/* open temp stats file */
+    struct timespec ts;			/* time of this snapshot */
+    int i;
+
+    /*
+     * form the temp stats filename once
+     */
+    if (new_stats == NULL) {
+	new_stats = path_cat(stats_file, suffix, "");
+    }
+
+    /*
+     * write the counters and histograms
+     */
+    errno = 0;
+    stream = fopen(new_stats, "w");
+    if (stream == NULL) {
+	debug("unable to open stats file: %s: %s", new_stats, strerror(errno));
+	return;
+    }
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    fprintf(stream,
+	    "# HELP syncfile_cycles_total Sync cycles run.\n"
+	    "# TYPE syncfile_cycles_total counter\n"
+	    "syncfile_cycles_total %lld\n",
+	    (long long)__atomic_load_n(&stats.cycles, __ATOMIC_RELAXED));
+    fprintf(stream,
+	    "# HELP syncfile_checks_total Pair checks performed.\n"
+	    "# TYPE syncfile_checks_total counter\n"
+	    "syncfile_checks_total %lld\n",
+	    (long long)__atomic_load_n(&stats.checks, __ATOMIC_RELAXED));
+    fprintf(stream,
+	    "# HELP syncfile_copies_started_total Copies started or queued.\n"
+	    "# TYPE syncfile_copies_started_total counter\n"
+	    "syncfile_copies_started_total %lld\n",
+	    (long long)__atomic_load_n(&stats.copies_started, __ATOMIC_RELAXED));
+    fprintf(stream,
+	    "# HELP syncfile_copies_completed_total Copies renamed into place.\n"
+	    "# TYPE syncfile_copies_completed_total counter\n"
+	    "syncfile_copies_completed_total %lld\n",
+	    (long long)__atomic_load_n(&stats.copies_completed, __ATOMIC_RELAXED));
+    fprintf(stream,
+	    "# HELP syncfile_copies_failed_total Copies that failed.\n"
+	    "# TYPE syncfile_copies_failed_total counter\n"
+	    "syncfile_copies_failed_total %lld\n",
+	    (long long)__atomic_load_n(&stats.copies_failed, __ATOMIC_RELAXED));
+    fprintf(stream,
+	    "# HELP syncfile_copies_discarded_total Copies discarded because src changed during the copy.\n"
+	    "# TYPE syncfile_copies_discarded_total counter\n"
+	    "syncfile_copies_discarded_total %lld\n",
+	    (long long)__atomic_load_n(&stats.copies_discarded, __ATOMIC_RELAXED));
+    fprintf(stream,
+	    "# HELP syncfile_attrs_synced_total Files with the same contents whose attributes were set instead of copied.\n"
+	    "# TYPE syncfile_attrs_synced_total counter\n"
+	    "syncfile_attrs_synced_total %lld\n",
+	    (long long)__atomic_load_n(&stats.attrs_synced, __ATOMIC_RELAXED));
+    fprintf(stream,
+	    "# HELP syncfile_copies_resumed_total Copies continued from a checkpoint of an earlier copy.\n"
+	    "# TYPE syncfile_copies_resumed_total counter\n"
+	    "syncfile_copies_resumed_total %lld\n",
+	    (long long)__atomic_load_n(&stats.copies_resumed, __ATOMIC_RELAXED));
+    fprintf(stream,
+	    "# HELP syncfile_resumed_bytes_total Octets that resumed copies did not copy again.\n"
+	    "# TYPE syncfile_resumed_bytes_total counter\n"
+	    "syncfile_resumed_bytes_total %lld\n",
+	    (long long)__atomic_load_n(&stats.resumed_bytes, __ATOMIC_RELAXED));
+    fprintf(stream,
+	    "# HELP syncfile_copied_bytes_total Octets copied by each engine.\n"
+	    "# TYPE syncfile_copied_bytes_total counter\n");
+    for (i=0; i < ENGINE_CNT; ++i) {
+	fprintf(stream, "syncfile_copied_bytes_total{engine=\"%s\"} %lld\n",
+		engine_name[i], (long long)__atomic_load_n(&stats.bytes[i], __ATOMIC_RELAXED));
+    }
+    fprintf(stream,
+	    "# HELP syncfile_delta_bytes_total Octets written by delta copies.\n"
+	    "# TYPE syncfile_delta_bytes_total counter\n"
+	    "syncfile_delta_bytes_total %lld\n",
+	    (long long)__atomic_load_n(&stats.delta_bytes, __ATOMIC_RELAXED));
+    stats_hist(stream, "syncfile_copy_duration_seconds",
+	       "Time to copy a file and rename it into place.",
+	       &stats.copy_time, stats.copy_time_max);
+    stats_hist(stream, "syncfile_sync_lag_seconds",
+	       "Time from finding a change to renaming its copy into place.",
+	       &stats.sync_lag, stats.sync_lag_max);
+    fprintf(stream,
+	    "# HELP syncfile_last_write_timestamp_seconds When this file was written.\n"
+	    "# TYPE syncfile_last_write_timestamp_seconds gauge\n"
+	    "syncfile_last_write_timestamp_seconds %lld.%03ld\n",
+	    (long long)ts.tv_sec, ts.tv_nsec / 1000000);
+
+    /*
+     * move the new stats into place
+     */
+    if (ferror(stream) || fclose(stream) != 0) {
+	debug("unable to write stats file: %s", new_stats);
+	(void) unlink(new_stats);
+	return;
+    }
+    errno = 0;
+    if (rename(new_stats, stats_file) < 0) {
+	debug("move %s to %s failed: %s", new_stats, stats_file, strerror(errno));
+	(void) unlink(new_stats);
+    }
+    return;
+}
+
+
+/*
+ * stats_hist - write a histogram in the Prometheus text format
+ *
+ * given:
+ *	stream	open stats file
+ *	name	metric name
+ *	help	metric help text
+ *	h	histogram
+ *	max	longest duration in nanoseconds
+ *
+ * Prometheus buckets are cumulative, so each le bucket counts all of
+ * the durations up to its bound.
+ */
+static void
+stats_hist(FILE *stream, char *name, char *help, struct histogram *h, int64_t max)
+{
+    int64_t cumulative = 0;	/* durations up to this bucket */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (stream == NULL || name == NULL || help == NULL || h == NULL) {
+	fprintf(stderr, "%s: stats_hist called with NULL ptr\n", program);
+	exit(72);
+    }
+
+    /*
+     * buckets, then sum and count
+     */
+    fprintf(stream, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i=0; i < HIST_BUCKETS-1; ++i) {
+	cumulative += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+	fprintf(stream, "%s_bucket{le=\"%.6f\"} %lld\n",
+		name, (double)((int64_t)1 << i) / 1e6, (long long)cumulative);
+    }
+    cumulative += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+    fprintf(stream, "%s_bucket{le=\"+Inf\"} %lld\n", name, (long long)cumulative);
+    fprintf(stream, "%s_sum %.9f\n", name,
+	    (double)__atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / (double)NSEC_PER_SEC);
+    fprintf(stream, "%s_count %lld\n", name, (long long)cumulative);
+    fprintf(stream,
+	    "# HELP %s_max Longest of these times.\n"
+	    "# TYPE %s_max gauge\n"
+	    "%s_max %.9f\n",
+	    name, name, name, (double)max / (double)NSEC_PER_SEC);
+    return;
+}
+
+
+/*
+ * add_pair - add a src dest pair to sync
+ *
+ * given:
+ *	src	src sync file
+ *	dest	dest sync file
+ *
+ * returns:
+ *	pointer to the new pair, initialized with the command line flags
+ */
+static struct pair *
+add_pair(char *src, char *dest)
+{
+    struct pair *p;		/* new pair */
+
+    /*
+     * firewall
+     */
+    if (src == NULL || dest == NULL) {
+	fprintf(stderr, "%s: add_pair called with NULL ptr\n", program);
+	exit(21);
+    }
+
+    /*
+     * grow the pair array if needed
+     */
+    if (npairs >= maxpairs) {
+	maxpairs = (maxpairs > 0) ? maxpairs*2 : 16;
+	pairs = (struct pair *)realloc(pairs, maxpairs * sizeof(pairs[0]));
+	if (pairs == NULL) {
+	    fprintf(stderr, "%s: pairs realloc failed\n", program);
+	    exit(22);
+	}
+    }
+
+    /*
+     * initialize the new pair
+     */
+    p = &pairs[npairs++];
+    memset(p, 0, sizeof(*p));
+    p->src = src;
+    p->dest = dest;
+    p->src_dir = -1;
+    p->dest_dir = -1;
+    p->fan_next = npairs - 1;
+    p->interval = interval;
+    p->del_dest = del_dest;
+    p->del_src = del_src;
+    p->trunc = trunc;
+    p->dest_2_src = dest_2_src;
+    p->tree = tree;
+    return p;
+}
+
+
+/*
+ * fan_join - add a pair to the fan-out ring of pairs with the same src
+ *
+ * given:
+ *	prev	index in pairs[] of the pair of the ring to add after
+ *	i	index in pairs[] of the pair to add
+ *
+ * Pairs are joined by index because add_pair() may move pairs[].
+ */
+static void
+fan_join(int prev, int i)
+{
+    pairs[i].fan_next = pairs[prev].fan_next;
+    pairs[prev].fan_next = i;
+}
+
+
+/*
+ * load_manifest - add the src dest pairs listed in a manifest
+ *
+ * given:
+ *	filename	manifest filename, - ==> stdin
+ *
+ * Each line of the manifest is of the form:
+ *
+ *	[-d] [-D] [-T] [-c] [-R] [-t secs] src dest [dest ...]
+ *
+ * where the flags have the same meaning as on the command line and
+ * add to the flags given on the command line.  A src with several
+ * dests is read once for all of them.  Blank lines and lines starting
+ * with # are ignored.  Filenames may not contain whitespace.
+ */
+static void
+load_manifest(char *filename)
+{
+    FILE *stream;		/* open manifest */
+    char *line = NULL;		/* manifest line */
+    size_t linesize = 0;	/* allocated size of line */
+    int line_num = 0;		/* manifest line number */
+    char *tok;			/* current token */
+    char *save;			/* strtok_r state */
+    char *path[1+FAN_MAX];	/* src and dests of this line */
+    int npath;			/* number of paths found on this line */
+    int l_del_dest;		/* -d on this line */
+    int l_del_src;		/* -D on this line */
+    int l_trunc;		/* -T on this line */
+    int l_dest_2_src;		/* -c on this line */
+    int l_tree;			/* -R on this line */
+    double l_interval;		/* -t on this line */
+    struct pair *p;		/* pair added */
+    int i;
+    char *c;
+
+    /*
+     * firewall
+     */
+    if (filename == NULL) {
+	fprintf(stderr, "%s: load_manifest called with NULL ptr\n", program);
+	exit(23);
+    }
+
+    /*
+     * open the manifest
+     */
+    if (strcmp(filename, "-") == 0) {
+	stream = stdin;
+    } else {
+	errno = 0;
+	stream = fopen(filename, "r");
+	if (stream == NULL) {
+	    fprintf(stderr, "%s: cannot open manifest: %s: %s\n",
+		    program, filename, strerror(errno));
+	    exit(3); /*ooo*/
+	    /*NOTREACHED*/
+	}
+    }
+
+    /*
+     * parse each line
+     */
+    while (getline(&line, &linesize, stream) >= 0) {
+	++line_num;
+	npath = 0;
+	l_del_dest = del_dest;
+	l_del_src = del_src;
+	l_trunc = trunc;
+	l_dest_2_src = dest_2_src;
+	l_tree = tree;
+	l_interval = interval;
+	for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+	     tok = strtok_r(NULL, " \t\r\n", &save)) {
+
+	    /* the rest of the line is a comment */
+	    if (tok[0] == '#' && npath == 0) {
+		break;
+	    }
+
+	    /* a path */
+	    if (tok[0] != '-' || tok[1] == '\0' || npath > 0) {
+		if (npath >= 1+FAN_MAX) {
+		    fprintf(stderr, "%s: manifest %s line %d: too many filenames\n",
+			    program, filename, line_num);
+		    exit(3); /*ooo*/
+		    /*NOTREACHED*/
+		}
+		path[npath++] = tok;
+		continue;
+	    }
+
+	    /* flags */
+	    for (c=tok+1; *c; ++c) {
+		switch (*c) {
+		case 'd':
+		    l_del_dest = 1;
+		    break;
+		case 'D':
+		    l_del_src = 1;
+		    break;
+		case 'T':
+		    l_trunc = 1;
+		    break;
+		case 'c':
+		    l_dest_2_src = 1;
+		    break;
+		case 'R':
+		    l_tree = 1;
+		    break;
+		case 't':
+		    if (c[1] == '\0') {
+			c = strtok_r(NULL, " \t\r\n", &save);
+		    } else {
+			++c;
+		    }
+		    errno = 0;
+		    l_interval = (c == NULL) ? 0.0 : strtod(c, NULL);
+		    if (errno == ERANGE || l_interval <= 0.0) {
+			fprintf(stderr,
+				"%s: manifest %s line %d: -t interval value must be > 0.0\n",
+				program, filename, line_num);
+			exit(3); /*ooo*/
+			/*NOTREACHED*/
+		    }
+		    c = "-";	/* -t value ends this token */
+		    break;
+		default:
+		    fprintf(stderr, "%s: manifest %s line %d: unknown flag: -%c\n",
+			    program, filename, line_num, *c);
+		    exit(3); /*ooo*/
+		    /*NOTREACHED*/
+		}
+	    }
+	}
+
+	/* ignore blank and comment lines */
+	if (npath == 0) {
+	    continue;
+	}
+	if (npath < 2) {
+	    fprintf(stderr, "%s: manifest %s line %d: src and dest required\n",
+		    program, filename, line_num);
+	    exit(3); /*ooo*/
+	    /*NOTREACHED*/
+	}
+	if (l_trunc && (l_del_dest || l_del_src)) {
+	    fprintf(stderr, "%s: manifest %s line %d: -T conflicts with -d and -D\n",
+		    program, filename, line_num);
+	    exit(3); /*ooo*/
+	    /*NOTREACHED*/
+	}
+
+	/* add a pair for each dest, all with the same src */
+	for (i=0; i < npath; ++i) {
+	    path[i] = strdup(path[i]);
+	    if (path[i] == NULL) {
+		fprintf(stderr, "%s: manifest strdup failed\n", program);
+		exit(24);
+	    }
+	}
+	for (i=1; i < npath; ++i) {
+	    p = add_pair(path[0], path[i]);
+	    p->del_dest = l_del_dest;
+	    p->del_src = l_del_src;
+	    p->trunc = l_trunc;
+	    p->dest_2_src = l_dest_2_src;
+	    p->tree = l_tree;
+	    p->interval = l_interval;
+	    if (i > 1) {
+		fan_join(npairs-2, npairs-1);
+	    }
+	}
+    }
+    if (ferror(stream)) {
+	fprintf(stderr, "%s: error reading manifest: %s\n", program, filename);
+	exit(3); /*ooo*/
+	/*NOTREACHED*/
+    }
+
+    /*
+     * cleanup
+     */
+    free(line);
+    if (stream != stdin) {
+	(void) fclose(stream);
+    }
+    return;
+}
+
+
+/*
+ * setup_pairs - form temp filenames and note directories of all pairs
+ */
+static void
+setup_pairs(void)
+{
+    struct pair *p;		/* current pair */
+    char *dir;			/* directory of a src or dest */
+    int i;
+
+    for (i=0; i < npairs; ++i) {
+	p = &pairs[i];
+
+	/*
+	 * form temp filenames
+	 */
+	p->new_src = (char *)malloc(strlen(p->src) + strlen(suffix) + 1);
+	if (p->new_src == NULL) {
+	    fprintf(stderr, "%s: new_src malloc failed\n", program);
+	    exit(11);
+	}
+	sprintf(p->new_src, "%s%s", p->src, suffix);
+	p->new_dest = (char *)malloc(strlen(p->dest) + strlen(suffix) + 1);
+	if (p->new_dest == NULL) {
+	    fprintf(stderr, "%s: new_dest malloc failed\n", program);
+	    exit(12);
+	}
+	sprintf(p->new_dest, "%s%s", p->dest, suffix);
+
+	/*
+	 * note the src and dest directories
+	 */
+	split_path(p->src, &dir, &p->src_base);
+	p->src_dir = find_dir(dir);
+	split_path(p->dest, &dir, &p->dest_base);
+	p->dest_dir = find_dir(dir);
+    }
+    return;
+}
+
+
+/*
+ * find_dir - find or add a directory in dirs[]
+ *
+ * given:
+ *	path	malloced directory path, freed if already in dirs[]
+ *
+ * returns:
+ *	index of path in dirs[]
+ */
+static int
+find_dir(char *path)
+{
+    int i;
+
+    /*
+     * firewall
+     */
+    if (path == NULL) {
+	fprintf(stderr, "%s: find_dir called with NULL ptr\n", program);
+	exit(25);
+    }
+
+    /*
+     * look for the directory
+     */
+    i = dir_lookup(path, strlen(path));
+    if (i >= 0) {
+	free(path);
+	return i;
+    }
+
+    /*
+     * add the directory
+     */
+    if (ndirs >= maxdirs) {
+	maxdirs = (maxdirs > 0) ? maxdirs*2 : 16;
+	dirs = (struct dir *)realloc(dirs, maxdirs * sizeof(dirs[0]));
+	dir_hash = (int *)realloc(dir_hash, 2 * maxdirs * sizeof(dir_hash[0]));
+	if (dirs == NULL || dir_hash == NULL) {
+	    fprintf(stderr, "%s: dirs realloc failed\n", program);
+	    exit(26);
+	}
+	dir_mask = 2 * maxdirs - 1;
+	memset(dir_hash, -1, 2 * maxdirs * sizeof(dir_hash[0]));
+	for (i=0; i < ndirs; ++i) {
+	    dir_hash[dir_slot(dirs[i].path, strlen(dirs[i].path))] = i;
+	}
+    }
+    dirs[ndirs].path = path;
+    dirs[ndirs].fd = -1;
+    dirs[ndirs].valid = 0;
+    dirs[ndirs].wd = -1;
+    dir_hash[dir_slot(path, strlen(path))] = ndirs;
+    if (dir_open(ndirs) < 0) {
+	/* OK to continue, we look up the whole path */
+	debug("cannot open directory: %s: %s", path, strerror(errno));
+    }
+    return ndirs++;
+}
+
+
+/*
+ * dir_slot - find the dir_hash[] slot of a directory path
+ *
+ * given:
+ *	path	directory path, need not be NUL terminated
+ *	len	length of path
+ *
+ * returns:
+ *	slot holding the index in dirs[] of path, or the empty slot it goes in
+ */
+static unsigned int
+dir_slot(char *path, size_t len)
+{
+    unsigned int hash = 2166136261U;	/* FNV-1a */
+    size_t i;
+
+    /*
+     * firewall
+     */
+    if (path == NULL || dir_hash == NULL) {
+	fprintf(stderr, "%s: dir_slot called with NULL ptr\n", program);
+	exit(105);
+    }
+
+    /*
+     * probe from the hash of path
+     */
+    for (i=0; i < len; ++i) {
+	hash ^= (unsigned char)path[i];
+	hash *= 16777619U;
+    }
+    for (hash &= dir_mask; dir_hash[hash] >= 0; hash = (hash + 1) & dir_mask) {
+	if (strncmp(dirs[dir_hash[hash]].path, path, len) == 0 &&
+	    dirs[dir_hash[hash]].path[len] == '\0') {
+	    break;
+	}
+    }
+    return hash;
+}
+
+
+/*
+ * dir_lookup - find a directory in dirs[]
+ *
+ * given:
+ *	path	directory path, need not be NUL terminated
+ *	len	length of path
+ *
+ * returns:
+ *	index of path in dirs[], or -1 ==> not one of dirs[]
+ */
+static int
+dir_lookup(char *path, size_t len)
+{
+    /*
+     * firewall
+     */
+    if (path == NULL) {
+	fprintf(stderr, "%s: dir_lookup called with NULL ptr\n", program);
+	exit(106);
+    }
+
+    if (dir_hash == NULL) {
+	return -1;
+    }
+    return dir_hash[dir_slot(path, len)];
+}
+
+
+/*
+ * dir_open - open the directory at the path of a dirs[] entry
+ *
+ * given:
+ *	dir	index in dirs[]
+ *
+ * returns:
+ *	0 ==> opened, -1 ==> cannot open (errno set), the path is used
+ *
+ * An open descriptor is replaced in place, so that a worker using it
+ * sees the old directory or the new one, never a closed descriptor.
+ */
+static int
+dir_open(int dir)
+{
+    struct dir *d;		/* directory to open */
+    struct stat buf;		/* fstat of the directory */
+    int fd;			/* new descriptor */
+    int err;			/* saved errno */
+
+    /*
+     * firewall
+     */
+    if (dir < 0 || dir >= maxdirs) {
+	fprintf(stderr, "%s: dir_open called with bad index: %d\n", program, dir);
+	exit(107);
+    }
+    d = &dirs[dir];
+    d->recheck = now_nsec() + DIR_RECHECK;
+
+    /*
+     * open the directory
+     */
+    errno = 0;
+    fd = open(d->path, O_PATH|O_DIRECTORY|O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &buf) < 0) {
+	err = errno;
+	if (fd >= 0) {
+	    (void) close(fd);
+	}
+	__atomic_store_n(&d->valid, 0, __ATOMIC_RELEASE);
+	errno = err;
+	return -1;
+    }
+    d->dev = buf.st_dev;
+    d->ino = buf.st_ino;
+
+    /*
+     * put it in place of the old descriptor
+     */
+    if (d->fd < 0) {
+	d->fd = fd;
+    } else if (dup3(fd, d->fd, O_CLOEXEC) < 0) {
+	err = errno;
+	(void) close(fd);
+	__atomic_store_n(&d->valid, 0, __ATOMIC_RELEASE);
+	errno = err;
+	return -1;
+    } else {
+	(void) close(fd);
+    }
+    __atomic_store_n(&d->valid, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/*
+ * dir_check - reopen a directory if its path now names another directory
+ *
+ * given:
+ *	dir	index in dirs[], or -1
+ *	force	1 ==> check now, 0 ==> only once every DIR_RECHECK
+ *
+ * returns:
+ *	1 ==> the directory was reopened or can no longer be used, 0 ==> unchanged
+ *
+ * Only the main thread checks directories.
+ */
+static int
+dir_check(int dir, int force)
+{
+    struct dir *d;		/* directory to check */
+    struct stat buf;		/* stat of the directory path */
+    int valid;			/* 1 ==> the open descriptor was in use */
+    int64_t now;		/* current time */
+
+    /*
+     * nothing to check for a path that is not one of dirs[]
+     */
+    if (dir < 0 || dir >= ndirs) {
+	return 0;
+    }
+    d = &dirs[dir];
+    now = now_nsec();
+    if (!force && now < d->recheck) {
+	return 0;
+    }
+    d->recheck = now + DIR_RECHECK;
+
+    /*
+     * the same directory needs nothing
+     */
+    valid = __atomic_load_n(&d->valid, __ATOMIC_ACQUIRE);
+    errno = 0;
+    if (stat(d->path, &buf) < 0) {
+	if (valid) {
+	    debug("directory is gone: %s: %s", d->path, strerror(errno));
+	    __atomic_store_n(&d->valid, 0, __ATOMIC_RELEASE);
+	}
+	return valid;
+    }
+    if (valid && buf.st_dev == d->dev && buf.st_ino == d->ino) {
+	return 0;
+    }
+
+    /*
+     * reopen the directory, and watch it if -w
+     */
+    if (dir_open(dir) < 0) {
+	debug("cannot open directory: %s: %s", d->path, strerror(errno));
+	return valid;
+    }
+    debug("reopened replaced directory: %s", d->path);
+#if defined(HAVE_INOTIFY)
+    if (watch_fd >= 0) {
+	watch_dir(dir);
+    }
+#endif
+    return 1;
+}
+
+
+/*
+ * pr_usage - print usage message
+ *
+ * given:
+ *
+ *    stream - print usage message on stream, NULL ==> stderr
+ */
+static void
+pr_usage(FILE *stream)
+{
+    /*
+     * NULL stream means stderr
+     */
+    if (stream == NULL) {
+        stream = stderr;
+    }
+
+    /*
+     * firewall - change program if NULL
+     */
+    if (program == NULL) {
+        program = "((NULL))";
+    }
+
+    /*
+     * firewall set name if NULL
+     */
+    if (prog == NULL) {
+        prog = rindex(program, '/');
+    }
+    /* paranoia if no / is found */
+    if (prog == NULL) {
+        prog = program;
+    } else {
+	++prog;
+    }
+
+    /*
+     * print usage message to stderr
+     */
+    fprintf(stream, usage, program, prog, VERSION);
+}
+
+
+/*
+ * parse_args - parse command args
+ *
+ * given:
+ *	argc	number of args to parse
+ *	argv	command arg list
+ */
+static void
+parse_args(int argc, char *argv[])
+{
+    extern char *optarg;	/* option argument */
+    extern int optind;		/* argv index of the next arg */
+    double a_min;		/* -A min secs or -q secs */
+    double a_max;		/* -A max secs */
+    char *p;
+    int i;
+
+    /*
+     * parse command flags
+     */
+    while ((i = getopt(argc, argv, "hvVL:fwdDTct:A:q:n:j:B:HMC:UP:K:F:RW:S:e:Ory:s:m:")) != -1) {
+	switch (i) {
+	case 'h':	/* print help message */
+	    pr_usage(stderr);
+	    exit(2); /*ooo*/
+	    /*NOTREACHED*/
+	case 'v':	/* verbose output */
+	    verbose = 1;
+	    break;
+	case 'L':	/* verbose output to a log file or syslog */
+	    log_file = optarg;
+	    verbose = 1;
+	    break;
+	case 'V':	/* verbose output */
+	    printf("%s\n", VERSION);
+	    exit(2); /*ooo*/
+	    /*NOTREACHED*/
+	case 'f':	/* fork info background */
+	    fork_flag = 1;
+	    break;
+	case 'w':	/* wait for inotify events between checks */
+#if defined(HAVE_INOTIFY)
+	    watch = 1;
+#else
+	    fprintf(stderr, "%s: -w is not supported on this system\n", program);
+	    exit(3); /*ooo*/
+	    /*NOTREACHED*/
+#endif
+	    break;
+	case 'd':	/* delete dest when src file does not exist */
+	    del_dest = 1;
+	    break;
+	case 'D':	/* delete src when dest file does not exist */
+	    del_src = 1;
+	    break;
+	case 'T':	/* truncate/touch both files of one file is missing */
+	    trunc = 1;
+	    break;
+	case 'c':	/* cp dest to src if dest is newer */
+	    dest_2_src = 1;
+	    break;
+	case 't':
+	    errno = 0;
+	    interval = strtod(optarg, NULL);
+	    if (errno == ERANGE) {
+		fprintf(stderr, "%s: invalid -t interval value\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    } else if (interval <= 0.0) {
+		fprintf(stderr,
+			"%s: -t interval value must be > 0.0\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    break;
+	case 'A':	/* adaptive check interval */
+	    errno = 0;
+	    a_min = strtod(optarg, &p);
+	    a_max = (*p == ':') ? strtod(p+1, &p) : 0.0;
+	    if (errno == ERANGE || *p != '\0' || a_min <= 0.0 || a_max < a_min) {
+		fprintf(stderr,
+			"%s: -A must be min:max secs with 0.0 < min <= max\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    adapt_min = (int64_t)(a_min * (double)NSEC_PER_SEC);
+	    adapt_max = (int64_t)(a_max * (double)NSEC_PER_SEC);
+	    if (adapt_min <= 0) {
+		adapt_min = 1;
+	    }
+	    break;
+	case 'q':	/* settle time */
+	    errno = 0;
+	    a_min = strtod(optarg, &p);
+	    if (errno == ERANGE || *p != '\0' || a_min < 0.0) {
+		fprintf(stderr, "%s: -q settle secs must be >= 0.0\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    settle = (int64_t)(a_min * (double)NSEC_PER_SEC);
+	    break;
+	case 'n':
+	    errno = 0;
+	    count = strtoll(optarg, NULL, 0);
+	    if (errno == ERANGE) {
+		fprintf(stderr, "%s: invalid -n count value\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    } else if (count < 0) {
+		fprintf(stderr, "%s: -n count must be >= 0\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    break;
+	case 'j':	/* copy worker threads */
+	    errno = 0;
+	    jobs = (int)strtol(optarg, NULL, 0);
+	    if (errno == ERANGE || jobs < 0 || jobs > 1024) {
+		fprintf(stderr, "%s: -j jobs must be >= 0 and <= 1024\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    break;
+	case 'B':	/* delta block size */
+	    delta_bsize = parse_size(optarg, "-B bsize");
+	    break;
+	case 'H':	/* compare contents by digest */
+	    content_hash = 1;
+	    break;
+	case 'M':	/* sync only the attributes of same contents */
+	    meta_sync = 1;
+	    break;
+	case 'C':	/* digest cache file */
+	    cache_file = optarg;
+	    content_hash = 1;
+	    break;
+	case 'U':	/* batch checks and copy by io_uring */
+#if defined(HAVE_IO_URING)
+	    use_uring = 1;
+#else
+	    fprintf(stderr, "%s: -U is not supported on this system\n", program);
+	    exit(3); /*ooo*/
+	    /*NOTREACHED*/
+#endif
+	    break;
+	case 'P':	/* threads copying a large file */
+	    errno = 0;
+	    copy_threads = (int)strtol(optarg, NULL, 0);
+	    if (errno == ERANGE || copy_threads < 0 || copy_threads > 64) {
+		fprintf(stderr, "%s: -P threads must be >= 0 and <= 64\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    break;
+	case 'R':	/* src and dest are directory trees */
+	    tree = 1;
+	    break;
+	case 'W':	/* threads walking a tree */
+	    errno = 0;
+	    walkers = (int)strtol(optarg, NULL, 0);
+	    if (errno == ERANGE || walkers < 1 || walkers > 256) {
+		fprintf(stderr, "%s: -W walkers must be >= 1 and <= 256\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    break;
+	case 'K':	/* parallel copy chunk size */
+	    chunk_size = parse_size(optarg, "-K chunk");
+	    break;
+	case 'F':	/* page cache policy of copies */
+	    for (page_policy=0; page_policy < PAGES_CNT; ++page_policy) {
+		if (strcmp(optarg, pages_name[page_policy]) == 0) {
+		    break;
+		}
+	    }
+	    if (page_policy >= PAGES_CNT) {
+		fprintf(stderr, "%s: -F policy must be keep, drop or direct\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    break;
+	case 'e':	/* copy engine */
+	    for (force_engine=0; force_engine < ENGINE_CNT; ++force_engine) {
+		if (strcmp(optarg, engine_flag[force_engine]) == 0) {
+		    break;
+		}
+	    }
+	    if (force_engine >= ENGINE_CNT) {
+		fprintf(stderr, "%s: -e engine must be clone, direct, cfr, uring, sendfile or rw\n",
+			program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    break;
+	case 'S':	/* Prometheus stats file */
+	    stats_file = optarg;
+	    break;
+	case 'O':	/* unnamed temp files */
+#if defined(O_TMPFILE)
+	    use_tmpfile = 1;
+#else
+	    fprintf(stderr, "%s: -O is not supported on this system\n", program);
+	    exit(3); /*ooo*/
+	    /*NOTREACHED*/
+#endif
+	    break;
+	case 'r':	/* resumable copies */
+	    resume = 1;
+	    break;
+	case 'y':	/* durability of copies */
+	    for (durability=0; durability < DURABLE_CNT; ++durability) {
+		if (strcmp(optarg, durable_name[durability]) == 0) {
+		    break;
+		}
+	    }
+	    if (durability >= DURABLE_CNT) {
+		fprintf(stderr, "%s: -y level must be none, data or full\n", program);
+		exit(3); /*ooo*/
+		/*NOTREACHED*/
+	    }
+	    break;
+	case 's':	/* new file suffix */
+	    suffix = optarg;
+	    for (p=suffix; *p; ++p) {
+		if (!isascii(*p) || (!isalnum(*p) && *p != '.' && *p != '_' &&
+		    *p != '+' && *p != ',' && *p != '-')) {
+		    fprintf(stderr,
+			    "%s: -s suffux must only be [A-Za-z0-9._+,-]\n",
+			    program);
+		    exit(3); /*ooo*/
+		    /*NOTREACHED*/
+		}
+	    }
+	    break;
+	case 'm':	/* manifest of src dest pairs */
+	    manifest = optarg;
+	    break;
+	default:
+	    pr_usage(stderr);
+	    exit(3); /*ooo*/
+	    /*NOTREACHED*/
+	}
+    }
+    if (trunc && (del_dest || del_src)) {
+	fprintf(stderr, "%s: -T conflicts with -d and -D", program);
+	exit(3); /*ooo*/
+	/*NOTREACHED*/
+    }
+
+    /*
+     * parse flags
+     */
+    if (optind+2 <= argc) {
+	(void) add_pair(argv[optind], argv[optind+1]);
+	for (i=optind+2; i < argc; ++i) {
+	    (void) add_pair(argv[optind], argv[i]);
+	    fan_join(npairs-2, npairs-1);
+	}
+    } else if (optind != argc || manifest == NULL) {
+	fprintf(stderr, "%s: required to args are missing\n", program);
+	pr_usage(stderr);
+	exit(3); /*ooo*/
+	/*NOTREACHED*/
+    }
+
+    /*
+     * load the manifest if -m
+     */
+    if (manifest != NULL) {
+	load_manifest(manifest);
+	if (npairs <= 0) {
+	    fprintf(stderr, "%s: no src dest pairs in manifest: %s\n",
+		    program, manifest);
+	    exit(3); /*ooo*/
+	    /*NOTREACHED*/
+	}
+    }
+    return;
+}
+
+
+/*
+ * parse_size - parse an octet count with an optional k, m or g suffix
+ *
+ * given:
+ *	arg	string to parse
+ *	flag	command line flag being parsed, for error messages
+ *
+ * returns:
+ *	octet count > 0
+ */
+static off_t
+parse_size(char *arg, char *flag)
+{
+    char *end;			/* first character after the number */
+    long long size;		/* parsed size */
+    long long mult = 1;		/* octets in a unit of the suffix */
+
+    errno = 0;
+    size = strtoll(arg, &end, 0);
+    switch (*end) {
+    case 'g': case 'G':
+	mult *= 1024;
+	/*FALLTHRU*/
+    case 'm': case 'M':
+	mult *= 1024;
+	/*FALLTHRU*/
+    case 'k': case 'K':
+	mult *= 1024;
+	++end;
+	break;
+    }
+    if (size > LLONG_MAX / mult) {
+	fprintf(stderr, "%s: %s is too large\n", program, flag);
+	exit(3); /*ooo*/
+	/*NOTREACHED*/
+    }
+    size *= mult;
+    if (errno == ERANGE || *end != '\0' || size <= 0) {
+	fprintf(stderr, "%s: %s must be a size > 0 with an optional k, m or g suffix\n",
+		program, flag);
+	exit(3); /*ooo*/
+	/*NOTREACHED*/
+    }
+    return (off_t)size;
+}
+
+
+/*
+ * split_path - split a path into a directory and a basename
+ *
+ * given:
+ *	path	path to split
+ *	dir	where to store the malloced directory name
+ *	base	where to store the basename, points into path
+ *
+ * A path without a / is in the current directory, ".".
+ */
+static void
+split_path(char *path, char **dir, char **base)
+{
+    char *p;			/* last / in path */
+
+    /*
+     * firewall
+     */
+    if (path == NULL || dir == NULL || base == NULL) {
+	fprintf(stderr, "%s: split_path called with NULL ptr\n", program);
+	exit(15);
+    }
+
+    /*
+     * split on the last /
+     */
+    p = rindex(path, '/');
+    if (p == NULL) {
+	*dir = strdup(".");
+	*base = path;
+    } else if (p == path) {
+	*dir = strdup("/");
+	*base = p+1;
+    } else {
+	*dir = strndup(path, p-path);
+	*base = p+1;
+    }
+    if (*dir == NULL) {
+	fprintf(stderr, "%s: split_path strdup failed\n", program);
+	exit(16);
+    }
+    return;
+}
+
+
+/*
+ * heap_push - add a pair to the scheduler heap
+ *
+ * given:
+ *	i	index in pairs[] of the pair to add
+ */
+static void
+heap_push(int i)
+{
+    /*
+     * firewall
+     */
+    if (i < 0 || i >= npairs || nheap >= npairs) {
+	fprintf(stderr, "%s: heap_push bad pair: %d\n", program, i);
+	exit(28);
+    }
+
+    /*
+     * add to the bottom and sift up
+     */
+    heap[nheap] = i;
+    pairs[i].heap_pos = nheap++;
+    heap_fix(i);
+    return;
+}
+
+
+/*
+ * heap_pop - remove the pair that is due next from the scheduler heap
+ *
+ * returns:
+ *	index in pairs[] of the pair that is due next
+ */
+static int
+heap_pop(void)
+{
+    int i;			/* pair that is due next */
+
+    /*
+     * firewall
+     */
+    if (nheap <= 0) {
+	fprintf(stderr, "%s: heap_pop on empty heap\n", program);
+	exit(29);
+    }
+
+    /*
+     * move the bottom to the top and sift down
+     */
+    i = heap[0];
+    pairs[i].heap_pos = -1;
+    if (--nheap > 0) {
+	heap[0] = heap[nheap];
+	pairs[heap[0]].heap_pos = 0;
+	heap_fix(heap[0]);
+    }
+    return i;
+}
+
+
+/*
+ * heap_fix - restore heap order after the next_due of a pair changed
+ *
+ * given:
+ *	i	index in pairs[] of a pair in the heap
+ */
+static void
+heap_fix(int i)
+{
+    int pos;			/* heap position of pair i */
+    int up;			/* parent heap position */
+    int down;			/* earliest child heap position */
+
+    /*
+     * firewall
+     */
+    if (i < 0 || i >= npairs || pairs[i].heap_pos < 0) {
+	fprintf(stderr, "%s: heap_fix bad pair: %d\n", program, i);
+	exit(30);
+    }
+    pos = pairs[i].heap_pos;
+
+    /*
+     * sift up while due before our parent
+     */
+    while (pos > 0) {
+	up = (pos-1) / 2;
+	if (pairs[heap[up]].next_due <= pairs[i].next_due) {
+	    break;
+	}
+	heap[pos] = heap[up];
+	pairs[heap[pos]].heap_pos = pos;
+	pos = up;
+    }
+
+    /*
+     * sift down while due after our earliest child
+     */
+    for (down = 2*pos+1; down < nheap; down = 2*pos+1) {
+	if (down+1 < nheap &&
+	    pairs[heap[down+1]].next_due < pairs[heap[down]].next_due) {
+	    ++down;
+	}
+	if (pairs[i].next_due <= pairs[heap[down]].next_due) {
+	    break;
+	}
+	heap[pos] = heap[down];
+	pairs[heap[pos]].heap_pos = pos;
+	pos = down;
+    }
+    heap[pos] = i;
+    pairs[i].heap_pos = pos;
+    return;
+}
+
+
+/*
+ * next_period - return the -A interval until the next check of a pair
+ *
+ * given:
+ *	p	pair just checked
+ *
+ * returns:
+ *	nanoseconds until the next check, with jitter
+ */
+static int64_t
+next_period(struct pair *p)
+{
+    uint64_t r;			/* random bits */
+    int64_t spread;		/* width of the jitter */
+
+    /*
+     * firewall
+     */
+    if (p == NULL) {
+	fprintf(stderr, "%s: next_period called with NULL ptr\n", program);
+	exit(76);
+    }
+
+    /*
+     * min after a change, else back off to max
+     */
+    if (p->changed || p->period <= 0) {
+	p->period = adapt_min;
+    } else if (p->period < adapt_max / 2) {
+	p->period *= 2;
+    } else {
+	p->period = adapt_max;
+    }
+
+    /*
+     * xorshift64* is plenty for jitter
+     */
+    if (jitter_state == 0) {
+	jitter_state = ((uint64_t)now_nsec() ^ ((uint64_t)getpid() << 32)) | 1;
+    }
+    jitter_state ^= jitter_state >> 12;
+    jitter_state ^= jitter_state << 25;
+    jitter_state ^= jitter_state >> 27;
+    r = jitter_state * UINT64_C(0x2545F4914F6CDD1D);
+    spread = 2 * (p->period / ADAPT_JITTER) + 1;
+    return p->period - p->period / ADAPT_JITTER + (int64_t)(r % (uint64_t)spread);
+}
+
+
+/*
+ * settle_wait - return how long until a file has gone -q secs unwritten
+ *
+ * given:
+ *	buf	fstat of the file
+ *
+ * returns:
+ *	nanoseconds to wait, 0 ==> the file has settled
+ *
+ * Every write sets the mod time, so a file whose mod time is at least
+ * -q secs old has not been written for -q secs.  A mod time in the
+ * future waits no longer than -q secs.
+ */
+static int64_t
+settle_wait(struct stat *buf)
+{
+    struct timespec now;	/* CLOCK_REALTIME time */
+    int64_t age;		/* nanoseconds since the last write */
+
+    /*
+     * firewall
+     */
+    if (buf == NULL) {
+	fprintf(stderr, "%s: settle_wait called with NULL ptr\n", program);
+	exit(77);
+    }
+
+    (void) clock_gettime(CLOCK_REALTIME, &now);
+    age = ((int64_t)now.tv_sec - buf->st_mtim.tv_sec) * NSEC_PER_SEC +
+	  (now.tv_nsec - buf->st_mtim.tv_nsec);
+    if (age >= settle) {
+	return 0;
+    } else if (age < 0) {
+	return settle;
+    }
+    return settle - age;
+}
+
+
+/*
+ * now_nsec - return the CLOCK_MONOTONIC time in nanoseconds
+ */
+static int64_t
+now_nsec(void)
+{
+    struct timespec now;	/* current time */
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * NSEC_PER_SEC + (int64_t)now.tv_nsec;
+}
+
+
+/*
+ * sleep_until - sleep until a CLOCK_MONOTONIC time
+ *
+ * given:
+ *	when	CLOCK_MONOTONIC nanoseconds to wake up at
+ *
+ * We sleep until an absolute time so that the time taken by a cycle
+ * does not add to the time between cycles.
+ */
+static void
+sleep_until(int64_t when)
+{
+    struct timespec wake;	/* time to wake up */
+    int ret;			/* clock_nanosleep return */
+
+    /*
+     * setup to sleep
+     */
+    wake.tv_sec = (time_t)(when / NSEC_PER_SEC);
+    wake.tv_nsec = (long)(when % NSEC_PER_SEC);
+
+    /*
+     * sleep until finished
+     */
+    do {
+	ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+    } while (ret == EINTR);
+    return;
+}
+
+
+#if defined(HAVE_INOTIFY)
+/*
+ * watch_hash_of - hash a watch descriptor and basename
+ *
+ * given:
+ *	wd	inotify watch descriptor
+ *	name	basename within the watched directory
+ *
+ * returns:
+ *	index into watch_hash[]
+ */
+static unsigned int
+watch_hash_of(int wd, char *name)
+{
+    unsigned int hash = 2166136261U ^ (unsigned int)wd;	/* FNV-1a */
+
+    while (*name) {
+	hash ^= (unsigned char)*name++;
+	hash *= 16777619U;
+    }
+    return hash & watch_mask;
+}
+
+
+/*
+ * watch_setup - watch the src and dest directories for changes
+ *
+ * We watch the directories, not the files, so that we learn when
+ * a missing file is created, or when a file is replaced by a rename.
+ */
+static void
+watch_setup(void)
+{
+    unsigned int size;		/* size of watch_hash[] */
+    int i;
+
+    /*
+     * create the inotify instance
+     */
+    errno = 0;
+    watch_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (watch_fd < 0) {
+	fprintf(stderr, "%s: inotify_init1 failed: %s\n",
+		program, strerror(errno));
+	exit(17);
+    }
+
+    /*
+     * create the timer that ends a wait when the next pair is due
+     */
+    errno = 0;
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (timer_fd < 0) {
+	fprintf(stderr, "%s: timerfd_create failed: %s\n",
+		program, strerror(errno));
+	exit(31);
+    }
+
+    /*
+     * watch each directory once
+     *
+     * inotify returns the same wd if two paths name the same directory.
+     */
+    for (i=0; i < ndirs; ++i) {
+	errno = 0;
+	dirs[i].wd = inotify_add_watch(watch_fd, dirs[i].path, WATCH_MASK);
+	if (dirs[i].wd < 0) {
+	    fprintf(stderr, "%s: cannot watch directory: %s: %s\n",
+		    program, dirs[i].path, strerror(errno));
+	    exit(18);
+	}
+	debug("watching directory: %s", dirs[i].path);
+    }
+
+    /*
+     * hash the src and dest endpoints of every pair
+     */
+    for (size=16; size < 4U*(unsigned int)npairs; size *= 2) {
+    }
+    watch_mask = size - 1;
+    watch_hash = (int *)malloc(size * sizeof(watch_hash[0]));
+    watch_next = (int *)malloc(2 * npairs * sizeof(watch_next[0]));
+    if (watch_hash == NULL || watch_next == NULL) {
+	fprintf(stderr, "%s: watch hash malloc failed\n", program);
+	exit(19);
+    }
+    watch_rehash();
+    return;
+}
+
+
+/*
+ * watch_rehash - hash the src and dest endpoints of every pair by watch
+ */
+static void
+watch_rehash(void)
+{
+    struct pair *p;		/* current pair */
+    unsigned int h;		/* hash of an endpoint */
+    int e;			/* endpoint */
+
+    memset(watch_hash, -1, (watch_mask + 1) * sizeof(watch_hash[0]));
+    for (e=0; e < 2*npairs; ++e) {
+	p = &pairs[e/2];
+	if (e & 1) {
+	    h = watch_hash_of(dirs[p->dest_dir].wd, p->dest_base);
+	} else {
+	    h = watch_hash_of(dirs[p->src_dir].wd, p->src_base);
+	}
+	watch_next[e] = watch_hash[h];
+	watch_hash[h] = e;
+    }
+    return;
+}
+
+
+/*
+ * watch_dir - watch a directory that replaced the one we watched
+ *
+ * given:
+ *	dir	index in dirs[]
+ *
+ * The watch of the old directory is left alone: its events no longer
+ * match any endpoint.
+ */
+static void
+watch_dir(int dir)
+{
+    int wd;			/* watch descriptor of the directory */
+
+    /*
+     * firewall
+     */
+    if (dir < 0 || dir >= ndirs) {
+	fprintf(stderr, "%s: watch_dir called with bad index: %d\n", program, dir);
+	exit(108);
+    }
+
+    errno = 0;
+    wd = inotify_add_watch(watch_fd, dirs[dir].path, WATCH_MASK);
+    if (wd < 0) {
+	/* OK to continue, -t rescans find its changes */
+	debug("cannot watch directory: %s: %s", dirs[dir].path, strerror(errno));
+	return;
+    }
+    if (wd != dirs[dir].wd) {
+	dirs[dir].wd = wd;
+	watch_rehash();
+	debug("watching directory: %s", dirs[dir].path);
+    }
+    return;
+}
+
+
+/*
+ * watch_wait - wait for the src or dest of some pair to change
+ *
+ * given:
+ *	until		CLOCK_MONOTONIC nanoseconds when the wait ends
+ *
+ * returns:
+ *	number of pairs that changed and are now due, 0 ==> timeout
+ *
+ * Events on other files in the watched directories, such as our
+ * own temp files, do not end the wait.  Nor does an event that leaves
+ * src and dest alike, such as our own rename of a copy into place.
+ */
+static int
+watch_wait(int64_t until)
+{
+    char buf[8 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;	/* current event */
+    struct itimerspec timer;	/* when the wait ends */
+    struct pollfd pfd[2];	/* inotify and timer descriptors to poll */
+    uint64_t expired;		/* timer expiration count */
+    struct pair *q;		/* pair of an endpoint */
+    int64_t now;		/* current time */
+    ssize_t len;		/* length of events read */
+    char *p;
+    int changed = 0;		/* number of pairs now due */
+    int e;			/* endpoint */
+    int i;
+
+    /*
+     * arm the timer for when the wait ends
+     */
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = (time_t)(until / NSEC_PER_SEC);
+    timer.it_value.tv_nsec = (long)(until % NSEC_PER_SEC);
+    errno = 0;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+	debug("timerfd_settime failed: %s", strerror(errno));
+	sleep_until(until);
+	return 0;
+    }
+
+    /*
+     * wait for events until we see a change or the timer expires
+     */
+    pfd[0].fd = watch_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = timer_fd;
+    pfd[1].events = POLLIN;
+    while (changed == 0) {
+
+	/* wait for an event or the timer */
+	errno = 0;
+	if (poll(pfd, 2, -1) <= 0) {
+	    /* EINTR is the only OK error */
+	    if (errno != 0 && errno != EINTR) {
+		debug("poll failed: %s", strerror(errno));
+		sleep_until(until);
+		break;
+	    }
+	    continue;
+	}
+
+	/* drain all pending events */
+	now = now_nsec();
+	while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+	    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+		ev = (struct inotify_event *)p;
+
+		/* lost events, so every pair may have changed */
+		if (ev->mask & IN_Q_OVERFLOW) {
+		    debug("inotify queue overflow");
+		    for (i=0; i < npairs; ++i) {
+			if (pairs[i].heap_pos >= 0 && pairs[i].next_due > now) {
+			    pairs[i].next_due = now;
+			    heap_fix(i);
+			    ++changed;
+			}
+		    }
+		    continue;
+		}
+		if (ev->len == 0) {
+		    continue;
+		}
+
+		/* make due each pair with this src or dest */
+		for (e = watch_hash[watch_hash_of(ev->wd, ev->name)]; e >= 0;
+		     e = watch_next[e]) {
+		    q = &pairs[e/2];
+		    if ((e & 1) ?
+			 (dirs[q->dest_dir].wd != ev->wd ||
+			  strcmp(q->dest_base, ev->name) != 0) :
+			 (dirs[q->src_dir].wd != ev->wd ||
+			  strcmp(q->src_base, ev->name) != 0)) {
+			continue;
+		    }
+		    if (q->heap_pos >= 0 && q->next_due > now) {
+			if (watch_similar(q)) {
+			    debug("event 0x%x on: %s leaves it like its %s, ignored",
+				  ev->mask, (e & 1) ? q->dest : q->src, (e & 1) ? "src" : "dest");
+			    continue;
+			}
+			debug("event 0x%x on: %s", ev->mask, (e & 1) ? q->dest : q->src);
+			q->next_due = now;
+			heap_fix(e/2);
+			++changed;
+		    }
+		}
+	    }
+	}
+
+	/* the timer expired */
+	if (read(timer_fd, &expired, sizeof(expired)) == sizeof(expired)) {
+	    break;
+	}
+    }
+    return changed;
+}
+
+
+/*
+ * watch_similar - determine if an event left the src and dest of a pair alike
+ *
+ * given:
+ *	p	pair with an event on its src or dest
+ *
+ * returns:
+ *	1 ==> src and dest are regular files that a check would leave be,
+ *	0 ==> they differ, or cannot tell
+ *
+ * Our own copy renamed into place, or its attributes synced, leaves src
+ * and dest with the same mode, length and time to the nanosecond, and
+ * with -M the same owner, so the event it raises need not wake us.
+ * With -H contents decide, so every event wakes us.
+ */
+static int
+watch_similar(struct pair *p)
+{
+    struct stat src_buf;	/* src status */
+    struct stat dest_buf;	/* dest status */
+    char *name;			/* name in dirfd */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+
+    /*
+     * firewall
+     */
+    if (p == NULL) {
+	fprintf(stderr, "%s: watch_similar called with NULL ptr\n", program);
+	exit(115);
+    }
+    if (content_hash) {
+	return 0;
+    }
+
+    /*
+     * compare what a check would
+     */
+    name = at_dir(p->src_dir, p->src_base, p->src, &dirfd);
+    if (fstatat(dirfd, name, &src_buf, AT_SYMLINK_NOFOLLOW) < 0) {
+	return 0;
+    }
+    name = at_dir(p->dest_dir, p->dest_base, p->dest, &dirfd);
+    if (fstatat(dirfd, name, &dest_buf, AT_SYMLINK_NOFOLLOW) < 0) {
+	return 0;
+    }
+    return S_ISREG(src_buf.st_mode) && S_ISREG(dest_buf.st_mode) &&
+	   src_buf.st_mode == dest_buf.st_mode &&
+	   src_buf.st_size == dest_buf.st_size &&
+	   src_buf.st_mtim.tv_sec == dest_buf.st_mtim.tv_sec &&
+	   src_buf.st_mtim.tv_nsec == dest_buf.st_mtim.tv_nsec &&
+	   (!meta_sync || (src_buf.st_uid == dest_buf.st_uid &&
+			   src_buf.st_gid == dest_buf.st_gid));
+}
+#endif
+
+
+/*
+ * debug - queue a debug message (if -v) for the log
+ *
+ * given:
+ *	fmt	printf-like format of the main part of the debug message
+ *	...	optional debug message args
+ */
+static void
+debug(char *fmt, ...)
+{
+    struct timespec now;	/* CLOCK_REALTIME_COARSE time */
+    struct log_msg *m;		/* slot of the message */
+    uint64_t pos;		/* position of the message */
+    uint64_t seq;		/* seq of the slot at pos */
+    va_list ap;		/* argument pointer */
+    int len;			/* length of the whole message */
+
+    /* only output if verbose (-v) */
+    if (!verbose) {
+	return;
+    }
+    (void) clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+    /*
+     * claim the next free slot
+     */
+    pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    for (;;) {
+	m = &log_ring[pos & LOG_RING_MASK];
+	seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+	if (seq == (pos & ~LOG_RING_MASK)) {
+	    /* free: on failure pos is the new log_tail */
+	    if (__atomic_compare_exchange_n(&log_tail, &pos, pos+1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		break;
+	    }
+	} else if (seq < (pos & ~LOG_RING_MASK)) {
+	    /* the ring is full, drain it unless someone else is */
+	    if (pthread_mutex_trylock(&log_lock) == 0) {
+		log_drain();
+		pthread_mutex_unlock(&log_lock);
+	    } else {
+		sched_yield();
+	    }
+	    pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	} else {
+	    /* another thread claimed pos */
+	    pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	}
+    }
+
+    /*
+     * format the message into the slot, then hand the slot to the consumer
+     */
+    m->when = (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+    va_start(ap, fmt);
+    len = vsnprintf(m->text, LOG_MSG_MAX, fmt, ap);
+    va_end(ap);
+    if (len >= LOG_MSG_MAX) {
+	strcpy(m->text + LOG_MSG_MAX - sizeof(LOG_MORE), LOG_MORE);
+    }
+    __atomic_store_n(&m->seq, (pos & ~LOG_RING_MASK) + 1, __ATOMIC_RELEASE);
+
+    /*
+     * wake the log thread if it waits, the fence pairs with log_thread()
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED)) {
+	pthread_mutex_lock(&log_wake_lock);
+	pthread_cond_signal(&log_wake);
+	pthread_mutex_unlock(&log_wake_lock);
+    }
+    return;
+}
+
+
+/*
+ * log_setup - open the -L log and arrange for it to be drained at exit
+ */
+static void
+log_setup(void)
+{
+    char *name;			/* basename of program */
+
+    /*
+     * open the log
+     */
+    if (log_file == NULL) {
+	log_stream = stdout;
+    } else if (strcmp(log_file, "syslog") == 0) {
+	name = strrchr(program, '/');
+	openlog(name == NULL ? program : name+1, LOG_PID, LOG_DAEMON);
+	log_stream = NULL;
+    } else {
+	errno = 0;
+	log_stream = fopen(log_file, "a");
+	if (log_stream == NULL) {
+	    fprintf(stderr, "%s: cannot open log: %s: %s\n",
+		    program, log_file, strerror(errno));
+	    exit(73);
+	}
+    }
+    if (atexit(log_finish) != 0) {
+	fprintf(stderr, "%s: cannot register the log drain\n", program);
+	exit(74);
+    }
+}
+
+
+/*
+ * log_start - start the log thread
+ */
+static void
+log_start(void)
+{
+    pthread_t tid;		/* log thread */
+    pthread_attr_t attr;	/* detached thread attributes */
+    int ret;			/* pthread return */
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&tid, &attr, log_thread, NULL);
+    if (ret != 0) {
+	fprintf(stderr, "%s: cannot start the log thread: %s\n",
+		program, strerror(ret));
+	exit(75);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+
+/*
+ * log_thread - drain the log ring whenever a message is queued
+ *
+ * given:
+ *	arg	unused
+ *
+ * returns:
+ *	never returns
+ *
+ * We say we sleep before we look at the ring one last time, and
+ * debug() fills its slot before it looks at log_sleeping, so either we
+ * see the message or its producer sees us waiting and signals.
+ */
+static void *
+log_thread(void *arg)
+{
+    struct log_msg *m;		/* slot of the next message */
+    uint64_t head;		/* position of the next message */
+
+    for (;;) {
+	pthread_mutex_lock(&log_lock);
+	log_drain();
+	pthread_mutex_unlock(&log_lock);
+
+	/* wait for the next message */
+	pthread_mutex_lock(&log_wake_lock);
+	__atomic_store_n(&log_sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (;;) {
+	    head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	    m = &log_ring[head & LOG_RING_MASK];
+	    if (__atomic_load_n(&m->seq, __ATOMIC_ACQUIRE) == (head & ~LOG_RING_MASK) + 1) {
+		break;
+	    }
+	    pthread_cond_wait(&log_wake, &log_wake_lock);
+	}
+	__atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&log_wake_lock);
+    }
+    /*NOTREACHED*/
+    return NULL;
+}
+
+
+/*
+ * log_drain - write the messages in the log ring, log_lock must be held
+ *
+ * Stops at the first slot claimed but not yet filled, so messages are
+ * written in the order they were claimed.
+ */
+static void
+log_drain(void)
+{
+    struct log_msg *m;		/* slot of the next message */
+    uint64_t round;		/* round of log_head */
+    int written = 0;		/* messages written */
+
+    for (;;) {
+	m = &log_ring[log_head & LOG_RING_MASK];
+	round = log_head & ~LOG_RING_MASK;
+	if (__atomic_load_n(&m->seq, __ATOMIC_ACQUIRE) != round + 1) {
+	    break;
+	}
+	if (log_stream == NULL) {
+	    syslog(LOG_DEBUG, "%s", m->text);
+	} else {
+	    fprintf(log_stream, "%s:%lld.%06ld: %s\n", program,
+		    (long long)(m->when / NSEC_PER_SEC),
+		    (long)(m->when % NSEC_PER_SEC / 1000), m->text);
+	}
+	__atomic_store_n(&m->seq, round + LOG_SLOTS, __ATOMIC_RELEASE);
+	__atomic_store_n(&log_head, log_head + 1, __ATOMIC_RELAXED);
+	++written;
+    }
+    if (written > 0 && log_stream != NULL) {
+	fflush(log_stream);
+    }
+}
+
+
+/*
+ * log_finish - write what is left in the log ring
+ */
+static void
+log_finish(void)
+{
+    pthread_mutex_lock(&log_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_lock);
+}
+
+
+/*
+ * copy_file - copy from one file to another in a safe atomic fashion
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	src_buf		pointer to fstat of from_fd
+ *	from		name of file being copied from
+ *	new_to		temp filename in same directory as to
+ *	to		filename being copied into
+ *	fan		other dests to copy the from file into, or NULL
+ *	detected	CLOCK_MONOTONIC when the change was found
+ *	started		CLOCK_MONOTONIC when the copy started
+ *
+ * We copy into a temp filename and then rename it to the destination.
+ * This means that the to file will never contain a partial copy
+ * of the from file.  The to file will either have its original contents
+ * or the contents of the from file ... nothing in between.
+ *
+ * This function also sets the modification time of the to file
+ * to match the from file.
+ *
+ * If the from file was written while we copied it, the temp file may
+ * hold a torn mix of old and new data, so we discard it and let a later
+ * check copy the from file again.
+ *
+ * With -r, a large copy that fails keeps its temp file and checkpoint,
+ * and the next copy of the unchanged from file continues from there.
+ *
+ * The other dests of a fan-out get their data as it is copied into our
+ * temp file, and their fan->dest[i].ret as we would return for them.
+ *
+ * returns:
+ *	0 ==> copied, 1 ==> from file changed so nothing copied, -1 ==> not copied
+ */
+static int
+copy_file(int from_fd, struct stat *src_buf, char *from, char *new_to, char *to,
+	  struct fan *fan, int64_t detected, int64_t started)
+{
+    int to_fd = -1;		/* temp file open file descriptor */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* name to open in dirfd */
+    char fd_path[sizeof("/proc/self/fd/") + 3*sizeof(int)];	/* -O temp file */
+    char *temp = new_to;	/* name to open the temp file by */
+    int unnamed = 0;		/* 1 ==> -O temp file has no name */
+    struct resume_state rs;	/* -r checkpoint of the copy */
+    struct resume_state *rsp = NULL;	/* &rs ==> the copy is resumable */
+    int ret = 0;		/* copy return */
+
+    /*
+     * firewall
+     */
+    if (from_fd < 0) {
+	fprintf(stderr, "%s: copy_file from_fd < 0: %d\n", program, from_fd);
+	exit(13);
+    }
+    if (src_buf == NULL || from == NULL || new_to == NULL || to == NULL) {
+	fprintf(stderr, "%s: called with NULL ptr\n", program);
+	exit(14);
+    }
+
+    /*
+     * open the temp from file
+     *
+     * The temp file is owner writable until the copy is done, so that
+     * -P threads and the O_DIRECT engine can open it again.  We set
+     * its mode after the copy.  With -O it has no name until it is
+     * complete, and is opened again by its /proc/self/fd name.  With -r,
+     * a large file continues an earlier copy into its named temp file.
+     */
+    if (resume && src_buf->st_size >= RESUME_MIN) {
+	rsp = &rs;
+	to_fd = resume_open(src_buf, new_to, rsp);
+    } else if (use_tmpfile) {
+	to_fd = temp_open(to);
+	if (to_fd >= 0) {
+	    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", to_fd);
+	    temp = fd_path;
+	    unnamed = 1;
+	}
+    }
+    if (to_fd < 0) {
+	debug("opening temp file: %s", new_to);
+	name = at_path(new_to, &dirfd);
+	errno = 0;
+	to_fd = openat(dirfd, name, O_CREAT|O_EXCL|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
+	if (to_fd < 0) {
+	    debug("unable to open temp file: %s: %s", new_to, strerror(errno));
+	    fan_discard(fan, -1);
+	    return -1;
+	}
+    }
+    (void) flock(to_fd, LOCK_EX|LOCK_NB);	/* so temp_name() knows the temp is ours */
+    if (fan != NULL) {
+	fan_open(fan, from_fd, src_buf->st_size);
+    }
+
+    /*
+     * send data from the from file to the to file :-)
+     */
+    if (src_buf->st_size > 0) {
+	debug("copying %lld octets %s ==> %s",
+	      (long long)src_buf->st_size, from, temp);
+	ret = 1;
+	if (delta_bsize > 0 && (rsp == NULL || rs.done == 0)) {
+	    ret = copy_delta(from_fd, src_buf, to_fd, from, temp, to);
+	}
+	if (ret > 0) {
+	    ret = copy_data(from_fd, to_fd, src_buf->st_size, from, temp, rsp, fan);
+	}
+	if (ret == 0) {
+	    fan_copy(fan, to_fd, temp, src_buf->st_size);
+	}
+	if (ret < 0 && rsp != NULL && rs.done > 0) {
+	    debug("keeping %s to resume the copy at %lld", new_to, (long long)rs.done);
+	    (void) close(to_fd);
+	    fan_discard(fan, -1);
+	    return -1;
+	} else if (ret < 0) {
+	    temp_discard(to_fd, new_to, unnamed);
+	    fan_discard(fan, -1);
+	    return -1;
+	}
+    } else {
+	debug("src is empty, creating empty %s", temp);
+    }
+
+    /*
+     * discard the copy if the from file was written during the copy
+     */
+    if (ret > 0 || from_changed(from_fd, src_buf)) {
+	debug("%s changed during the copy, discarding %s", from, temp);
+	temp_discard(to_fd, new_to, unnamed);
+	fan_discard(fan, 1);
+	return 1;
+    }
+
+    /*
+     * move the new files into place
+     */
+    fan_finish(fan, src_buf, from, detected, started);
+    ret = temp_finish(to_fd, src_buf, from, temp, unnamed, new_to, to, detected, started);
+    if (rsp != NULL) {
+	resume_remove(new_to);
+    }
+    return ret;
+}
+
+
+/*
+ * temp_finish - give a complete temp file the attributes of the from file
+ *		 and rename it into place
+ *
+ * given:
+ *	to_fd		open temp file descriptor, closed on return
+ *	src_buf		pointer to fstat of the from file
+ *	from		name of file being copied from
+ *	temp		name to open the temp file by
+ *	unnamed		1 ==> -O temp file, temp is its /proc/self/fd name
+ *	new_to		temp filename in same directory as to
+ *	to		filename being copied into
+ *	detected	CLOCK_MONOTONIC when the change was found
+ *	started		CLOCK_MONOTONIC when the copy started
+ *
+ * returns:
+ *	0 ==> renamed into place, or queued for a -y full group commit,
+ *	-1 ==> temp file discarded
+ */
+static int
+temp_finish(int to_fd, struct stat *src_buf, char *from, char *temp,
+	    int unnamed, char *new_to, char *to, int64_t detected, int64_t started)
+{
+    char *link_name;		/* name the -O temp file was linked to */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* name to open in dirfd */
+    struct timespec times[2];	/* access and modification time to set */
+
+    /*
+     * firewall
+     */
+    if (src_buf == NULL || from == NULL || temp == NULL || new_to == NULL || to == NULL) {
+	fprintf(stderr, "%s: temp_finish called with NULL ptr\n", program);
+	exit(92);
+    }
+
+    /*
+     * set mode
+     */
+    errno = 0;
+    if (fchmod(to_fd, src_buf->st_mode) < 0) {
+	debug("cannot chmod %s %03o: %s",
+	      temp, src_buf->st_mode, strerror(errno));
+	temp_discard(to_fd, new_to, unnamed);
+	return -1;
+    }
+
+    /*
+     * set ownership and group if we are root
+     */
+    if (uid == 0 && fchown(to_fd, src_buf->st_uid, src_buf->st_gid) < 0) {
+	debug("unable to chown %d.%d of %s: %s",
+	      src_buf->st_uid, src_buf->st_gid, temp,
+	      strerror(errno));
+	debug("will continue anyway");
+	/* OK to continue */
+    }
+
+    /*
+     * set new file attributes, to the nanosecond
+     */
+    times[0] = src_buf->st_atim;
+    times[1] = src_buf->st_mtim;
+    errno = 0;
+    if (futimens(to_fd, times) < 0) {
+	debug("unable to set file time on %s: %s", temp, strerror(errno));
+	temp_discard(to_fd, new_to, unnamed);
+	return -1;
+    }
+
+    /*
+     * -y data: the data must be on disk before the rename
+     */
+    errno = 0;
+    if (durability == DURABLE_DATA && !unnamed && fdatasync(to_fd) < 0) {
+	debug("cannot fdatasync %s: %s", temp, strerror(errno));
+	temp_discard(to_fd, new_to, unnamed);
+	return -1;
+    }
+
+    /*
+     * -O: the data must be on disk before the file has a name, but -y
+     * full syncs it with its group commit, before the name is the dest
+     */
+    link_name = new_to;
+    if (unnamed) {
+	errno = 0;
+	if (durability != DURABLE_FULL && fsync(to_fd) < 0) {
+	    debug("cannot fsync %s: %s", temp, strerror(errno));
+	    temp_discard(to_fd, new_to, unnamed);
+	    return -1;
+	}
+	link_name = temp_link(temp, new_to);
+	if (link_name == NULL) {
+	    temp_discard(to_fd, new_to, unnamed);
+	    return -1;
+	}
+    }
+
+    /*
+     * -y full: sync and rename it with the next group commit
+     */
+    if (durability == DURABLE_FULL) {
+	durable_add(to_fd, link_name, to, from, src_buf, detected, started);
+	if (link_name != new_to) {
+	    free(link_name);
+	}
+	return 0;
+    }
+
+    /*
+     * close up the complete and new file
+     */
+    (void) close(to_fd);
+
+    /*
+     * move new file into place
+     */
+    debug("rename %s ==> %s", link_name, to);
+    if (at_rename(link_name, to) < 0) {
+	debug("move %s to %s failed: %s", link_name, to, strerror(errno));
+	name = at_path(link_name, &dirfd);
+	(void) unlinkat(dirfd, name, 0);
+	if (link_name != new_to) {
+	    free(link_name);
+	}
+	return -1;
+    }
+    if (link_name != new_to) {
+	free(link_name);
+    }
+    if (cache != NULL) {
+	cache_copied(from, src_buf, to);
+    }
+    debug("completed sync %s ==> %s", from, to);
+    return 0;
+}
+
+
+/*
+ * fan_collect - find the other dests of a pair that need the copy of its src
+ *
+ * given:
+ *	p		pair whose src is being copied to its dest
+ *	from_buf	fstat of the src
+ *
+ * returns:
+ *	malloced fan of the other dests, or NULL ==> none
+ *
+ * The pairs of the dests found are in flight until fan_release().
+ */
+static struct fan *
+fan_collect(struct pair *p, struct stat *from_buf)
+{
+    struct fan *fan;		/* other dests found */
+    struct fan_dest *d;		/* dest being added */
+    struct pair *s;		/* another pair with the same src */
+    int busy;			/* 1 ==> a worker is copying s */
+    int n = 0;			/* other pairs with the same src */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (p == NULL || from_buf == NULL) {
+	fprintf(stderr, "%s: fan_collect called with NULL ptr\n", program);
+	exit(93);
+    }
+
+    /*
+     * count the other pairs in the ring of p
+     */
+    if (p->entry || p->tree || p->fan_next == p - pairs) {
+	return NULL;
+    }
+    for (i = p->fan_next; i != p - pairs; i = pairs[i].fan_next) {
+	++n;
+    }
+    fan = (struct fan *)malloc(sizeof(*fan) + n * sizeof(fan->dest[0]));
+    if (fan == NULL) {
+	fprintf(stderr, "%s: fan-out malloc failed\n", program);
+	exit(94);
+    }
+
+    /*
+     * add each dest that would copy this src too, unless it is in flight
+     */
+    fan->n = 0;
+    for (i = p->fan_next; i != p - pairs; i = pairs[i].fan_next) {
+	s = &pairs[i];
+	if (!fan_wants(s, from_buf)) {
+	    continue;
+	}
+	if (jobs > 0) {
+	    pthread_mutex_lock(&pool_lock);
+	    busy = s->in_flight;
+	    s->in_flight = 1;
+	    pthread_mutex_unlock(&pool_lock);
+	    if (busy) {
+		debug("copy in flight: %s ==> %s", s->src, s->dest);
+		continue;
+	    }
+	}
+	debug("also copying %s to %s", s->src, s->dest);
+	s->changed = 1;
+	d = &fan->dest[fan->n++];
+	d->pair = i;
+	d->new_to = s->new_dest;
+	d->to = s->dest;
+	d->to_fd = -1;
+	d->ret = -1;
+    }
+    if (fan->n <= 0) {
+	free(fan);
+	return NULL;
+    }
+    return fan;
+}
+
+
+/*
+ * fan_wants - determine if the dest of a pair would be copied from its src
+ *
+ * given:
+ *	s		pair of the dest
+ *	from_buf	fstat of the src
+ *
+ * returns:
+ *	1 ==> copy the src to the dest, 0 ==> leave it to the checks of s
+ *
+ * This is the copy check_pair() would make of s.  Anything else, such
+ * as -D or -T for a missing dest, or -H or -M for a dest of the same
+ * length, is left for s to find when it is checked.
+ */
+static int
+fan_wants(struct pair *s, struct stat *from_buf)
+{
+    struct stat buf;		/* dest status */
+
+    /*
+     * firewall
+     */
+    if (s == NULL || from_buf == NULL) {
+	fprintf(stderr, "%s: fan_wants called with NULL ptr\n", program);
+	exit(95);
+    }
+
+    if (durability == DURABLE_FULL && durable_pending(s->dest)) {
+	return 0;
+    }
+    switch (probe_file(s->dest_dir, s->dest_base, s->dest, &buf)) {
+    case 0:
+	return !s->del_src && !s->trunc;
+    case 1:
+	if (!S_ISREG(buf.st_mode) ||
+	    (s->dest_2_src && from_buf->st_mtime < buf.st_mtime) ||
+	    ((content_hash || meta_sync) && from_buf->st_size == buf.st_size)) {
+	    return 0;
+	}
+	return from_buf->st_mode != buf.st_mode ||
+	       from_buf->st_size != buf.st_size ||
+	       from_buf->st_mtime != buf.st_mtime;
+    default:
+	return 0;
+    }
+}
+
+
+/*
+ * fan_open - open the temp files of the other dests of a fan-out
+ *
+ * given:
+ *	fan		other dests
+ *	from_fd		open file descriptor to copy from
+ *	size		number of octets to copy
+ *
+ * A dest whose temp file cannot be opened is not copied.  A temp file
+ * that is cloned from the from file needs no data from the first one.
+ */
+static void
+fan_open(struct fan *fan, int from_fd, off_t size)
+{
+    struct fan_dest *d;		/* dest being opened */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* name to open in dirfd */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (fan == NULL) {
+	fprintf(stderr, "%s: fan_open called with NULL ptr\n", program);
+	exit(96);
+    }
+
+    fan->size = size;
+    fan->done = 0;
+    for (i=0; i < fan->n; ++i) {
+	d = &fan->dest[i];
+	d->temp = d->new_to;
+	d->unnamed = 0;
+	d->cloned = 0;
+	d->ret = -1;
+
+	/* open the temp file as copy_file() does */
+	d->to_fd = use_tmpfile ? temp_open(d->to) : -1;
+	if (d->to_fd >= 0) {
+	    snprintf(d->fd_path, sizeof(d->fd_path), "/proc/self/fd/%d", d->to_fd);
+	    d->temp = d->fd_path;
+	    d->unnamed = 1;
+	} else {
+	    name = at_path(d->new_to, &dirfd);
+	    errno = 0;
+	    d->to_fd = openat(dirfd, name, O_CREAT|O_EXCL|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
+	    if (d->to_fd < 0) {
+		debug("unable to open temp file: %s: %s", d->new_to, strerror(errno));
+		continue;
+	    }
+	}
+	(void) flock(d->to_fd, LOCK_EX|LOCK_NB);	/* so temp_name() knows the temp is ours */
+	d->ret = 0;
+
+#if defined(HAVE_FICLONE)
+	/* clone the from file, unless -e picked another engine */
+	if (force_engine <= ENGINE_CLONE && size > 0 &&
+	    ioctl(d->to_fd, FICLONE, from_fd) == 0) {
+	    debug("cloned %lld octets to %s", (long long)size, d->temp);
+	    STAT_ADD(stats.bytes[ENGINE_CLONE], size);
+	    d->cloned = 1;
+	}
+#endif
+    }
+    return;
+}
+
+
+/*
+ * fan_copy - copy more of the first temp file into the other dests
+ *
+ * given:
+ *	fan		other dests, or NULL
+ *	to_fd		open descriptor of the first temp file
+ *	temp		name of the first temp file
+ *	end		octet after what the first temp file now holds
+ *
+ * Each dest gets what was copied since the last call, which is still
+ * in the page cache.  A dest that cannot be copied is dropped from the
+ * fan-out, the others go on.
+ */
+static void
+fan_copy(struct fan *fan, int to_fd, char *temp, off_t end)
+{
+    struct fan_dest *d;		/* dest being copied */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (temp == NULL) {
+	fprintf(stderr, "%s: fan_copy called with NULL ptr\n", program);
+	exit(97);
+    }
+    if (fan == NULL || end <= fan->done) {
+	return;
+    }
+
+    for (i=0; i < fan->n; ++i) {
+	d = &fan->dest[i];
+	if (d->ret != 0 || d->cloned) {
+	    continue;
+	}
+	if (copy_extents(to_fd, d->to_fd, fan->done, end, temp, d->temp,
+			 copy_engine(fan->size)) != 0) {
+	    debug("cannot copy %s to %s", temp, d->temp);
+	    d->ret = -1;
+	}
+    }
+    fan->done = end;
+    return;
+}
+
+
+/*
+ * fan_finish - rename the complete temp files of a fan-out into place
+ *
+ * given:
+ *	fan		other dests, or NULL
+ *	src_buf		pointer to fstat of the from file
+ *	from		name of file being copied from
+ *	detected	CLOCK_MONOTONIC when the change was found
+ *	started		CLOCK_MONOTONIC when the copy started
+ */
+static void
+fan_finish(struct fan *fan, struct stat *src_buf, char *from,
+	   int64_t detected, int64_t started)
+{
+    struct fan_dest *d;		/* dest being finished */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (src_buf == NULL || from == NULL) {
+	fprintf(stderr, "%s: fan_finish called with NULL ptr\n", program);
+	exit(98);
+    }
+    if (fan == NULL) {
+	return;
+    }
+
+    for (i=0; i < fan->n; ++i) {
+	d = &fan->dest[i];
+	if (d->to_fd < 0) {
+	    continue;
+	}
+
+	/* like copy_data(), keep any hole at the end of the from file */
+	errno = 0;
+	if (d->ret == 0 && !d->cloned && ftruncate(d->to_fd, fan->size) < 0) {
+	    debug("cannot set the length of %s: %s", d->temp, strerror(errno));
+	    d->ret = -1;
+	}
+	if (d->ret != 0) {
+	    temp_discard(d->to_fd, d->new_to, d->unnamed);
+	} else {
+	    d->ret = temp_finish(d->to_fd, src_buf, from, d->temp, d->unnamed,
+				 d->new_to, d->to, detected, started);
+	}
+	d->to_fd = -1;
+    }
+    return;
+}
+
+
+/*
+ * fan_discard - discard the temp files of a fan-out
+ *
+ * given:
+ *	fan		other dests, or NULL
+ *	ret		copy_file() return of each dest
+ */
+static void
+fan_discard(struct fan *fan, int ret)
+{
+    struct fan_dest *d;		/* dest being discarded */
+    int i;
+
+    if (fan == NULL) {
+	return;
+    }
+    for (i=0; i < fan->n; ++i) {
+	d = &fan->dest[i];
+	if (d->to_fd >= 0) {
+	    temp_discard(d->to_fd, d->new_to, d->unnamed);
+	    d->to_fd = -1;
+	}
+	d->ret = ret;
+    }
+    return;
+}
+
+
+/*
+ * fan_stats - count the copies of a fan-out
+ *
+ * given:
+ *	fan		other dests, or NULL
+ *	detected	CLOCK_MONOTONIC when the change was found
+ *	started		CLOCK_MONOTONIC when the copy started
+ */
+static void
+fan_stats(struct fan *fan, int64_t detected, int64_t started)
+{
+    int i;
+
+    if (fan == NULL) {
+	return;
+    }
+    for (i=0; i < fan->n; ++i) {
+	stats_copy(fan->dest[i].ret, detected, started);
+    }
+    return;
+}
+
+
+/*
+ * fan_release - let the pairs of a fan-out be checked again
+ *
+ * given:
+ *	fan		other dests, or NULL, freed
+ */
+static void
+fan_release(struct fan *fan)
+{
+    int i;
+
+    if (fan == NULL) {
+	return;
+    }
+    for (i=0; i < fan->n; ++i) {
+	if (jobs > 0) {
+	    pthread_mutex_lock(&pool_lock);
+	    pairs[fan->dest[i].pair].in_flight = 0;
+	    pthread_mutex_unlock(&pool_lock);
+	}
+    }
+    free(fan);
+    return;
+}
+
+/*
+ * durable_add - add a complete temp file to the next -y full group commit
+ *
+ * given:
+ *	fd		open temp file descriptor, closed by the commit
+ *	link_name	temp filename
+ *	to		filename to rename it to
+ *	from		name of file it was copied from
+ *	from_buf	fstat of the from file
+ *	detected	CLOCK_MONOTONIC when the change was found
+ *	started		CLOCK_MONOTONIC when the copy started
+ *
+ * A full batch is committed by the thread that fills it.
+ */
+static void
+durable_add(int fd, char *link_name, char *to, char *from, struct stat *from_buf,
+	    int64_t detected, int64_t started)
+{
+    struct durable *e;		/* batch entry */
+
+    /*
+     * firewall
+     */
+    if (link_name == NULL || to == NULL || from == NULL || from_buf == NULL) {
+	fprintf(stderr, "%s: durable_add called with NULL ptr\n", program);
+	exit(99);
+    }
+
+    pthread_mutex_lock(&durable_lock);
+    e = &durable_batch[durable_len];
+    e->fd = fd;
+    e->link_name = strdup(link_name);
+    e->to = strdup(to);
+    e->from = strdup(from);
+    if (e->link_name == NULL || e->to == NULL || e->from == NULL) {
+	fprintf(stderr, "%s: group commit strdup failed\n", program);
+	exit(100);
+    }
+    e->from_buf = *from_buf;
+    e->detected = detected;
+    e->copy_time = now_nsec() - started;
+    e->renamed = 0;
+    debug("%s waits for a group commit", link_name);
+    if (++durable_len >= DURABLE_BATCH) {
+	durable_commit();
+    }
+    pthread_mutex_unlock(&durable_lock);
+    return;
+}
+
+
+/*
+ * durable_pending - determine if a copy to a file waits for a group commit
+ *
+ * given:
+ *	to	filename being copied into
+ *
+ * returns:
+ *	1 ==> a copy to the file is not yet renamed into place, 0 ==> none
+ *
+ * This waits for a commit in progress, after which its copies are in place.
+ */
+static int
+durable_pending(char *to)
+{
+    int found = 0;		/* 1 ==> to is in the batch */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (to == NULL) {
+	fprintf(stderr, "%s: durable_pending called with NULL ptr\n", program);
+	exit(101);
+    }
+
+    pthread_mutex_lock(&durable_lock);
+    for (i=0; i < durable_len && !found; ++i) {
+	found = (strcmp(durable_batch[i].to, to) == 0);
+    }
+    pthread_mutex_unlock(&durable_lock);
+    return found;
+}
+
+
+/*
+ * durable_flush - commit the copies waiting for a -y full group commit
+ */
+static void
+durable_flush(void)
+{
+    pthread_mutex_lock(&durable_lock);
+    durable_commit();
+    pthread_mutex_unlock(&durable_lock);
+    return;
+}
+
+
+/*
+ * durable_commit - sync, rename and fsync the directories of the batch
+ *
+ * The caller holds durable_lock, so that copies are neither added nor
+ * looked for while the batch is committed.
+ *
+ * Writeback of every file is started before we wait for any of them,
+ * so the device sees the whole batch at once and the fdatasyncs share
+ * journal commits.  We do not syncfs(): it would also write whatever
+ * else is dirty on the filesystem.  Each directory is fsynced through
+ * its dirs[] descriptor, the directory the rename went into, or by path
+ * for a -R tree.  The copies are counted for -S here, as completed once
+ * durable, or as failed if they cannot be synced or renamed.
+ */
+static void
+durable_commit(void)
+{
+    struct durable *e;		/* batch entry */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* name to open in dirfd */
+    int synced_fd[DURABLE_BATCH];	/* dirs[] directories fsynced */
+    char *synced[DURABLE_BATCH];	/* other directories fsynced */
+    int nsynced_fd = 0;		/* entries in synced_fd[] */
+    int nsynced = 0;		/* entries in synced[] */
+    char *dir;			/* directory of a renamed file */
+    char *base;			/* basename of a renamed file */
+    int renamed = 0;		/* files renamed into place */
+    int64_t now;		/* CLOCK_MONOTONIC when the commit was done */
+    int fd;			/* open directory */
+    int i;
+    int j;
+
+    if (durable_len <= 0) {
+	return;
+    }
+
+    /*
+     * start writeback of all files, then wait for each
+     */
+    for (i=0; i < durable_len; ++i) {
+	(void) sync_file_range(durable_batch[i].fd, (off_t)0, (off_t)0,
+			       SYNC_FILE_RANGE_WRITE);
+    }
+    for (i=0; i < durable_len; ++i) {
+	e = &durable_batch[i];
+	errno = 0;
+	if (fdatasync(e->fd) < 0) {
+	    debug("cannot fdatasync %s: %s", e->link_name, strerror(errno));
+	    (void) close(e->fd);
+	    name = at_path(e->link_name, &dirfd);
+	    (void) unlinkat(dirfd, name, 0);
+	    continue;
+	}
+	(void) close(e->fd);
+
+	/* move new file into place */
+	debug("rename %s ==> %s", e->link_name, e->to);
+	if (at_rename(e->link_name, e->to) < 0) {
+	    debug("move %s to %s failed: %s", e->link_name, e->to, strerror(errno));
+	    name = at_path(e->link_name, &dirfd);
+	    (void) unlinkat(dirfd, name, 0);
+	    continue;
+	}
+	e->renamed = 1;
+	++renamed;
+	if (cache != NULL) {
+	    cache_copied(e->from, &e->from_buf, e->to);
+	}
+	debug("completed sync %s ==> %s", e->from, e->to);
+    }
+
+    /*
+     * fsync each directory we renamed into once
+     *
+     * The dirs[] descriptors are O_PATH, which cannot be fsynced, so we
+     * open the directory they refer to, not the path again.
+     */
+    for (i=0; i < durable_len; ++i) {
+	e = &durable_batch[i];
+	if (!e->renamed) {
+	    continue;
+	}
+	(void) at_path(e->to, &dirfd);
+	if (dirfd != AT_FDCWD) {
+	    for (j=0; j < nsynced_fd && synced_fd[j] != dirfd; ++j) {
+	    }
+	    if (j < nsynced_fd) {
+		continue;
+	    }
+	    synced_fd[nsynced_fd++] = dirfd;
+	    errno = 0;
+	    fd = openat(dirfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	} else {
+	    split_path(e->to, &dir, &base);
+	    for (j=0; j < nsynced && strcmp(synced[j], dir) != 0; ++j) {
+	    }
+	    if (j < nsynced) {
+		free(dir);
+		continue;
+	    }
+	    synced[nsynced++] = dir;
+	    errno = 0;
+	    fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	}
+	if (fd < 0 || fsync(fd) < 0) {
+	    debug("cannot fsync the directory of %s: %s", e->to, strerror(errno));
+	}
+	if (fd >= 0) {
+	    (void) close(fd);
+	}
+    }
+    debug("group commit of %d files in %d directories", renamed, nsynced_fd + nsynced);
+
+    /*
+     * -S: count each copy, the sync lag of a copy includes its wait for the commit
+     */
+    now = now_nsec();
+    for (i=0; i < durable_len; ++i) {
+	e = &durable_batch[i];
+	if (e->renamed) {
+	    STAT_ADD(stats.copies_completed, 1);
+	    hist_observe(&stats.copy_time, &stats.copy_time_max, e->copy_time);
+	    hist_observe(&stats.sync_lag, &stats.sync_lag_max, now - e->detected);
+	} else {
+	    STAT_ADD(stats.copies_failed, 1);
+	}
+    }
+
+    /*
+     * empty the batch
+     */
+    for (i=0; i < nsynced; ++i) {
+	free(synced[i]);
+    }
+    for (i=0; i < durable_len; ++i) {
+	e = &durable_batch[i];
+	free(e->link_name);
+	free(e->to);
+	free(e->from);
+    }
+    durable_len = 0;
+    return;
+}
+
+
+/*
+ * temp_open - open an unnamed temp file in the directory of a file
+ *
+ * given:
+ *	to	file whose directory gets the temp file
+ *
+ * returns:
+ *	open descriptor of the temp file, or -1 ==> use a named temp file
+ */
+static int
+temp_open(char *to)
+{
+    char *dir;			/* directory of to */
+    char *base;			/* basename of to */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    int fd = -1;		/* temp file descriptor */
+
+    /*
+     * firewall
+     */
+    if (to == NULL) {
+	fprintf(stderr, "%s: temp_open called with NULL ptr\n", program);
+	exit(82);
+    }
+
+#if defined(O_TMPFILE)
+    /*
+     * filesystems without O_TMPFILE fail with EOPNOTSUPP, or EISDIR on
+     * kernels that do not know it
+     */
+    split_path(to, &dir, &base);
+    (void) at_path(to, &dirfd);
+    errno = 0;
+    if (dirfd == AT_FDCWD) {
+	fd = open(dir, O_TMPFILE|O_RDWR, S_IRUSR|S_IWUSR);
+    } else {
+	fd = openat(dirfd, ".", O_TMPFILE|O_RDWR, S_IRUSR|S_IWUSR);
+    }
+    if (fd < 0) {
+	debug("cannot open an unnamed temp file in: %s: %s, using a named one",
+	      dir, strerror(errno));
+    } else {
+	debug("opened an unnamed temp file in: %s", dir);
+    }
+    free(dir);
+#endif
+    return fd;
+}
+
+
+/*
+ * temp_link - give a complete -O temp file a name next to its final name
+ *
+ * given:
+ *	fd_path		/proc/self/fd name of the open temp file
+ *	new_to		temp filename in same directory as to
+ *
+ * returns:
+ *	new_to, a malloced name if new_to is taken, or NULL ==> not linked
+ *
+ * A stale new_to left by a crash, or another syncfile copying to the
+ * same file, only makes us pick another name.
+ */
+static char *
+temp_link(char *fd_path, char *new_to)
+{
+    char *name;			/* name to link to */
+    char *base;			/* name to link to in dirfd */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    int err = 0;		/* linkat errno */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (fd_path == NULL || new_to == NULL) {
+	fprintf(stderr, "%s: temp_link called with NULL ptr\n", program);
+	exit(83);
+    }
+
+    /*
+     * link to new_to, or to new_to.pid.i if it is taken
+     */
+    for (i=0; i < LINK_TRIES; ++i) {
+	if (i == 0) {
+	    name = new_to;
+	} else {
+	    name = (char *)malloc(strlen(new_to) + 1 + 3*sizeof(int) + 1 + 3*sizeof(int) + 1);
+	    if (name == NULL) {
+		fprintf(stderr, "%s: temp name malloc failed\n", program);
+		exit(84);
+	    }
+	    sprintf(name, LINK_NAME, new_to, (int)getpid(), i);
+	}
+	base = at_path(name, &dirfd);
+	errno = 0;
+	if (linkat(AT_FDCWD, fd_path, dirfd, base, AT_SYMLINK_FOLLOW) == 0) {
+	    debug("linked %s ==> %s", fd_path, name);
+	    return name;
+	}
+	err = errno;
+	if (name != new_to) {
+	    free(name);
+	}
+	if (err != EEXIST) {
+	    break;
+	}
+    }
+    debug("cannot link %s to %s: %s", fd_path, new_to, strerror(err));
+    return NULL;
+}
+
+
+/*
+ * temp_discard - close and remove an incomplete temp file
+ *
+ * given:
+ *	to_fd		open descriptor of the temp file
+ *	new_to		temp filename
+ *	unnamed		1 ==> -O temp file, it goes away when closed
+ *
+ * With -r, the checkpoint of a named temp file goes with it.
+ */
+static void
+temp_discard(int to_fd, char *new_to, int unnamed)
+{
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* new_to in dirfd */
+
+    /*
+     * firewall
+     */
+    if (new_to == NULL) {
+	fprintf(stderr, "%s: temp_discard called with NULL ptr\n", program);
+	exit(85);
+    }
+
+    (void) close(to_fd);
+    if (!unnamed) {
+	name = at_path(new_to, &dirfd);
+	(void) unlinkat(dirfd, name, 0);
+	if (resume) {
+	    resume_remove(new_to);
+	}
+    }
+}
+
+
+/*
+ * resume_name - form the -r state filename of a temp file
+ *
+ * given:
+ *	new_to		temp filename
+ *
+ * returns:
+ *	malloced state filename
+ */
+static char *
+resume_name(char *new_to)
+{
+    char *state;		/* state filename */
+
+    /*
+     * firewall
+     */
+    if (new_to == NULL) {
+	fprintf(stderr, "%s: resume_name called with NULL ptr\n", program);
+	exit(86);
+    }
+
+    state = (char *)malloc(strlen(new_to) + sizeof(RESUME_SUFFIX));
+    if (state == NULL) {
+	fprintf(stderr, "%s: state filename malloc failed\n", program);
+	exit(87);
+    }
+    sprintf(state, "%s%s", new_to, RESUME_SUFFIX);
+    return state;
+}
+
+
+/*
+ * resume_open - open the temp file of an earlier copy that can be resumed
+ *
+ * given:
+ *	src_buf		fstat of the from file
+ *	new_to		temp filename
+ *	rs		where to form the -r state of this copy
+ *
+ * returns:
+ *	open descriptor of the temp file, or -1 ==> start a new copy
+ *
+ * The earlier copy is resumed when its state file is for the same from
+ * file, unchanged since, and the temp file still matches the digest of
+ * its checkpoint.  Anything the temp file holds past the checkpoint was
+ * not synced, so it is cut off.  Otherwise the stale temp and state
+ * files are removed, and rs->done is 0.
+ */
+static int
+resume_open(struct stat *src_buf, char *new_to, struct resume_state *rs)
+{
+    struct resume_state old;	/* state file of the earlier copy */
+    struct digest d;		/* digest of the temp file before its checkpoint */
+    struct stat buf;		/* fstat of the temp file */
+    char *state;		/* state filename */
+    int state_fd;		/* open state file */
+    int fd = -1;		/* open temp file */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* name to open in dirfd */
+    int lane;
+
+    /*
+     * firewall
+     */
+    if (src_buf == NULL || new_to == NULL || rs == NULL) {
+	fprintf(stderr, "%s: resume_open called with NULL ptr\n", program);
+	exit(88);
+    }
+
+    /*
+     * the state of this copy, before anything is copied
+     */
+    memset(rs, 0, sizeof(*rs));
+    memcpy(rs->magic, RESUME_MAGIC, sizeof(rs->magic));
+    for (lane=0; lane < DIGEST_LANES; ++lane) {
+	rs->check.lane[lane] = 0xffffffff;
+    }
+    rs->dev = (uint64_t)src_buf->st_dev;
+    rs->ino = (uint64_t)src_buf->st_ino;
+    rs->size = (int64_t)src_buf->st_size;
+    rs->mtime_ns = (int64_t)src_buf->st_mtim.tv_sec * NSEC_PER_SEC +
+		   src_buf->st_mtim.tv_nsec;
+
+    /*
+     * validate the state file and temp file of an earlier copy
+     */
+    state = resume_name(new_to);
+    name = at_path(state, &dirfd);
+    state_fd = openat(dirfd, name, O_RDONLY);
+    if (state_fd >= 0) {
+	if (pread(state_fd, &old, sizeof(old), (off_t)0) == sizeof(old) &&
+	    memcmp(old.magic, rs->magic, sizeof(old.magic)) == 0 &&
+	    old.dev == rs->dev && old.ino == rs->ino &&
+	    old.size == rs->size && old.mtime_ns == rs->mtime_ns &&
+	    old.done > 0 && old.done < rs->size) {
+	    name = at_path(new_to, &dirfd);
+	    fd = openat(dirfd, name, O_RDWR);
+	    d = rs->check;
+	    if (fd >= 0 &&
+		(fstat(fd, &buf) < 0 || buf.st_size < old.done ||
+		 resume_check(fd, (off_t)0, old.done, new_to, &d) < 0 ||
+		 memcmp(&d, &old.check, sizeof(d)) != 0 ||
+		 ftruncate(fd, old.done) < 0)) {
+		debug("%s does not match its checkpoint", new_to);
+		(void) close(fd);
+		fd = -1;
+	    }
+	} else {
+	    debug("%s is not a checkpoint of %lld octets of this src",
+		  state, (long long)rs->size);
+	}
+	(void) close(state_fd);
+    }
+
+    /*
+     * resume the copy, or remove what is left of the earlier one
+     */
+    if (fd >= 0) {
+	rs->done = old.done;
+	rs->check = old.check;
+	debug("resuming copy into %s at %lld of %lld octets",
+	      new_to, (long long)rs->done, (long long)rs->size);
+	STAT_ADD(stats.copies_resumed, 1);
+	STAT_ADD(stats.resumed_bytes, rs->done);
+    } else {
+	name = at_path(new_to, &dirfd);
+	if (unlinkat(dirfd, name, 0) == 0) {
+	    debug("removed stale temp file: %s", new_to);
+	}
+	name = at_path(state, &dirfd);
+	(void) unlinkat(dirfd, name, 0);
+    }
+    free(state);
+    return fd;
+}
+
+
+/*
+ * resume_save - checkpoint a resumable copy
+ *
+ * given:
+ *	to_fd		open temp file descriptor
+ *	new_to		temp filename
+ *	rs		-r state of the copy
+ *	done		octets of the temp file copied so far
+ *
+ * returns:
+ *	0 ==> saved, -1 ==> not saved, rs->done is unchanged
+ *
+ * The temp file is synced before the state file is written, so a state
+ * file never claims data that a crash could lose.
+ */
+static int
+resume_save(int to_fd, char *new_to, struct resume_state *rs, off_t done)
+{
+    struct resume_state next;	/* state after this checkpoint */
+    char *state;		/* state filename */
+    int fd;			/* open state file */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* state in dirfd */
+    int ret = -1;		/* save return */
+
+    /*
+     * firewall
+     */
+    if (new_to == NULL || rs == NULL) {
+	fprintf(stderr, "%s: resume_save called with NULL ptr\n", program);
+	exit(89);
+    }
+
+    /*
+     * sync the copied data, then add what was copied since the last
+     * checkpoint to the digest
+     */
+    errno = 0;
+    if (fdatasync(to_fd) < 0) {
+	debug("cannot fdatasync %s: %s", new_to, strerror(errno));
+	return -1;
+    }
+    next = *rs;
+    next.done = done;
+    if (resume_check(to_fd, rs->done, done, new_to, &next.check) < 0) {
+	return -1;
+    }
+
+    /*
+     * write the state file
+     */
+    state = resume_name(new_to);
+    name = at_path(state, &dirfd);
+    errno = 0;
+    fd = openat(dirfd, name, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR);
+    if (fd < 0) {
+	debug("cannot open state file: %s: %s", state, strerror(errno));
+    } else if (pwrite(fd, &next, sizeof(next), (off_t)0) != sizeof(next) ||
+	       fdatasync(fd) < 0) {
+	debug("cannot write state file: %s: %s", state, strerror(errno));
+	(void) close(fd);
+    } else {
+	(void) close(fd);
+	*rs = next;
+	debug("checkpoint of %s at %lld octets", new_to, (long long)done);
+	ret = 0;
+    }
+    free(state);
+    return ret;
+}
+
+
+/*
+ * resume_check - add octets of a temp file to the digest of a checkpoint
+ *
+ * given:
+ *	fd		open temp file descriptor
+ *	start		first octet to add, the previous checkpoint or 0
+ *	done		checkpoint, start plus a whole number of DIGEST_STRIPE
+ *	name		temp filename
+ *	d		digest of the octets before start, to add to
+ *
+ * returns:
+ *	0 ==> digest formed, -1 ==> error
+ *
+ * The digest is left unfinished, with no final complement, so that the
+ * next checkpoint can continue it.
+ */
+static int
+resume_check(int fd, off_t start, off_t done, char *name, struct digest *d)
+{
+    unsigned char *buf;		/* octets read from the temp file */
+    off_t offset;		/* offset of buf in the temp file */
+    size_t len;			/* octets to read into buf */
+
+    /*
+     * firewall
+     */
+    if (name == NULL || d == NULL) {
+	fprintf(stderr, "%s: resume_check called with NULL ptr\n", program);
+	exit(90);
+    }
+
+    buf = (unsigned char *)malloc(DIGEST_BUFSIZ);
+    if (buf == NULL) {
+	debug("checkpoint buffer malloc failed");
+	return -1;
+    }
+    for (offset = start; offset < done; offset += len) {
+	len = (done - offset < DIGEST_BUFSIZ) ? (size_t)(done - offset) : (size_t)DIGEST_BUFSIZ;
+	if (pread_full(fd, (char *)buf, len, offset) != (ssize_t)len) {
+	    debug("cannot read %s before %lld", name, (long long)done);
+	    free(buf);
+	    return -1;
+	}
+	digest_kernel(d, buf, len);
+    }
+    free(buf);
+    return 0;
+}
+
+
+/*
+ * resume_remove - remove the -r state file of a temp file
+ *
+ * given:
+ *	new_to		temp filename
+ */
+static void
+resume_remove(char *new_to)
+{
+    char *state;		/* state filename */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* state in dirfd */
+
+    /*
+     * firewall
+     */
+    if (new_to == NULL) {
+	fprintf(stderr, "%s: resume_remove called with NULL ptr\n", program);
+	exit(91);
+    }
+
+    state = resume_name(new_to);
+    name = at_path(state, &dirfd);
+    (void) unlinkat(dirfd, name, 0);
+    free(state);
+}
+
+
+/*
+ * from_changed - determine if a file was written since it was fstated
+ *
+ * given:
+ *	from_fd		open file descriptor of the file
+ *	buf		earlier fstat of from_fd
+ *
+ * returns:
+ *	1 ==> length or mod time changed, 0 ==> unchanged or cannot tell
+ */
+static int
+from_changed(int from_fd, struct stat *buf)
+{
+    struct stat now;		/* fstat of from_fd now */
+
+    /*
+     * firewall
+     */
+    if (buf == NULL) {
+	fprintf(stderr, "%s: from_changed called with NULL ptr\n", program);
+	exit(81);
+    }
+
+    if (fstat(from_fd, &now) < 0) {
+	return 0;
+    }
+    return now.st_size != buf->st_size ||
+	   now.st_mtim.tv_sec != buf->st_mtim.tv_sec ||
+	   now.st_mtim.tv_nsec != buf->st_mtim.tv_nsec;
+}
+
+
+/*
+ * copy_data - copy all of the from file into the temp file
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	to_fd		open temp file descriptor to copy into
+ *	size		number of octets to copy
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *	rs		-r state of a resumable copy, or NULL
+ *	fan		other dests to copy into, or NULL
+ *
+ * returns:
+ *	0 ==> copied, 1 ==> from file changed, -1 ==> failed
+ *
+ * We first try to clone the whole file, which shares its extents and
+ * takes no time.  Otherwise copy_extents() copies the data of the file
+ * with the other engines, in chunks by several threads if -P and the
+ * file is large.  Holes are not copied, so at the end we set the length
+ * of the temp file to keep any hole at the end of the from file.
+ *
+ * A resumable copy starts at rs->done, and saves a checkpoint after
+ * each RESUME_STEP it copies.  A fan-out copies each FAN_STEP into the
+ * other dests as soon as it is in our temp file.
+ */
+static int
+copy_data(int from_fd, int to_fd, off_t size, char *from, char *new_to,
+	  struct resume_state *rs, struct fan *fan)
+{
+    int nthreads;		/* threads copying the file */
+    off_t chunk;		/* octets each thread copies at a time */
+    off_t step;			/* octets copied at a time */
+    off_t start;		/* first octet of this step */
+    off_t end;			/* octet after this step */
+    int engine;			/* first engine after clone */
+    int ret;			/* copy return */
+
+    engine = copy_engine(size);
+
+#if defined(HAVE_FICLONE)
+    /*
+     * try to clone the from file, unless -e picked another engine
+     *
+     * Usually EXDEV, EOPNOTSUPP or EINVAL: this pair of files cannot be
+     * cloned.  Nothing was written, so whatever the error, the next
+     * engine starts from the beginning.
+     */
+    errno = 0;
+    if (force_engine > ENGINE_CLONE) {
+	/* -e: do not clone */
+    } else if (ioctl(to_fd, FICLONE, from_fd) == 0) {
+	debug("cloned %lld octets %s ==> %s", (long long)size, from, new_to);
+	STAT_ADD(stats.bytes[ENGINE_CLONE], size);
+	return 0;
+    } else if (force_engine == ENGINE_CLONE) {
+	debug("cannot clone %s to %s: %s", from, new_to, strerror(errno));
+	return -1;
+    } else {
+	debug("cannot clone %s to %s: %s, trying %s",
+	      from, new_to, strerror(errno), engine_name[engine]);
+    }
+#else
+    if (force_engine == ENGINE_CLONE) {
+	debug("cannot clone %s to %s: not supported", from, new_to);
+	return -1;
+    }
+#endif
+
+    /*
+     * -F drop or direct: we read the from file once, from start to end
+     */
+    if (page_policy != PAGES_KEEP) {
+	(void) posix_fadvise(from_fd, (off_t)0, (off_t)0, POSIX_FADV_SEQUENTIAL);
+	(void) posix_fadvise(from_fd, (off_t)0, (off_t)0, POSIX_FADV_NOREUSE);
+    }
+
+    /*
+     * copy the file, or with -r, what is left of it a step at a time
+     */
+    step = size;
+    if (rs != NULL) {
+	step = RESUME_STEP;
+    }
+    if (fan != NULL && step > FAN_STEP) {
+	step = FAN_STEP;
+    }
+    for (start = (rs == NULL) ? 0 : rs->done; start < size; start = end) {
+	end = (size - start <= step) ? size : start + step;
+
+	/*
+	 * -P: copy a large file with several threads at once
+	 */
+	nthreads = parallel_plan(end - start, &chunk);
+	if (nthreads > 1) {
+	    ret = copy_parallel(from_fd, to_fd, start, end, from, new_to,
+				engine, nthreads, chunk);
+
+	/*
+	 * copy the data with the remaining engines
+	 */
+	} else {
+	    ret = copy_extents(from_fd, to_fd, start, end, from, new_to, engine);
+	}
+	if (ret != 0) {
+	    return ret;
+	}
+
+	/*
+	 * -r: a failed save only costs the steps copied since the last one
+	 */
+	if (rs != NULL && end < size && end % RESUME_STEP == 0) {
+	    (void) resume_save(to_fd, new_to, rs, end);
+	}
+	fan_copy(fan, to_fd, new_to, end);
+    }
+
+    /*
+     * a hole at the end of the from file was not copied
+     */
+    errno = 0;
+    if (ftruncate(to_fd, size) < 0) {
+	debug("cannot set the length of %s: %s", new_to, strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * copy_engine - pick the first engine after clone to copy a file with
+ *
+ * given:
+ *	size		number of octets to copy
+ *
+ * returns:
+ *	ENGINE_DIRECT, ENGINE_CFR or the -e engine
+ */
+static int
+copy_engine(off_t size)
+{
+    /*
+     * -F direct copies large files with O_DIRECT, -e picks the engine
+     */
+    if (force_engine > ENGINE_CLONE) {
+	return force_engine;
+    } else if (page_policy == PAGES_DIRECT && size >= DIRECT_MIN) {
+	return ENGINE_DIRECT;
+    }
+    return ENGINE_CFR;
+}
+
+
+/*
+ * parallel_plan - decide how many threads copy a file, and in what chunks
+ *
+ * given:
+ *	size	number of octets to copy
+ *	chunk	where to store the octets in each chunk
+ *
+ * returns:
+ *	number of threads, 1 ==> copy with this thread alone
+ *
+ * -P 0 gives a thread to each PARALLEL_MIN of the file, up to
+ * PARALLEL_MAX threads.  Without -K, each thread takes about
+ * CHUNKS_PER_THREAD chunks of at least CHUNK_MIN, so that a slow chunk
+ * does not hold up the copy.
+ */
+static int
+parallel_plan(off_t size, off_t *chunk)
+{
+    int nthreads;		/* threads copying the file */
+    int64_t nchunks;		/* number of chunks */
+
+    /*
+     * firewall
+     */
+    if (chunk == NULL) {
+	fprintf(stderr, "%s: parallel_plan called with NULL ptr\n", program);
+	exit(51);
+    }
+
+    /*
+     * small files and -P 1 are copied by one thread
+     */
+    *chunk = size;
+    if (copy_threads == 1 || size < PARALLEL_MIN) {
+	return 1;
+    }
+    if (copy_threads == 0) {
+	nthreads = (size / PARALLEL_MIN < PARALLEL_MAX) ?
+		   (int)(size / PARALLEL_MIN) : PARALLEL_MAX;
+    } else {
+	nthreads = copy_threads;
+    }
+
+    /*
+     * size the chunks, then use no more threads than chunks
+     */
+    if (chunk_size > 0) {
+	*chunk = chunk_size;
+    } else {
+	*chunk = size / ((off_t)nthreads * CHUNKS_PER_THREAD);
+	*chunk = (*chunk + CHUNK_ALIGN - 1) / CHUNK_ALIGN * CHUNK_ALIGN;
+	if (*chunk < CHUNK_MIN) {
+	    *chunk = CHUNK_MIN;
+	}
+    }
+    nchunks = (size + *chunk - 1) / *chunk;
+    if (nchunks < nthreads) {
+	nthreads = (int)nchunks;
+    }
+    return nthreads;
+}
+
+
+/*
+ * copy_parallel - copy a file with several threads at once
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	to_fd		open temp file descriptor to copy into
+ *	start		first octet to copy
+ *	end		octet after the last to copy
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *	engine		first engine to try
+ *	nthreads	number of threads copying, including this thread
+ *	chunk		octets in each chunk
+ *
+ * returns:
+ *	0 ==> copied, -1 ==> failed
+ *
+ * Every thread, including this one, opens new_to for itself because
+ * sendfile writes at the file offset of its descriptor.  All threads
+ * are joined before we return, so the caller sets the mode and renames
+ * the temp file as usual.
+ */
+static int
+copy_parallel(int from_fd, int to_fd, off_t start, off_t end, char *from,
+	      char *new_to, int engine, int nthreads, off_t chunk)
+{
+    struct chunk_copy cc;	/* copy shared by the threads */
+    struct stat from_buf;	/* fstat of from_fd */
+    pthread_t *tids;		/* helper threads */
+    int started;		/* helper threads started */
+    int i;
+
+    /*
+     * firewall
+     */
+    if (from == NULL || new_to == NULL) {
+	fprintf(stderr, "%s: copy_parallel called with NULL ptr\n", program);
+	exit(52);
+    }
+
+    /*
+     * reserve the blocks of the temp file so that the threads do not
+     * fight over allocation, and so that running out of space fails now,
+     * unless the from file has holes that the copy must keep
+     */
+    errno = 0;
+    if (fstat(from_fd, &from_buf) == 0 &&
+	(off_t)from_buf.st_blocks * 512 < from_buf.st_size) {
+	debug("not preallocating %s, %s has holes", new_to, from);
+    } else if (fallocate(to_fd, 0, start, end - start) < 0) {
+	if (errno != EOPNOTSUPP && errno != ENOSYS) {
+	    debug("cannot preallocate %lld octets of %s: %s",
+		  (long long)(end - start), new_to, strerror(errno));
+	    return -1;
+	}
+	debug("cannot preallocate %s: %s", new_to, strerror(errno));
+    }
+
+    /*
+     * start the helper threads, and copy with this thread too
+     */
+    cc.from_fd = from_fd;
+    cc.from = from;
+    cc.new_to = new_to;
+    cc.start = start;
+    cc.end = end;
+    cc.chunk = chunk;
+    cc.engine = engine;
+    cc.nchunks = (end - start + chunk - 1) / chunk;
+    cc.next = 0;
+    cc.failed = 0;
+    debug("copying %lld octets in %lld chunks of %lld with %d threads",
+	  (long long)(end - start), (long long)cc.nchunks, (long long)chunk, nthreads);
+    tids = (pthread_t *)malloc((nthreads - 1) * sizeof(tids[0]));
+    if (tids == NULL) {
+	fprintf(stderr, "%s: copy thread malloc failed\n", program);
+	exit(53);
+    }
+    for (started=0; started < nthreads - 1; ++started) {
+	errno = pthread_create(&tids[started], NULL, chunk_worker, &cc);
+	if (errno != 0) {
+	    /* OK to continue with the threads we have */
+	    debug("cannot start copy thread: %s", strerror(errno));
+	    break;
+	}
+    }
+    (void) chunk_worker(&cc);
+    for (i=0; i < started; ++i) {
+	(void) pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    if (__atomic_load_n(&cc.failed, __ATOMIC_ACQUIRE) < 0) {
+	debug("parallel copy %s to %s failed", from, new_to);
+	return -1;
+    }
+    return __atomic_load_n(&cc.failed, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * chunk_worker - copy chunks of a file until none are left
+ *
+ * given:
+ *	arg	pointer to the struct chunk_copy being copied
+ *
+ * returns:
+ *	NULL
+ */
+static void *
+chunk_worker(void *arg)
+{
+    struct chunk_copy *cc = (struct chunk_copy *)arg;	/* copy being made */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* name to open in dirfd */
+    int to_fd;			/* this thread's open temp file */
+    int64_t n;			/* chunk being copied */
+    off_t start;		/* first octet of the chunk */
+    off_t end;			/* octet after the chunk */
+    int ret;			/* copy_extents() return */
+
+    /*
+     * firewall
+     */
+    if (cc == NULL) {
+	fprintf(stderr, "%s: chunk_worker called with NULL ptr\n", program);
+	exit(54);
+    }
+
+    /*
+     * open our own temp file descriptor
+     */
+    name = at_path(cc->new_to, &dirfd);
+    errno = 0;
+    to_fd = openat(dirfd, name, O_WRONLY);
+    if (to_fd < 0) {
+	debug("unable to open temp file: %s: %s", cc->new_to, strerror(errno));
+	__atomic_store_n(&cc->failed, -1, __ATOMIC_RELEASE);
+	return NULL;
+    }
+
+    /*
+     * take chunks in turn until they are all taken, or a chunk fails or
+     * finds that the from file changed
+     */
+    while (!__atomic_load_n(&cc->failed, __ATOMIC_ACQUIRE)) {
+	n = __atomic_fetch_add(&cc->next, 1, __ATOMIC_ACQ_REL);
+	if (n >= cc->nchunks) {
+	    break;
+	}
+	start = cc->start + n * cc->chunk;
+	end = (cc->end - start < cc->chunk) ? cc->end : start + cc->chunk;
+	ret = copy_extents(cc->from_fd, to_fd, start, end,
+			   cc->from, cc->new_to, cc->engine);
+	if (ret != 0) {
+	    __atomic_store_n(&cc->failed, ret, __ATOMIC_RELEASE);
+	    break;
+	}
+    }
+    (void) close(to_fd);
+    return NULL;
+}
+
+
+/*
+ * copy_delta - form the temp file from the to file and the blocks that differ
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	from_buf	fstat of from_fd
+ *	to_fd		open temp file descriptor to copy into
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *	to		filename being copied into
+ *
+ * returns:
+ *	0 ==> copied, 1 ==> cannot, or from file changed, copy all instead,
+ *	-1 ==> failed
+ *
+ * The temp file starts as a clone of the to file, so it shares the
+ * extents of the to file, and we write only the blocks that differ.
+ * Without FICLONE, the temp file starts empty and the blocks that are
+ * the same are copied from the to file, by copy_file_range where it
+ * can, which some filesystems share or copy on the server.  Both files
+ * are local, so we compare the blocks themselves rather than
+ * signatures.  A block of zeros in a hole of the from file stays, or
+ * is punched back into, a hole.
+ */
+static int
+copy_delta(int from_fd, struct stat *from_buf, int to_fd,
+	   char *from, char *new_to, char *to)
+{
+    off_t size;			/* octets to copy */
+    int dirfd;			/* directory descriptor or AT_FDCWD */
+    char *name;			/* name to open in dirfd */
+    int old_fd;			/* open to file */
+    int cloned = 0;		/* 1 ==> temp file is a clone of the to file */
+    int use_cfr = 1;		/* 1 ==> copy same blocks by copy_file_range */
+    char *from_blk;		/* block of the from file */
+    char *to_blk;		/* same block of the to file */
+    size_t len;			/* octets of the block */
+    off_t offset;		/* offset of block */
+    off_t cfr_offset;		/* offset advanced by copy_by_cfr() */
+    ssize_t from_len;		/* octets of from block */
+    ssize_t to_len;		/* octets of to block */
+    off_t written = 0;		/* octets of differing blocks written */
+    int ret = 0;		/* 0 ==> copied, 1 ==> copy all, -1 ==> failed */
+
+    /*
+     * firewall
+     */
+    if (from_buf == NULL || from == NULL || new_to == NULL || to == NULL) {
+	fprintf(stderr, "%s: copy_delta called with NULL ptr\n", program);
+	exit(113);
+    }
+    size = from_buf->st_size;
+
+    /*
+     * clone the to file into the temp file, or read it as we go
+     */
+    name = at_path(to, &dirfd);
+    errno = 0;
+    old_fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC);
+    if (old_fd < 0) {
+	debug("cannot open %s for delta: %s", to, strerror(errno));
+	return 1;
+    }
+#if defined(HAVE_FICLONE)
+    errno = 0;
+    if (ioctl(to_fd, FICLONE, old_fd) == 0) {
+	cloned = 1;
+    } else {
+	debug("cannot clone %s for delta: %s, copying its same blocks",
+	      to, strerror(errno));
+    }
+#endif
+
+    /*
+     * allocate block buffers
+     */
+    from_blk = (char *)malloc(delta_bsize);
+    to_blk = (char *)malloc(delta_bsize);
+    if (from_blk == NULL || to_blk == NULL) {
+	debug("delta block malloc failed");
+	free(from_blk);
+	free(to_blk);
+	(void) close(old_fd);
+	return (ftruncate(to_fd, (off_t)0) < 0) ? -1 : 1;
+    }
+
+    /*
+     * write the blocks that differ, and without a clone, the same blocks
+     */
+    for (offset = 0; ret == 0 && offset < size; offset += from_len) {
+	len = (size - offset < delta_bsize) ? (size_t)(size - offset) : (size_t)delta_bsize;
+	from_len = pread_full(from_fd, from_blk, len, offset);
+	if (from_len < 0) {
+	    debug("bad read from %s: %s", from, strerror(errno));
+	    ret = -1;
+	    break;
+	}
+	if ((size_t)from_len != len || from_changed(from_fd, from_buf)) {
+	    debug("%s changed during its delta, copying it all", from);
+	    ret = 1;
+	    break;
+	}
+	to_len = pread_full(cloned ? to_fd : old_fd, to_blk, len, offset);
+	if (to_len < 0) {
+	    debug("bad read from %s: %s", cloned ? new_to : to, strerror(errno));
+	    ret = -1;
+	    break;
+	}
+
+	/* a block of zeros in a hole of the from file stays a hole */
+	if (delta_hole(from_fd, from_blk, offset, len)) {
+	    if (cloned && (to_len != from_len || memcmp(from_blk, to_blk, len) != 0) &&
+		fallocate(to_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset,
+			  (off_t)len) == 0) {
+		written += from_len;
+		continue;
+	    } else if (!cloned) {
+		continue;
+	    }
+	}
+
+	/* a block that is the same is already in a clone, else copy it from the to file */
+	if (to_len == from_len && memcmp(from_blk, to_blk, len) == 0) {
+	    if (cloned) {
+		continue;
+	    }
+	    cfr_offset = offset;
+	    if (use_cfr &&
+		copy_by_cfr(old_fd, to_fd, &cfr_offset, offset + from_len, to, new_to) == COPY_DONE) {
+		continue;
+	    }
+	    use_cfr = 0;
+	    errno = 0;
+	    if (pwrite(to_fd, to_blk, len, offset) != from_len) {
+		debug("bad write to %s: %s", new_to, strerror(errno));
+		ret = -1;
+	    }
+	    continue;
+	}
+
+	/* write a block that differs */
+	errno = 0;
+	if (pwrite(to_fd, from_blk, len, offset) != from_len) {
+	    debug("bad write to %s: %s", new_to, strerror(errno));
+	    ret = -1;
+	    break;
+	}
+	written += from_len;
+    }
+    free(from_blk);
+    free(to_blk);
+    (void) close(old_fd);
+    if (ret > 0) {
+	/* copy_data() starts over in an empty temp file */
+	return (ftruncate(to_fd, (off_t)0) < 0) ? -1 : 1;
+    } else if (ret < 0) {
+	return -1;
+    }
+
+    /*
+     * drop any part of the to file beyond the end of the from file,
+     * and extend over any holes at its end
+     */
+    errno = 0;
+    if (ftruncate(to_fd, size) < 0) {
+	debug("cannot truncate %s: %s", new_to, strerror(errno));
+	return -1;
+    }
+    debug("delta wrote %lld of %lld octets %s ==> %s%s",
+	  (long long)written, (long long)size, from, new_to,
+	  cloned ? "" : ", copying the rest");
+    STAT_ADD(stats.delta_bytes, written);
+    return 0;
+}
+
+
+/*
+ * delta_hole - determine if a block of the from file is a hole
+ *
+ * given:
+ *	from_fd		open file descriptor of the from file
+ *	blk		the block, as read
+ *	offset		offset of the block
+ *	len		octets of the block
+ *
+ * returns:
+ *	1 ==> the block is zeros with no data, 0 ==> it is not, or cannot tell
+ *
+ * Only a block of zeros is asked about, as reading a hole gives zeros.
+ */
+static int
+delta_hole(int from_fd, char *blk, off_t offset, size_t len)
+{
+    off_t data;			/* start of the next data */
+
+    /*
+     * firewall
+     */
+    if (blk == NULL) {
+	fprintf(stderr, "%s: delta_hole called with NULL ptr\n", program);
+	exit(114);
+    }
+
+    /*
+     * a block of zeros, with no data from offset to its end
+     */
+    if (len == 0 || blk[0] != '\0' || memcmp(blk, blk + 1, len - 1) != 0) {
+	return 0;
+    }
+    errno = 0;
+    data = lseek(from_fd, offset, SEEK_DATA);
+    return (data < 0 && errno == ENXIO) || (data >= 0 && data >= offset + (off_t)len);
+}
+
+
+/*
+ * pread_full - read until the buffer is full or end of file
+ *
+ * given:
+ *	fd		open file descriptor to read
+ *	buf		buffer to read into
+ *	len		octets to read
+ *	offset		file offset to read from
+ *
+ * returns:
+ *	octets read, < len ==> end of file, -1 ==> error
+ */
+static ssize_t
+pread_full(int fd, char *buf, size_t len, off_t offset)
+{
+    ssize_t readcnt;		/* octets read by one pread */
+    size_t total = 0;		/* octets read */
+
+    while (total < len) {
+	errno = 0;
+	readcnt = pread(fd, buf + total, len - total, offset + (off_t)total);
+	if (readcnt < 0) {
+	    /* EINTR is the only OK error */
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return -1;
+	} else if (readcnt == 0) {
+	    break;
+	}
+	total += (size_t)readcnt;
+    }
+    return (ssize_t)total;
+}
+
+
+/*
+ * digest_setup - build the CRC32C tables and select the digest kernel
+ *
+ * We use the SSE4.2 crc32 instruction when the CPU has it, otherwise
+ * a slicing-by-8 table kernel.  Both kernels form the same digest.
+ */
+static void
+digest_setup(void)
+{
+    uint32_t crc;		/* CRC of a table entry */
+    int i;
+    int j;
+
+    /*
+     * form the slicing-by-8 tables for the reflected CRC32C polynomial
+     */
+    for (i=0; i < 256; ++i) {
+	crc = (uint32_t)i;
+	for (j=0; j < 8; ++j) {
+	    crc = (crc & 1) ? ((crc >> 1) ^ CRC32C_POLY) : (crc >> 1);
+	}
+	crc32c_table[0][i] = crc;
+    }
+    for (i=0; i < 256; ++i) {
+	for (j=1; j < 8; ++j) {
+	    crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^
+				 crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+	}
+    }
+
+    /*
+     * select the kernel
+     */
+    digest_kernel = digest_sw;
+    digest_kernel_name = "slicing-by-8";
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+	digest_kernel = digest_sse42;
+	digest_kernel_name = "sse4.2";
+    }
+#endif
+    return;
+}
+
+
+/*
+ * digest_sw - add whole stripes to a digest with the table kernel
+ *
+ * given:
+ *	d	digest being formed
+ *	buf	octets to add
+ *	len	octets in buf, a multiple of DIGEST_STRIPE
+ */
+static void
+digest_sw(struct digest *d, const unsigned char *buf, size_t len)
+{
+    uint64_t word;		/* 8 octets as a little endian word */
+    size_t i;
+    int lane;
+    int j;
+
+    for (i=0; i + DIGEST_STRIPE <= len; i += DIGEST_STRIPE) {
+	for (lane=0; lane < DIGEST_LANES; ++lane) {
+
+	    /* load the word of this lane */
+	    word = 0;
+	    for (j=7; j >= 0; --j) {
+		word = (word << 8) | buf[i + 8*lane + j];
+	    }
+
+	    /* add the word, 8 octets at once */
+	    word ^= d->lane[lane];
+	    d->lane[lane] = crc32c_table[7][word & 0xff] ^
+			    crc32c_table[6][(word >> 8) & 0xff] ^
+			    crc32c_table[5][(word >> 16) & 0xff] ^
+			    crc32c_table[4][(word >> 24) & 0xff] ^
+			    crc32c_table[3][(word >> 32) & 0xff] ^
+			    crc32c_table[2][(word >> 40) & 0xff] ^
+			    crc32c_table[1][(word >> 48) & 0xff] ^
+			    crc32c_table[0][word >> 56];
+	}
+    }
+    return;
+}
+
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * digest_sse42 - add whole stripes to a digest with the SSE4.2 kernel
+ *
+ * given:
+ *	d	digest being formed
+ *	buf	octets to add
+ *	len	octets in buf, a multiple of DIGEST_STRIPE
+ *
+ * The four lanes are independent, so their crc32 instructions overlap.
+ */
+__attribute__ ((target("sse4.2")))
+static void
+digest_sse42(struct digest *d, const unsigned char *buf, size_t len)
+{
+    unsigned long long c0 = d->lane[0];	/* lane 0 CRC */
+    unsigned long long c1 = d->lane[1];	/* lane 1 CRC */
+    unsigned long long c2 = d->lane[2];	/* lane 2 CRC */
+    unsigned long long c3 = d->lane[3];	/* lane 3 CRC */
+    unsigned long long w[DIGEST_LANES];	/* words of a stripe */
+    size_t i;
+
+    for (i=0; i + DIGEST_STRIPE <= len; i += DIGEST_STRIPE) {
+	memcpy(w, buf + i, sizeof(w));
+	c0 = __builtin_ia32_crc32di(c0, w[0]);
+	c1 = __builtin_ia32_crc32di(c1, w[1]);
+	c2 = __builtin_ia32_crc32di(c2, w[2]);
+	c3 = __builtin_ia32_crc32di(c3, w[3]);
+    }
+    d->lane[0] = (uint32_t)c0;
+    d->lane[1] = (uint32_t)c1;
+    d->lane[2] = (uint32_t)c2;
+    d->lane[3] = (uint32_t)c3;
+    return;
+}
+#endif
+
+
+/*
+ * file_digest - form the digest of an open file
+ *
+ * given:
+ *	fd	open file descriptor
+ *	size	octets in the file
+ *	name	name of the file
+ *	d	where to store the digest
+ *
+ * returns:
+ *	0 ==> digest formed, -1 ==> error
+ */
+static int
+file_digest(int fd, off_t size, char *name, struct digest *d)
+{
+    unsigned char *buf;		/* read buffer */
+    off_t offset = 0;		/* octets read so far */
+    ssize_t readcnt;		/* octets read into buf */
+    size_t whole;		/* octets of buf in whole stripes */
+    size_t i;
+    int lane;
+
+    /*
+     * firewall
+     */
+    if (name == NULL || d == NULL) {
+	fprintf(stderr, "%s: file_digest called with NULL ptr\n", program);
+	exit(35);
+    }
+
+    /*
+     * allocate the read buffer
+     */
+    buf = (unsigned char *)malloc(DIGEST_BUFSIZ);
+    if (buf == NULL) {
+	debug("digest buffer malloc failed");
+	return -1;
+    }
+
+    /*
+     * add the file one buffer at a time
+     *
+     * Every buffer but the last is a whole number of stripes.  Octets of
+     * the final partial stripe go into lane 0.
+     */
+    for (lane=0; lane < DIGEST_LANES; ++lane) {
+	d->lane[lane] = 0xffffffff;
+    }
+    do {
+	readcnt = pread_full(fd, (char *)buf, DIGEST_BUFSIZ, offset);
+	if (readcnt < 0) {
+	    debug("bad read from %s: %s", name, strerror(errno));
+	    free(buf);
+	    return -1;
+	}
+	whole = (size_t)readcnt - ((size_t)readcnt % DIGEST_STRIPE);
+	digest_kernel(d, buf, whole);
+	for (i=whole; i < (size_t)readcnt; ++i) {
+	    d->lane[0] = crc32c_table[0][(d->lane[0] ^ buf[i]) & 0xff] ^
+			 (d->lane[0] >> 8);
+	}
+	offset += readcnt;
+    } while (readcnt == DIGEST_BUFSIZ);
+    for (lane=0; lane < DIGEST_LANES; ++lane) {
+	d->lane[lane] ^= 0xffffffff;
+    }
+    free(buf);
+
+    /*
+     * the file must not have changed size while we read it
+     */
+    if (offset != size) {
+	debug("%s changed size while forming its digest", name);
+	return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * cache_setup - map the digest cache file, creating or growing it if needed
+ *
+ * The cache is sized for two files per pair at a load of at most 1/2.
+ * A cache that is too small, or is not a valid cache, is rebuilt,
+ * keeping any valid entries.
+ */
+static void
+cache_setup(void)
+{
+    struct cache_head head;	/* cache file header */
+    struct cache_entry *old = NULL;	/* entries of a cache being rebuilt */
+    uint32_t old_slots = 0;	/* number of old entries */
+    uint32_t slots;		/* number of cache slots needed */
+    struct stat buf;		/* cache file status */
+    size_t len;			/* length of the cache file */
+    uint32_t i;
+    int fd;
+
+    /*
+     * determine the number of slots we need
+     */
+    for (slots=64; slots < 4U*(uint32_t)npairs; slots *= 2) {
+    }
+
+    /*
+     * open the cache file
+     */
+    errno = 0;
+    fd = open(cache_file, O_RDWR|O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &buf) < 0) {
+	fprintf(stderr, "%s: cannot open digest cache: %s: %s\n",
+		program, cache_file, strerror(errno));
+	exit(36);
+    }
+
+    /*
+     * use an existing cache that is valid and large enough
+     */
+    if (pread(fd, &head, sizeof(head), (off_t)0) == sizeof(head) &&
+	memcmp(head.magic, CACHE_MAGIC, sizeof(head.magic)) == 0 &&
+	head.slots > 0 && (head.slots & (head.slots-1)) == 0 &&
+	buf.st_size == (off_t)(sizeof(head) + head.slots * sizeof(struct cache_entry))) {
+	len = buf.st_size;
+	cache_map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, (off_t)0);
+	if (cache_map == MAP_FAILED) {
+	    fprintf(stderr, "%s: cannot mmap digest cache: %s: %s\n",
+		    program, cache_file, strerror(errno));
+	    exit(37);
+	}
+	cache = (struct cache_entry *)((char *)cache_map + sizeof(head));
+	cache_mask = head.slots - 1;
+	if (head.slots >= slots) {
+	    debug("using digest cache: %s", cache_file);
+	    (void) close(fd);
+	    return;
+	}
+
+	/* too small, save the old entries */
+	old_slots = head.slots;
+	old = (struct cache_entry *)malloc(old_slots * sizeof(old[0]));
+	if (old == NULL) {
+	    fprintf(stderr, "%s: digest cache malloc failed\n", program);
+	    exit(38);
+	}
+	memcpy(old, cache, old_slots * sizeof(old[0]));
+	(void) munmap(cache_map, len);
+    }
+
+    /*
+     * form an empty cache
+     */
+    debug("forming digest cache: %s with %u slots", cache_file, slots);
+    len = sizeof(head) + slots * sizeof(struct cache_entry);
+    errno = 0;
+    if (ftruncate(fd, (off_t)0) < 0 || ftruncate(fd, (off_t)len) < 0) {
+	fprintf(stderr, "%s: cannot size digest cache: %s: %s\n",
+		program, cache_file, strerror(errno));
+	exit(39);
+    }
+    cache_map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, (off_t)0);
+    if (cache_map == MAP_FAILED) {
+	fprintf(stderr, "%s: cannot mmap digest cache: %s: %s\n",
+		program, cache_file, strerror(errno));
+	exit(37);
+    }
+    (void) close(fd);
+    cache = (struct cache_entry *)((char *)cache_map + sizeof(head));
+    cache_mask = slots - 1;
+
+    /*
+     * put back the entries of a cache that was too small
+     */
+    for (i=0; i < old_slots; ++i) {
+	if (old[i].key != 0) {
+	    *cache_slot(old[i].key) = old[i];
+	}
+    }
+    free(old);
+
+    /*
+     * write the header last, so that an interrupted rebuild is not valid
+     */
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, CACHE_MAGIC, sizeof(head.magic));
+    head.slots = slots;
+    memcpy(cache_map, &head, sizeof(head));
+    return;
+}
+
+
+/*
+ * cache_slot - find the cache slot of a key
+ *
+ * given:
+ *	key	hash of a filename
+ *
+ * returns:
+ *	slot holding key, or an empty slot for it
+ *
+ * When the cache is full the slot of the key is reused.
+ */
+static struct cache_entry *
+cache_slot(uint64_t key)
+{
+    uint32_t i;			/* slot being probed */
+    uint32_t n;			/* slots probed */
+
+    for (i = (uint32_t)key & cache_mask, n = 0; n <= cache_mask;
+	 i = (i+1) & cache_mask, ++n) {
+	if (cache[i].key == key || cache[i].key == 0) {
+	    return &cache[i];
+	}
+    }
+    return &cache[(uint32_t)key & cache_mask];
+}
+
+
+/*
+ * cache_key - hash a filename into a cache key
+ *
+ * given:
+ *	name	filename
+ *
+ * returns:
+ *	non-zero 64 bit FNV-1a hash of name
+ */
+static uint64_t
+cache_key(char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;	/* FNV-1a offset basis */
+
+    while (*name) {
+	hash ^= (unsigned char)*name++;
+	hash *= 1099511628211ULL;
+    }
+    return (hash == 0) ? 1 : hash;
+}
+
+
+/*
+ * cached_digest - form the digest of an open file, using the cache if -C
+ *
+ * given:
+ *	fd	open file descriptor
+ *	buf	fstat of fd
+ *	name	name of the file
+ *	d	where to store the digest
+ *
+ * returns:
+ *	0 ==> digest formed, -1 ==> error
+ *
+ * A cache entry is valid while the file has the same device, inode,
+ * size, and nanosecond mod and change times.
+ */
+static int
+cached_digest(int fd, struct stat *buf, char *name, struct digest *d)
+{
+    struct cache_entry *e;	/* cache entry of name */
+    uint64_t key;		/* cache key of name */
+    int found = 0;		/* 1 ==> valid cache entry found */
+
+    /*
+     * look for a valid cache entry
+     */
+    if (cache != NULL) {
+	key = cache_key(name);
+	pthread_mutex_lock(&cache_lock);
+	e = cache_slot(key);
+	if (e->key == key && cache_valid(e, buf)) {
+	    *d = e->digest;
+	    found = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (found) {
+	    debug("cached digest: %s", name);
+	    return 0;
+	}
+    }
+
+    /*
+     * form the digest
+     */
+    if (file_digest(fd, buf->st_size, name, d) < 0) {
+	return -1;
+    }
+
+    /*
+     * cache the digest
+     */
+    if (cache != NULL) {
+	cache_store(name, buf, d);
+    }
+    return 0;
+}
+
+
+/*
+ * cache_valid - determine if a cache entry describes a file
+ *
+ * given:
+ *	e	cache entry
+ *	buf	stat of the file
+ *
+ * returns:
+ *	1 ==> entry is valid for the file, 0 ==> file has changed
+ */
+static int
+cache_valid(struct cache_entry *e, struct stat *buf)
+{
+    return e->dev == (uint64_t)buf->st_dev &&
+	   e->ino == (uint64_t)buf->st_ino &&
+	   e->size == (int64_t)buf->st_size &&
+	   e->mtime_ns == (int64_t)buf->st_mtim.tv_sec * NSEC_PER_SEC + buf->st_mtim.tv_nsec &&
+	   e->ctime_ns == (int64_t)buf->st_ctim.tv_sec * NSEC_PER_SEC + buf->st_ctim.tv_nsec;
+}
+
+
+/*
+ * cache_store - store the digest of a file in the cache
+ *
+ * given:
+ *	name	name of the file
+ *	buf	stat of the file
+ *	d	digest of the file
+ */
+static void
+cache_store(char *name, struct stat *buf, struct digest *d)
+{
+    struct cache_entry *e;	/* cache entry of name */
+    uint64_t key;		/* cache key of name */
+
+    key = cache_key(name);
+    pthread_mutex_lock(&cache_lock);
+    e = cache_slot(key);
+    e->key = 0;
+    e->dev = (uint64_t)buf->st_dev;
+    e->ino = (uint64_t)buf->st_ino;
+    e->size = (int64_t)buf->st_size;
+    e->mtime_ns = (int64_t)buf->st_mtim.tv_sec * NSEC_PER_SEC + buf->st_mtim.tv_nsec;
+    e->ctime_ns = (int64_t)buf->st_ctim.tv_sec * NSEC_PER_SEC + buf->st_ctim.tv_nsec;
+    e->digest = *d;
+    e->key = key;
+    pthread_mutex_unlock(&cache_lock);
+    return;
+}
+
+
+/*
+ * cache_copied - cache the digest of a file we just copied
+ *
+ * given:
+ *	from		name of file copied from
+ *	from_buf	fstat of from when it was copied
+ *	to		name of file copied into
+ *
+ * If the digest of the from file is cached, the to file now has that
+ * digest, so the next check does not need to read the to file.
+ */
+static void
+cache_copied(char *from, struct stat *from_buf, char *to)
+{
+    struct cache_entry *e;	/* cache entry of from */
+    struct digest d;		/* digest of from */
+    struct stat to_buf;		/* stat of to */
+    int found = 0;		/* 1 ==> from digest is cached */
+
+    /*
+     * look for the digest of the from file
+     */
+    pthread_mutex_lock(&cache_lock);
+    e = cache_slot(cache_key(from));
+    if (e->key == cache_key(from) && cache_valid(e, from_buf)) {
+	d = e->digest;
+	found = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    /*
+     * cache it for the to file
+     */
+    if (found && stat(to, &to_buf) == 0) {
+	cache_store(to, &to_buf, &d);
+    }
+    return;
+}
+
+#if defined(HAVE_IO_URING)
+/*
+ * uring_ring - return this thread's io_uring, forming it on first use
+ *
+ * returns:
+ *	pointer to the ring, or NULL ==> this thread cannot use io_uring
+ *
+ * The kernel may refuse to form a ring (io_uring can be disabled by
+ * sysctl or seccomp), or may lack an operation we use.  Then the thread
+ * does what it would do without -U.  When the buffers cannot be
+ * registered (RLIMIT_MEMLOCK), the engine uses plain reads and writes.
+ */
+static struct uring *
+uring_ring(void)
+{
+    struct io_uring_params params;	/* ring setup parameters */
+    struct io_uring_probe *probe;	/* supported operations */
+    struct iovec iov[URING_BUFS];	/* buffers to register */
+    struct uring *r;			/* ring being formed */
+    char *sq_map;			/* mapped submission and completion rings */
+    size_t sq_len;			/* length of sq_map */
+    size_t cq_len;			/* length of the completion ring */
+    size_t sqes_len;			/* length of the submission queue entries */
+    int supported;			/* 1 ==> ring has every operation we use */
+    int i;
+
+    /*
+     * use the ring we already have, or do not try again
+     */
+    if (ring != NULL) {
+	return ring;
+    } else if (ring_failed) {
+	return NULL;
+    }
+    ring_failed = 1;
+
+    /*
+     * form the ring
+     */
+    r = (struct uring *)calloc(1, sizeof(*r));
+    if (r == NULL) {
+	fprintf(stderr, "%s: uring calloc failed\n", program);
+	exit(41);
+    }
+    memset(&params, 0, sizeof(params));
+    errno = 0;
+    r->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (r->fd < 0) {
+	debug("cannot form an io_uring: %s", strerror(errno));
+	free(r);
+	return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+	debug("io_uring is too old, rings are not in a single mapping");
+	(void) close(r->fd);
+	free(r);
+	return NULL;
+    }
+
+    /*
+     * map the submission and completion rings, and the submission entries
+     */
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_len > sq_len) {
+	sq_len = cq_len;
+    }
+    errno = 0;
+    sq_map = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		  r->fd, IORING_OFF_SQ_RING);
+    if (sq_map == MAP_FAILED) {
+	debug("cannot map the io_uring rings: %s", strerror(errno));
+	(void) close(r->fd);
+	free(r);
+	return NULL;
+    }
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    errno = 0;
+    r->sqes = mmap(NULL, sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+	debug("cannot map the io_uring entries: %s", strerror(errno));
+	(void) munmap(sq_map, sq_len);
+	(void) close(r->fd);
+	free(r);
+	return NULL;
+    }
+    r->entries = params.sq_entries;
+    r->sq_head = (unsigned int *)(sq_map + params.sq_off.head);
+    r->sq_tail = (unsigned int *)(sq_map + params.sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq_map + params.sq_off.ring_mask);
+    r->tail = *r->sq_tail;
+    r->cq_head = (unsigned int *)(sq_map + params.cq_off.head);
+    r->cq_tail = (unsigned int *)(sq_map + params.cq_off.tail);
+    r->cq_mask = (unsigned int *)(sq_map + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(sq_map + params.cq_off.cqes);
+    for (i=0; i < (int)params.sq_entries; ++i) {
+	((unsigned int *)(sq_map + params.sq_off.array))[i] = i;
+    }
+
+    /*
+     * the ring must have every operation we use
+     */
+    probe = (struct io_uring_probe *)calloc(1, sizeof(*probe) +
+					    256 * sizeof(struct io_uring_probe_op));
+    if (probe == NULL) {
+	fprintf(stderr, "%s: probe calloc failed\n", program);
+	exit(42);
+    }
+    supported = (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+			 probe, 256) == 0 &&
+		 probe->last_op >= IORING_OP_WRITE &&
+		 (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) &&
+		 (probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+		 (probe->ops[IORING_OP_WRITE_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+		 (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+		 (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED));
+    free(probe);
+    if (!supported) {
+	debug("io_uring lacks statx, read or write");
+	(void) munmap(r->sqes, sqes_len);
+	(void) munmap(sq_map, sq_len);
+	(void) close(r->fd);
+	free(r);
+	return NULL;
+    }
+
+    /*
+     * register the copy buffers
+     */
+    r->bufs = mmap(NULL, URING_BUFS * URING_BUFSIZ, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (r->bufs == MAP_FAILED) {
+	fprintf(stderr, "%s: io_uring buffer mmap failed\n", program);
+	exit(43);
+    }
+    for (i=0; i < URING_BUFS; ++i) {
+	iov[i].iov_base = r->bufs + i * URING_BUFSIZ;
+	iov[i].iov_len = URING_BUFSIZ;
+    }
+    errno = 0;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+		iov, URING_BUFS) == 0) {
+	r->fixed = 1;
+    } else {
+	debug("cannot register io_uring buffers: %s, using plain reads and writes",
+	      strerror(errno));
+    }
+    debug("formed an io_uring of %u entries", r->entries);
+    ring = r;
+    ring_failed = 0;
+    return r;
+}
+
+
+/*
+ * uring_discard - stop using a ring that failed
+ *
+ * given:
+ *	r	this thread's ring
+ *
+ * Requests may still be in flight when io_uring_enter fails, so the
+ * buffers are not unmapped: closing the ring cancels the requests and
+ * the buffers stay valid until they are done.
+ */
+static void
+uring_discard(struct uring *r)
+{
+    /*
+     * firewall
+     */
+    if (r == NULL) {
+	fprintf(stderr, "%s: uring_discard called with NULL ptr\n", program);
+	exit(44);
+    }
+
+    /*
+     * this thread does without io_uring from now on
+     */
+    debug("no longer using io_uring");
+    (void) close(r->fd);
+    ring = NULL;
+    ring_failed = 1;
+    return;
+}
+
+
+/*
+ * uring_sqe - return a cleared submission queue entry to fill in
+ *
+ * given:
+ *	r	this thread's ring
+ *
+ * returns:
+ *	pointer to the entry
+ *
+ * The entry is submitted by the next uring_wait().  Callers never
+ * queue more than r->entries entries before they wait.
+ */
+static struct io_uring_sqe *
+uring_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe;	/* entry to fill in */
+
+    /*
+     * firewall
+     */
+    if (r == NULL) {
+	fprintf(stderr, "%s: uring_sqe called with NULL ptr\n", program);
+	exit(45);
+    }
+    if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) {
+	fprintf(stderr, "%s: io_uring submission queue is full\n", program);
+	exit(46);
+    }
+
+    /*
+     * take the next entry
+     */
+    sqe = &r->sqes[r->tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++r->tail;
+    ++r->pending;
+    return sqe;
+}
+
+
+/*
+ * uring_wait - submit the queued entries and wait for completions
+ *
+ * given:
+ *	r	this thread's ring
+ *	want	number of completions to wait for
+ *
+ * returns:
+ *	0 ==> want completions are ready to reap, -1 ==> ring discarded
+ */
+static int
+uring_wait(struct uring *r, unsigned int want)
+{
+    unsigned int ready;		/* completions ready to reap */
+    long ret;			/* io_uring_enter return */
+
+    /*
+     * firewall
+     */
+    if (r == NULL) {
+	fprintf(stderr, "%s: uring_wait called with NULL ptr\n", program);
+	exit(47);
+    }
+
+    /*
+     * publish the entries, then submit and wait in as few calls as we can
+     */
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    for (;;) {
+	ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+	if (r->pending == 0 && ready >= want) {
+	    return 0;
+	}
+	errno = 0;
+	ret = syscall(__NR_io_uring_enter, r->fd, r->pending,
+		      (ready < want) ? want - ready : 0,
+		      IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret < 0) {
+	    /* EINTR is the only OK error */
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    debug("io_uring_enter failed: %s", strerror(errno));
+	    uring_discard(r);
+	    return -1;
+	}
+	r->pending -= (unsigned int)ret;
+    }
+}
+
+
+/*
+ * uring_reap - take the next completion
+ *
+ * given:
+ *	r		this thread's ring
+ *	user_data	where to store the user_data of the completed entry
+ *	res		where to store the result of the completed entry
+ *
+ * returns:
+ *	1 ==> took a completion, 0 ==> none are ready
+ */
+static int
+uring_reap(struct uring *r, uint64_t *user_data, int *res)
+{
+    struct io_uring_cqe *cqe;	/* completion queue entry */
+    unsigned int head;		/* completion queue head */
+
+    /*
+     * firewall
+     */
+    if (r == NULL || user_data == NULL || res == NULL) {
+	fprintf(stderr, "%s: uring_reap called with NULL ptr\n", program);
+	exit(48);
+    }
+
+    /*
+     * take the entry at the head, if any
+     */
+    head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+	return 0;
+    }
+    cqe = &r->cqes[head & *r->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/*
+ * uring_stat_due - statx the pairs in due[] and mark the settled pairs
+ *
+ * given:
+ *	ndue	number of pairs in due[]
+ *
+ * A pair is settled when src and dest are both regular files with the
+ * same mode, length and mod time: check_pair() would find nothing to
+ * do, so the pair need not be opened.  Up to URING_ENTRIES/2 pairs are
+ * stated by each io_uring_enter.  When a batch fails, its pairs are
+ * left unsettled and are checked one system call at a time.
+ */
+static void
+uring_stat_due(int ndue)
+{
+    struct uring *r;		/* main thread's ring */
+    struct io_uring_sqe *sqe;	/* submission queue entry */
+    struct pair *p;		/* pair being stated */
+    struct statx *s;		/* src statx */
+    struct statx *d;		/* dest statx */
+    int ok[URING_ENTRIES];	/* 1 ==> statx into due_stat[i] worked */
+    uint64_t user_data;		/* index in due_stat[] of a completion */
+    int result;			/* statx result */
+    int start;			/* index in due[] of the first pair of the batch */
+    int n;			/* pairs in this batch */
+    int i;
+
+    /*
+     * no pair is settled until its statx says so
+     */
+    for (i=0; i < ndue; ++i) {
+	pairs[due[i]].settled = 0;
+    }
+    r = uring_ring();
+    if (r == NULL) {
+	return;
+    }
+
+    /*
+     * statx each batch of pairs
+     */
+    for (start=0; start < ndue; start += n) {
+	n = ndue - start;
+	if (n > URING_ENTRIES/2) {
+	    n = URING_ENTRIES/2;
+	}
+	for (i=0; i < n; ++i) {
+	    p = &pairs[due[start+i]];
+	    (void) dir_check(p->src_dir, 0);
+	    (void) dir_check(p->dest_dir, 0);
+	    sqe = uring_sqe(r);
+	    sqe->opcode = IORING_OP_STATX;
+	    sqe->addr = (uintptr_t)at_dir(p->src_dir, p->src_base, p->src, &sqe->fd);
+	    sqe->len = STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME;
+	    sqe->off = (uintptr_t)&due_stat[2*i];
+	    sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+	    sqe->user_data = 2*i;
+	    sqe = uring_sqe(r);
+	    sqe->opcode = IORING_OP_STATX;
+	    sqe->addr = (uintptr_t)at_dir(p->dest_dir, p->dest_base, p->dest, &sqe->fd);
+	    sqe->len = STATX_TYPE|STATX_MODE|STATX_SIZE|STATX_MTIME;
+	    sqe->off = (uintptr_t)&due_stat[2*i+1];
+	    sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+	    sqe->user_data = 2*i+1;
+	}
+	if (uring_wait(r, 2*n) < 0) {
+	    return;
+	}
+	memset(ok, 0, sizeof(ok));
+	for (i=0; i < 2*n; ++i) {
+	    if (uring_reap(r, &user_data, &result) == 0 || user_data >= (uint64_t)(2*n)) {
+		fprintf(stderr, "%s: lost an io_uring statx completion\n", program);
+		exit(49);
+	    }
+	    ok[user_data] = (result == 0);
+	}
+	for (i=0; i < n; ++i) {
+	    p = &pairs[due[start+i]];
+	    s = &due_stat[2*i];
+	    d = &due_stat[2*i+1];
+	    p->settled = (ok[2*i] && ok[2*i+1] &&
+			  S_ISREG(s->stx_mode) && S_ISREG(d->stx_mode) &&
+			  s->stx_mode == d->stx_mode &&
+			  s->stx_size == d->stx_size &&
+			  s->stx_mtime.tv_sec == d->stx_mtime.tv_sec);
+	}
+    }
+    return;
+}
+#endif
+
+
+/*
+ * same_contents - determine if src and dest have the same contents
+ *
+ * given:
+ *	src_fd		open src descriptor
+ *	src_buf		fstat of src_fd
+ *	src		src filename
+ *	dest_fd		open dest descriptor
+ *	dest_buf	fstat of dest_fd
+ *	dest		dest filename
+ *
+ * returns:
+ *	1 ==> same contents, 0 ==> different, -1 ==> unable to tell
+ */
+static int
+same_contents(int src_fd, struct stat *src_buf, char *src,
+	      int dest_fd, struct stat *dest_buf, char *dest)
+{
+    struct digest src_digest;	/* digest of src */
+    struct digest dest_digest;	/* digest of dest */
+
+    /*
+     * different lengths mean different contents
+     */
+    if (src_buf->st_size != dest_buf->st_size) {
+	return 0;
+    }
+
+    /*
+     * compare digests
+     */
+    if (cached_digest(src_fd, src_buf, src, &src_digest) < 0 ||
+	cached_digest(dest_fd, dest_buf, dest, &dest_digest) < 0) {
+	return -1;
+    }
+    debug("src digest: %08x%08x%08x%08x: %s",
+	  src_digest.lane[0], src_digest.lane[1],
+	  src_digest.lane[2], src_digest.lane[3], src);
+    debug("dest digest: %08x%08x%08x%08x: %s",
+	  dest_digest.lane[0], dest_digest.lane[1],
+	  dest_digest.lane[2], dest_digest.lane[3], dest);
+    return memcmp(&src_digest, &dest_digest, sizeof(src_digest)) == 0;
+}
+
+
+/*
+ * same_data - determine if src and dest have the same data, by reading both
+ *
+ * given:
+ *	src_fd		open src descriptor
+ *	src_buf		fstat of src_fd
+ *	src		src filename
+ *	dest_fd		open dest descriptor
+ *	dest_buf	fstat of dest_fd
+ *	dest		dest filename
+ *
+ * returns:
+ *	1 ==> same contents, 0 ==> different, -1 ==> unable to tell
+ *
+ * Both files are read SAME_BUFSIZ octets at a time and compared with
+ * memcmp(), which the C library vectorizes.  Files that differ usually
+ * do so in the first buffer.  We read rather than mmap, as a file
+ * truncated while mapped would kill us with SIGBUS.  A file written or
+ * truncated while we compared it cannot be trusted to be the same.
+ */
+static int
+same_data(int src_fd, struct stat *src_buf, char *src,
+	  int dest_fd, struct stat *dest_buf, char *dest)
+{
+    char *src_data;		/* buffer of src data */
+    char *dest_data;		/* buffer of dest data */
+    off_t offset;		/* start of the buffer in the files */
+    size_t len;			/* octets to compare in the buffer */
+    ssize_t src_cnt;		/* octets read from src */
+    ssize_t dest_cnt;		/* octets read from dest */
+    int same = 1;		/* 1 ==> no difference found yet */
+
+    /*
+     * firewall
+     */
+    if (src_buf == NULL || src == NULL || dest_buf == NULL || dest == NULL) {
+	fprintf(stderr, "%s: same_data called with NULL ptr\n", program);
+	exit(102);
+    }
+
+    /*
+     * different lengths mean different contents
+     */
+    if (src_buf->st_size != dest_buf->st_size) {
+	return 0;
+    }
+
+    /*
+     * allocate the read buffers
+     */
+    src_data = (char *)malloc(2*SAME_BUFSIZ);
+    if (src_data == NULL) {
+	debug("compare buffer malloc failed");
+	return -1;
+    }
+    dest_data = src_data + SAME_BUFSIZ;
+    (void) posix_fadvise(src_fd, (off_t)0, (off_t)0, POSIX_FADV_SEQUENTIAL);
+    (void) posix_fadvise(dest_fd, (off_t)0, (off_t)0, POSIX_FADV_SEQUENTIAL);
+
+    /*
+     * compare a buffer at a time
+     */
+    for (offset=0; same && offset < src_buf->st_size; offset += len) {
+	len = (src_buf->st_size - offset < SAME_BUFSIZ) ?
+	      (size_t)(src_buf->st_size - offset) : (size_t)SAME_BUFSIZ;
+	src_cnt = pread_full(src_fd, src_data, len, offset);
+	if (src_cnt < 0) {
+	    debug("bad read from %s: %s", src, strerror(errno));
+	    free(src_data);
+	    return -1;
+	}
+	dest_cnt = pread_full(dest_fd, dest_data, len, offset);
+	if (dest_cnt < 0) {
+	    debug("bad read from %s: %s", dest, strerror(errno));
+	    free(src_data);
+	    return -1;
+	}
+	if ((size_t)src_cnt != len || (size_t)dest_cnt != len) {
+	    debug("%s or %s shrank while we compared them", src, dest);
+	    free(src_data);
+	    return -1;
+	}
+	same = (memcmp(src_data, dest_data, len) == 0);
+    }
+    free(src_data);
+    if (from_changed(src_fd, src_buf) || from_changed(dest_fd, dest_buf)) {
+	debug("%s or %s changed while we compared them", src, dest);
+	return -1;
+    }
+    return same;
+}
+
+
+/*
+ * sync_attrs - give a file with the same contents the attributes of another
+ *
+ * given:
+ *	to_fd		open descriptor of the file to change
+ *	from_buf	fstat of the file with the attributes
+ *	from		name of the file with the attributes
+ *	to		name of the file to change
+ *
+ * returns:
+ *	0 ==> attributes set, -1 ==> error
+ *
+ * This is what copy_file() would do to the temp file, without the copy.
+ */
+static int
+sync_attrs(int to_fd, struct stat *from_buf, char *from, char *to)
+{
+    struct timespec times[2];	/* access and modification time to set */
+
+    /*
+     * firewall
+     */
+    if (from_buf == NULL || from == NULL || to == NULL) {
+	fprintf(stderr, "%s: sync_attrs called with NULL ptr\n", program);
+	exit(103);
+    }
+
+    /*
+     * set mode
+     */
+    errno = 0;
+    if (fchmod(to_fd, from_buf->st_mode) < 0) {
+	debug("cannot chmod %s %03o: %s", to, from_buf->st_mode, strerror(errno));
+	return -1;
     }
 
     /*
-     * send data from the from file to the to file :-)
+     * set ownership and group if we are root
      */
-    count = (off_t)src_buf->st_size;
-    if (count > 0) {
-	debug("copying %lld octets %s ==> %s", (long long)count, from, new_to);
-	do {
+    if (uid == 0 && fchown(to_fd, from_buf->st_uid, from_buf->st_gid) < 0) {
+	debug("unable to chown %d.%d of %s: %s",
+	      from_buf->st_uid, from_buf->st_gid, to, strerror(errno));
+	debug("will continue anyway");
+	/* OK to continue */
+    }
 
-#if defined(HAVE_SENDFILE)
-	    /*
-	     * transfer by sendfile
-	     */
-	    errno = 0;
-	    written = sendfile(to_fd, from_fd, &offset, count);
+    /*
+     * set file times, to the nanosecond
+     */
+    times[0] = from_buf->st_atim;
+    times[1] = from_buf->st_mtim;
+    errno = 0;
+    if (futimens(to_fd, times) < 0) {
+	debug("unable to set file time on %s: %s", to, strerror(errno));
+	return -1;
+    }
+    if (cache != NULL) {
+	cache_copied(from, from_buf, to);
+    }
+    STAT_ADD(stats.attrs_synced, 1);
+    debug("synced attributes %s ==> %s", from, to);
+    return 0;
+}
 
-	    /* transfer failed, EINTR is the only OK error */
-	    if (written < 0 && errno != EINTR) {
-		debug("sendfile %s to %s failed: %s",
-		      from, new_to, strerror(errno));
-		(void) close(to_fd);
-		(void) unlink(new_to);
-		return;
-	    } else if (written == 0) {
-		debug("sendfile transferred 0 octets");
-		(void) close(to_fd);
-		(void) unlink(new_to);
-		return;
-	    }
 
-	    /* determine next count needed, if any */
-	    count = src_buf->st_size - offset;
+/*
+ * copy_extents - copy the data in a range, leaving its holes as holes
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	to_fd		open temp file descriptor to copy into
+ *	start		first octet to copy
+ *	end		octet after the last octet to copy
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *	engine		first engine to try, ENGINE_DIRECT or ENGINE_CFR
+ *
+ * returns:
+ *	0 ==> copied, 1 ==> from file changed, -1 ==> failed
+ *
+ * SEEK_DATA and SEEK_HOLE find the data of the from file, and only the
+ * data is copied by copy_range().  The temp file starts empty, so the
+ * ranges that we skip stay holes.  A filesystem that does not track
+ * holes reports all of the file as data.
+ */
+static int
+copy_extents(int from_fd, int to_fd, off_t start, off_t end,
+	     char *from, char *new_to, int engine)
+{
+    off_t offset;		/* start of the range left to copy */
+    off_t data;			/* start of the next data */
+    off_t hole;			/* start of the hole after the data */
+    off_t holes = 0;		/* octets of holes skipped */
+    int ret;			/* copy_range() return */
 
-#else
+    /*
+     * copy each run of data
+     */
+    for (offset = start; offset < end; offset = hole) {
 
-	    /*
-	     * transfer by read/write buffer
-	     */
-	    count = 0;
+	/* find the next data and the hole after it */
+	errno = 0;
+	data = lseek(from_fd, offset, SEEK_DATA);
+	if (data < 0 && errno == ENXIO) {
+	    /* the rest is a hole */
+	    holes += end - offset;
+	    break;
+	} else if (data < 0) {
+	    /* cannot find holes, copy the rest as data */
+	    debug("cannot find data in %s: %s, copying it all",
+		  from, strerror(errno));
+	    data = offset;
+	    hole = end;
+	} else if (data >= end) {
+	    holes += end - offset;
+	    break;
+	} else {
 	    errno = 0;
-	    /* read a buffer */
-	    readcnt = read(from_fd, buf, BUFSIZ);
-	    if (readcnt < 0) {
-		/* EINTR is the only OK error */
-		if (errno != EINTR) {
-		    debug("bad read from %s: %s", from, strerror(errno));
-		    (void) close(to_fd);
-		    (void) unlink(new_to);
-		    return;
-		}
-	    } else if (readcnt == 0) {
-		debug("empty read from %s: %s", from, strerror(errno));
-		(void) close(to_fd);
-		(void) unlink(new_to);
-		return;
-
-	    /* write the same buffer */
-	    } else if (readcnt > 0) {
-		errno = 0;
-		written = write(to_fd, buf, readcnt);
-		if (written < 0) {
-		    debug("bad write to %s: %s", new_to, strerror(errno));
-		    (void) close(to_fd);
-		    (void) unlink(new_to);
-		    return;
-		} else if (written != readcnt) {
-		    debug("wrote only %ld out of %ld to %s: %s",
-			  written, readcnt, new_to, strerror(errno));
-		    (void) close(to_fd);
-		    (void) unlink(new_to);
-		    return;
-		}
+	    hole = lseek(from_fd, data, SEEK_HOLE);
+	    if (hole < 0 || hole > end) {
+		hole = end;
 	    }
+	}
+	holes += data - offset;
 
-	    /* note how much data is left to transfer */
-	    count -= written;
+	/* copy the data */
+	ret = copy_range(from_fd, to_fd, data, hole, from, new_to, engine);
+	if (ret != 0) {
+	    return ret;
+	}
+    }
+    if (holes > 0) {
+	debug("left %lld octets of holes in %s", (long long)holes, new_to);
+    }
+    return 0;
+}
 
-#endif
 
-	} while (count > 0);
+/*
+ * copy_range - copy a range of the from file into the same range of the temp file
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	to_fd		open temp file descriptor to copy into
+ *	start		first octet to copy
+ *	end		octet after the last octet to copy
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *	engine		first engine to try, ENGINE_DIRECT or ENGINE_CFR
+ *
+ * returns:
+ *	0 ==> copied, 1 ==> from file changed, -1 ==> failed
+ *
+ * The engines are tried fastest first.  When an engine cannot copy
+ * between these files it returns COPY_NEXT, and the next engine
+ * continues from where it stopped.  The engines copy a CHANGE_WINDOW
+ * at a time, or with -F drop or direct a DROP_WINDOW, so that we can
+ * stop when the from file changes, and drop the copied pages behind
+ * the copy.  A failure of an engine is often a from file that was
+ * truncated under it, so that is reported as a change too.
+ */
+static int
+copy_range(int from_fd, int to_fd, off_t start, off_t end,
+	   char *from, char *new_to, int engine)
+{
+    off_t offset = start;	/* next octet to copy */
+    off_t window_end;		/* octet after the window being copied */
+    off_t dropped = start;	/* first octet that may still be in the page cache */
+    off_t started = start;	/* octet after the last window being written back */
+    off_t before;		/* offset before the engine ran */
+    struct stat from_buf;	/* fstat of from_fd before the copy */
+    int watching;		/* 1 ==> from_buf is set, watch for changes */
+    int first = -1;		/* first engine that copied something */
+    int ret = COPY_NEXT;	/* engine return */
 
-    } else {
-	debug("src is empty, creating empty %s", new_to);
+    /*
+     * try each engine in turn
+     */
+    watching = (fstat(from_fd, &from_buf) == 0);
+    while (engine < ENGINE_CNT) {
+	if (page_policy != PAGES_KEEP && engine != ENGINE_DIRECT &&
+	    end - offset > DROP_WINDOW) {
+	    window_end = offset + DROP_WINDOW;
+	} else if (end - offset > CHANGE_WINDOW) {
+	    window_end = offset + CHANGE_WINDOW;
+	} else {
+	    window_end = end;
+	}
+	before = offset;
+	switch (engine) {
+	case ENGINE_DIRECT:
+	    ret = copy_by_direct(from_fd, to_fd, &offset, window_end, from, new_to);
+	    break;
+	case ENGINE_CFR:
+	    ret = copy_by_cfr(from_fd, to_fd, &offset, window_end, from, new_to);
+	    break;
+	case ENGINE_URING:
+	    ret = copy_by_uring(from_fd, to_fd, &offset, window_end, from, new_to);
+	    break;
+	case ENGINE_SENDFILE:
+	    ret = copy_by_sendfile(from_fd, to_fd, &offset, window_end, from, new_to);
+	    break;
+	default:
+	    ret = copy_by_rw(from_fd, to_fd, &offset, window_end, from, new_to);
+	    break;
+	}
+	if (offset > before) {
+	    STAT_ADD(stats.bytes[engine], offset - before);
+	    if (first < 0) {
+		first = engine;
+	    }
+	}
+	if (ret == COPY_FAIL) {
+	    break;
+	} else if (ret == COPY_NEXT) {
+	    engine = next_engine(engine);
+	    continue;
+	}
+	if (page_policy != PAGES_KEEP && engine != ENGINE_DIRECT) {
+	    drop_behind(from_fd, to_fd, &dropped, &started, offset, offset >= end);
+	}
+	if (offset >= end) {
+	    if (first < 0 || engine == first) {
+		debug("copied %lld octets by %s %s ==> %s",
+		      (long long)(end - start), engine_name[engine], from, new_to);
+	    } else {
+		debug("copied %lld octets by %s and %s %s ==> %s",
+		      (long long)(end - start), engine_name[first],
+		      engine_name[engine], from, new_to);
+	    }
+	    return 0;
+	}
+
+	/* stop copying a from file that was written */
+	if (watching && from_changed(from_fd, &from_buf)) {
+	    debug("%s changed, stopped copying at %lld of %lld octets",
+		  from, (long long)(offset - start), (long long)(end - start));
+	    return 1;
+	}
+    }
+    if (watching && from_changed(from_fd, &from_buf)) {
+	debug("%s changed, stopped copying at %lld of %lld octets",
+	      from, (long long)(offset - start), (long long)(end - start));
+	return 1;
+    } else if (ret != COPY_FAIL) {
+	debug("no engine could copy %s to %s", from, new_to);
     }
+    return -1;
+}
+
 
+/*
+ * drop_behind - let the pages of a copy leave the page cache
+ *
+ * given:
+ *	from_fd		open file descriptor being copied from
+ *	to_fd		open temp file descriptor being copied into
+ *	dropped		pointer to first octet that may still be cached
+ *	started		pointer to octet after the last window being written back
+ *	done		octet after the last octet copied
+ *	last		1 ==> the copy is done, drop all of it
+ *
+ * Dirty pages cannot be dropped, so we start writeback of the newest
+ * window and wait for, then drop, the window before it.
+ */
+static void
+drop_behind(int from_fd, int to_fd, off_t *dropped, off_t *started,
+	    off_t done, int last)
+{
     /*
-     * set mode
+     * firewall
      */
-    errno = 0;
-    if (fchmod(to_fd, src_buf->st_mode) < 0) {
-	debug("cannot chmod %s %03o: %s",
-	      new_to, src_buf->st_mode, strerror(errno));
-	(void) unlink(new_to);
-	return;
+    if (dropped == NULL || started == NULL) {
+	fprintf(stderr, "%s: drop_behind called with NULL ptr\n", program);
+	exit(55);
     }
 
     /*
-     * set ownership and group if we are root
+     * start writeback of the newest window
      */
-    if (uid == 0 && fchown(to_fd, src_buf->st_uid, src_buf->st_gid) < 0) {
-	debug("unable to chown %d.%d of %s: %s",
-	      src_buf->st_uid, src_buf->st_gid, new_to,
-	      strerror(errno));
-	debug("will continue anyway");
-	/* OK to continue */
+    if (done > *started) {
+	(void) sync_file_range(to_fd, *started, done - *started, SYNC_FILE_RANGE_WRITE);
+    }
+    if (last) {
+	*started = done;
     }
 
     /*
-     * close up the complete and new file
+     * wait for and drop the windows before it, or everything when done
      */
-    (void) close(to_fd);
+    if (*started > *dropped) {
+	(void) sync_file_range(to_fd, *dropped, *started - *dropped,
+			       SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|
+			       SYNC_FILE_RANGE_WAIT_AFTER);
+	(void) posix_fadvise(to_fd, *dropped, *started - *dropped, POSIX_FADV_DONTNEED);
+	(void) posix_fadvise(from_fd, *dropped, *started - *dropped, POSIX_FADV_DONTNEED);
+    }
+    *dropped = *started;
+    *started = done;
+    return;
+}
+
+
+/*
+ * copy_by_direct - copy a range with O_DIRECT reads and writes
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	to_fd		open temp file descriptor to copy into
+ *	offset		pointer to next octet to copy, advanced as we copy
+ *	end		octet after the last octet to copy
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *
+ * returns:
+ *	COPY_DONE, COPY_NEXT or COPY_FAIL
+ *
+ * We open both files again via /proc/self/fd with O_DIRECT, so that the
+ * descriptors of the caller (and of other -P threads) are not changed.
+ * O_DIRECT needs aligned offsets and lengths, so only the whole
+ * DIRECT_ALIGN blocks are copied here, and the next engine copies
+ * the tail of the file.
+ */
+static int
+copy_by_direct(int from_fd, int to_fd, off_t *offset, off_t end,
+	       char *from, char *new_to)
+{
+    char path[sizeof("/proc/self/fd/") + 3*sizeof(int)];	/* /proc path of a descriptor */
+    int dfrom_fd;		/* O_DIRECT from descriptor */
+    int dto_fd;			/* O_DIRECT temp descriptor */
+    void *buf;			/* aligned I/O buffer */
+    off_t aligned_end;		/* end of the last whole block to copy */
+    ssize_t readcnt;		/* octets read from from */
+    ssize_t written;		/* octets written */
+    size_t len;			/* octets to read */
+    int ret = COPY_DONE;	/* copy return */
+
+    /*
+     * we can only copy whole blocks
+     */
+    aligned_end = end / DIRECT_ALIGN * DIRECT_ALIGN;
+    if (*offset % DIRECT_ALIGN != 0 || *offset >= aligned_end) {
+	debug("%s cannot copy an unaligned range of %s, trying %s",
+	      engine_name[ENGINE_DIRECT], from, engine_name[next_engine(ENGINE_DIRECT)]);
+	return COPY_NEXT;
+    }
 
     /*
-     * set new file attributes
+     * open both files again with O_DIRECT
      */
-    timebuf.actime = src_buf->st_atime;
-    timebuf.modtime = src_buf->st_mtime;
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", from_fd);
     errno = 0;
-    if (utime(new_to, &timebuf) < 0) {
-	debug("unable to set file time on %s: %s", new_to, strerror(errno));
-	(void) unlink(new_to);
-	return;
+    dfrom_fd = open(path, O_RDONLY|O_DIRECT);
+    if (dfrom_fd < 0) {
+	debug("cannot open %s with %s: %s, trying %s", from, engine_name[ENGINE_DIRECT],
+	      strerror(errno), engine_name[next_engine(ENGINE_DIRECT)]);
+	return COPY_NEXT;
+    }
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", to_fd);
+    errno = 0;
+    dto_fd = open(path, O_WRONLY|O_DIRECT);
+    if (dto_fd < 0) {
+	debug("cannot open %s with %s: %s, trying %s", new_to, engine_name[ENGINE_DIRECT],
+	      strerror(errno), engine_name[next_engine(ENGINE_DIRECT)]);
+	(void) close(dfrom_fd);
+	return COPY_NEXT;
+    }
+    if (posix_memalign(&buf, DIRECT_ALIGN, DIRECT_BUFSIZ) != 0) {
+	fprintf(stderr, "%s: O_DIRECT buffer posix_memalign failed\n", program);
+	exit(56);
     }
 
     /*
-     * move new file into place
+     * copy the whole blocks
+     */
+    while (*offset < aligned_end) {
+
+	/* read a buffer */
+	len = (aligned_end - *offset < DIRECT_BUFSIZ) ?
+	      (size_t)(aligned_end - *offset) : DIRECT_BUFSIZ;
+	errno = 0;
+	readcnt = pread(dfrom_fd, buf, len, *offset);
+	if (readcnt < 0) {
+	    /* EINTR is OK, EINVAL means this filesystem cannot O_DIRECT */
+	    if (errno == EINTR) {
+		continue;
+	    } else if (errno == EINVAL) {
+		debug("cannot %s %s to %s: %s, trying %s",
+		      engine_name[ENGINE_DIRECT], from, new_to, strerror(errno),
+		      engine_name[next_engine(ENGINE_DIRECT)]);
+		ret = COPY_NEXT;
+		break;
+	    }
+	    debug("bad read from %s: %s", from, strerror(errno));
+	    ret = COPY_FAIL;
+	    break;
+	} else if (readcnt == 0) {
+	    debug("empty read from %s", from);
+	    ret = COPY_FAIL;
+	    break;
+	} else if (readcnt % DIRECT_ALIGN != 0) {
+	    /* the file became shorter, let the next engine sort it out */
+	    debug("short %s read of %s, trying %s", engine_name[ENGINE_DIRECT],
+		  from, engine_name[next_engine(ENGINE_DIRECT)]);
+	    ret = COPY_NEXT;
+	    break;
+	}
+
+	/* write the same buffer */
+	errno = 0;
+	written = pwrite(dto_fd, buf, readcnt, *offset);
+	if (written < 0 && errno == EINVAL) {
+	    debug("cannot %s %s to %s: %s, trying %s",
+		  engine_name[ENGINE_DIRECT], from, new_to, strerror(errno),
+		  engine_name[next_engine(ENGINE_DIRECT)]);
+	    ret = COPY_NEXT;
+	    break;
+	} else if (written < 0) {
+	    debug("bad write to %s: %s", new_to, strerror(errno));
+	    ret = COPY_FAIL;
+	    break;
+	} else if (written != readcnt) {
+	    debug("wrote only %ld out of %ld to %s",
+		  (long)written, (long)readcnt, new_to);
+	    ret = COPY_FAIL;
+	    break;
+	}
+	*offset += written;
+    }
+    free(buf);
+    (void) close(dfrom_fd);
+    (void) close(dto_fd);
+
+    /*
+     * the next engine copies any partial block at the end
+     */
+    if (ret == COPY_DONE && *offset < end) {
+	debug("copying the last %lld octets of %s by %s",
+	      (long long)(end - *offset), from, engine_name[next_engine(ENGINE_DIRECT)]);
+	ret = COPY_NEXT;
+    }
+    return ret;
+}
+
+
+/*
+ * copy_by_cfr - copy a range by copy_file_range
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	to_fd		open temp file descriptor to copy into
+ *	offset		pointer to next octet to copy, advanced as we copy
+ *	end		octet after the last octet to copy
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *
+ * returns:
+ *	COPY_DONE, COPY_NEXT or COPY_FAIL
+ */
+static int
+copy_by_cfr(int from_fd, int to_fd, off_t *offset, off_t end,
+	    char *from, char *new_to)
+{
+#if defined(HAVE_COPY_FILE_RANGE)
+    off_t off_out;		/* temp file offset */
+    ssize_t written;		/* octets copied */
+
+    while (*offset < end) {
+	off_out = *offset;
+	errno = 0;
+	written = copy_file_range(from_fd, offset, to_fd, &off_out,
+				  (size_t)(end - *offset), 0);
+	if (written < 0) {
+	    /* EINTR is OK, these errors mean try the next engine */
+	    if (errno == EINTR) {
+		continue;
+	    } else if (errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL ||
+		       errno == ENOSYS) {
+		debug("cannot %s %s to %s: %s, trying %s",
+		      engine_name[ENGINE_CFR], from, new_to, strerror(errno),
+		      engine_name[next_engine(ENGINE_CFR)]);
+		return COPY_NEXT;
+	    }
+	    debug("%s %s to %s failed: %s",
+		  engine_name[ENGINE_CFR], from, new_to, strerror(errno));
+	    return COPY_FAIL;
+	} else if (written == 0) {
+	    debug("%s transferred 0 octets", engine_name[ENGINE_CFR]);
+	    return COPY_FAIL;
+	}
+    }
+    return COPY_DONE;
+#else
+    return COPY_NEXT;
+#endif
+}
+
+
+/*
+ * next_engine - return the engine to try after an engine
+ *
+ * given:
+ *	engine	engine that cannot copy
+ *
+ * returns:
+ *	next engine, ENGINE_CNT ==> no engines left
+ *
+ * The O_DIRECT engine is only tried first, and the io_uring engine is
+ * only tried if -U.
+ */
+static int
+next_engine(int engine)
+{
+    ++engine;
+    if (engine == ENGINE_DIRECT) {
+	++engine;
+    }
+    if (engine == ENGINE_URING && !use_uring) {
+	++engine;
+    }
+    return engine;
+}
+
+
+/*
+ * copy_by_uring - copy a range by io_uring reads linked to writes
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	to_fd		open temp file descriptor to copy into
+ *	offset		pointer to next octet to copy, advanced as we copy
+ *	end		octet after the last octet to copy
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *
+ * returns:
+ *	COPY_DONE, COPY_NEXT or COPY_FAIL
+ *
+ * Each io_uring_enter submits a read into every registered buffer, each
+ * read linked to the write of its buffer.  A short read cancels its
+ * write, so *offset only moves past buffers that were read and written
+ * in full, and the next engine continues from there.
+ */
+static int
+copy_by_uring(int from_fd, int to_fd, off_t *offset, off_t end,
+	      char *from, char *new_to)
+{
+#if defined(HAVE_IO_URING)
+    struct uring *r;		/* this thread's ring */
+    struct io_uring_sqe *sqe;	/* submission queue entry */
+    size_t len[URING_BUFS];	/* octets to move through each buffer */
+    int res[2*URING_BUFS];	/* read and write results of each buffer */
+    uint64_t user_data;		/* index in res[] of a completion */
+    int result;			/* read or write result */
+    off_t pos;			/* file offset of the next buffer */
+    int err;			/* error of the first buffer that failed */
+    int n;			/* buffers in this batch */
+    int i;
+
+    /*
+     * use this thread's ring, if it has one
      */
-    debug("rename %s ==> %s", new_to, to);
+    r = uring_ring();
+    if (r == NULL) {
+	debug("cannot %s %s to %s, trying %s",
+	      engine_name[ENGINE_URING], from, new_to,
+	      engine_name[next_engine(ENGINE_URING)]);
+	return COPY_NEXT;
+    }
+
+    while (*offset < end) {
+
+	/* queue a read linked to a write for each buffer */
+	pos = *offset;
+	for (n=0; n < URING_BUFS && pos < end; ++n) {
+	    len[n] = (end - pos < URING_BUFSIZ) ? (size_t)(end - pos) : URING_BUFSIZ;
+	    sqe = uring_sqe(r);
+	    sqe->opcode = r->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	    sqe->flags = IOSQE_IO_LINK;
+	    sqe->fd = from_fd;
+	    sqe->addr = (uintptr_t)(r->bufs + n * URING_BUFSIZ);
+	    sqe->len = len[n];
+	    sqe->off = pos;
+	    sqe->buf_index = n;
+	    sqe->user_data = 2*n;
+	    sqe = uring_sqe(r);
+	    sqe->opcode = r->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	    sqe->fd = to_fd;
+	    sqe->addr = (uintptr_t)(r->bufs + n * URING_BUFSIZ);
+	    sqe->len = len[n];
+	    sqe->off = pos;
+	    sqe->buf_index = n;
+	    sqe->user_data = 2*n+1;
+	    pos += len[n];
+	}
+
+	/* submit them all and wait for every read and write */
+	if (uring_wait(r, 2*n) < 0) {
+	    debug("cannot %s %s to %s, trying %s",
+		  engine_name[ENGINE_URING], from, new_to,
+		  engine_name[next_engine(ENGINE_URING)]);
+	    return COPY_NEXT;
+	}
+	for (i=0; i < 2*n; ++i) {
+	    if (uring_reap(r, &user_data, &result) == 0 || user_data >= (uint64_t)(2*n)) {
+		fprintf(stderr, "%s: lost an io_uring copy completion\n", program);
+		exit(50);
+	    }
+	    res[user_data] = result;
+	}
+
+	/* move past the buffers that were read and written in full */
+	for (i=0; i < n; ++i) {
+	    if (res[2*i] != (int)len[i] || res[2*i+1] != (int)len[i]) {
+		break;
+	    }
+	    *offset += len[i];
+	}
+	if (i < n) {
+	    if (res[2*i] < 0) {
+		err = -res[2*i];
+	    } else if (res[2*i+1] < 0 && res[2*i+1] != -ECANCELED) {
+		err = -res[2*i+1];
+	    } else {
+		/* short read or write, let the next engine sort it out */
+		debug("short %s of %s to %s, trying %s",
+		      engine_name[ENGINE_URING], from, new_to,
+		      engine_name[next_engine(ENGINE_URING)]);
+		return COPY_NEXT;
+	    }
+	    if (err == EINVAL || err == EOPNOTSUPP || err == ENOSYS) {
+		debug("cannot %s %s to %s: %s, trying %s",
+		      engine_name[ENGINE_URING], from, new_to, strerror(err),
+		      engine_name[next_engine(ENGINE_URING)]);
+		return COPY_NEXT;
+	    }
+	    debug("%s %s to %s failed: %s",
+		  engine_name[ENGINE_URING], from, new_to, strerror(err));
+	    return COPY_FAIL;
+	}
+    }
+    return COPY_DONE;
+#else
+    return COPY_NEXT;
+#endif
+}
+
+
+/*
+ * copy_by_sendfile - copy a range by sendfile
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	to_fd		open temp file descriptor to copy into
+ *	offset		pointer to next octet to copy, advanced as we copy
+ *	end		octet after the last octet to copy
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *
+ * returns:
+ *	COPY_DONE, COPY_NEXT or COPY_FAIL
+ *
+ * sendfile writes at the file offset of to_fd, so we seek there first.
+ */
+static int
+copy_by_sendfile(int from_fd, int to_fd, off_t *offset, off_t end,
+		 char *from, char *new_to)
+{
+#if defined(HAVE_SENDFILE)
+    ssize_t written;		/* octets copied */
+
     errno = 0;
-    if (rename(new_to, to) < 0) {
-	debug("move %s to %s failed: %s", new_to, to, strerror(errno));
-	(void) unlink(new_to);
-	return;
+    if (lseek(to_fd, *offset, SEEK_SET) < 0) {
+	debug("cannot seek %s: %s", new_to, strerror(errno));
+	return COPY_FAIL;
     }
-    debug("completed sync %s ==> %s", from, to);
-    return;
+    while (*offset < end) {
+	errno = 0;
+	written = sendfile(to_fd, from_fd, offset, (size_t)(end - *offset));
+	if (written < 0) {
+	    /* EINTR is OK, these errors mean try the next engine */
+	    if (errno == EINTR) {
+		continue;
+	    } else if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+		debug("cannot %s %s to %s: %s, trying %s",
+		      engine_name[ENGINE_SENDFILE], from, new_to, strerror(errno),
+		      engine_name[ENGINE_RW]);
+		return COPY_NEXT;
+	    }
+	    debug("sendfile %s to %s failed: %s",
+		  from, new_to, strerror(errno));
+	    return COPY_FAIL;
+	} else if (written == 0) {
+	    debug("sendfile transferred 0 octets");
+	    return COPY_FAIL;
+	}
+    }
+    return COPY_DONE;
+#else
+    return COPY_NEXT;
+#endif
+}
+
+
+/*
+ * copy_by_rw - copy a range by read and write via a buffer
+ *
+ * given:
+ *	from_fd		open file descriptor to copy from
+ *	to_fd		open temp file descriptor to copy into
+ *	offset		pointer to next octet to copy, advanced as we copy
+ *	end		octet after the last octet to copy
+ *	from		name of file being copied from
+ *	new_to		temp filename
+ *
+ * returns:
+ *	COPY_DONE or COPY_FAIL
+ */
+static int
+copy_by_rw(int from_fd, int to_fd, off_t *offset, off_t end,
+	   char *from, char *new_to)
+{
+    char buf[RW_BUFSIZ];	/* I/O buffer */
+    ssize_t readcnt;		/* octets read from from */
+    ssize_t written;		/* octets written */
+    size_t len;			/* octets to read */
+
+    while (*offset < end) {
+
+	/* read a buffer */
+	len = (end - *offset < (off_t)sizeof(buf)) ? (size_t)(end - *offset) : sizeof(buf);
+	errno = 0;
+	readcnt = pread(from_fd, buf, len, *offset);
+	if (readcnt < 0) {
+	    /* EINTR is the only OK error */
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    debug("bad read from %s: %s", from, strerror(errno));
+	    return COPY_FAIL;
+	} else if (readcnt == 0) {
+	    debug("empty read from %s", from);
+	    return COPY_FAIL;
+	}
+
+	/* write the same buffer */
+	errno = 0;
+	written = pwrite(to_fd, buf, readcnt, *offset);
+	if (written < 0) {
+	    debug("bad write to %s: %s", new_to, strerror(errno));
+	    return COPY_FAIL;
+	} else if (written != readcnt) {
+	    debug("wrote only %ld out of %ld to %s",
+		  (long)written, (long)readcnt, new_to);
+	    return COPY_FAIL;
+	}
+	*offset += written;
+    }
+    return COPY_DONE;
 }